@@ -48,6 +48,30 @@ static void fd_set_nb(int fd) {
 
 const size_t k_max_msg = 32 << 20;  // likely larger than the kernel buffer
 
+// a byte array consumed from the front in O(1),
+// the consumed space is reclaimed lazily when appending
+struct Buffer {
+    std::vector<uint8_t> data;
+    size_t head = 0;    // consumed up to
+};
+
+static size_t buf_size(const Buffer &buf) {
+    return buf.data.size() - buf.head;
+}
+
+static uint8_t *buf_data(Buffer &buf) {
+    return buf.data.data() + buf.head;
+}
+
+// drop the consumed space once it dominates the buffer,
+// so each byte is moved at most once on average
+static void buf_compact(Buffer &buf) {
+    if (buf.head > 0 && buf.head >= buf_size(buf)) {
+        buf.data.erase(buf.data.begin(), buf.data.begin() + buf.head);
+        buf.head = 0;
+    }
+}
+
 struct Conn {
     int fd = -1;
     // application's intention, for the event loop
@@ -55,19 +79,23 @@ struct Conn {
     bool want_write = false;
     bool want_close = false;
     // buffered input and output
-    std::vector<uint8_t> incoming;  // data to be parsed by the application
-    std::vector<uint8_t> outgoing;  // responses generated by the application
+    Buffer incoming;    // data to be parsed by the application
+    Buffer outgoing;    // responses generated by the application
 };
 
 // append to the back
-static void
-buf_append(std::vector<uint8_t> &buf, const uint8_t *data, size_t len) {
-    buf.insert(buf.end(), data, data + len);
+static void buf_append(Buffer &buf, const uint8_t *data, size_t len) {
+    buf_compact(buf);
+    buf.data.insert(buf.data.end(), data, data + len);
 }
 
 // remove from the front
-static void buf_consume(std::vector<uint8_t> &buf, size_t n) {
-    buf.erase(buf.begin(), buf.begin() + n);
+static void buf_consume(Buffer &buf, size_t n) {
+    buf.head += n;
+    if (buf.head == buf.data.size()) {
+        buf.data.clear();   // empty, rewind without moving anything
+        buf.head = 0;
+    }
 }
 
 // application callback when the listening socket is ready
@@ -99,21 +127,21 @@ static Conn *handle_accept(int fd) {
 // process 1 request if there is enough data
 static bool try_one_request(Conn *conn) {
     // try to parse the protocol: message header
-    if (conn->incoming.size() < 4) {
+    if (buf_size(conn->incoming) < 4) {
         return false;   // want read
     }
     uint32_t len = 0;
-    memcpy(&len, conn->incoming.data(), 4);
+    memcpy(&len, buf_data(conn->incoming), 4);
     if (len > k_max_msg) {
         msg("too long");
         conn->want_close = true;
         return false;   // want close
     }
     // message body
-    if (4 + len > conn->incoming.size()) {
+    if (4 + len > buf_size(conn->incoming)) {
         return false;   // want read
     }
-    const uint8_t *request = &conn->incoming[4];
+    const uint8_t *request = buf_data(conn->incoming) + 4;
 
     // got one request, do some application logic
     printf("client says: len:%d data:%.*s\n",
@@ -131,8 +159,9 @@ static bool try_one_request(Conn *conn) {
 
 // application callback when the socket is writable
 static void handle_write(Conn *conn) {
-    assert(conn->outgoing.size() > 0);
-    ssize_t rv = write(conn->fd, &conn->outgoing[0], conn->outgoing.size());
+    assert(buf_size(conn->outgoing) > 0);
+    ssize_t rv = write(
+        conn->fd, buf_data(conn->outgoing), buf_size(conn->outgoing));
     if (rv < 0 && errno == EAGAIN) {
         return; // actually not ready
     }
@@ -146,7 +175,7 @@ static void handle_write(Conn *conn) {
     buf_consume(conn->outgoing, (size_t)rv);
 
     // update the readiness intention
-    if (conn->outgoing.size() == 0) {   // all data written
+    if (buf_size(conn->outgoing) == 0) {    // all data written
         conn->want_read = true;
         conn->want_write = false;
     } // else: want write
@@ -168,7 +197,7 @@ static void handle_read(Conn *conn) {
     }
     // handle EOF
     if (rv == 0) {
-        if (conn->incoming.size() == 0) {
+        if (buf_size(conn->incoming) == 0) {
             msg("client closed");
         } else {
             msg("unexpected EOF");
@@ -184,7 +213,7 @@ static void handle_read(Conn *conn) {
     // Q: Why calling this in a loop? See the explanation of "pipelining".
 
     // update the readiness intention
-    if (conn->outgoing.size() > 0) {    // has a response
+    if (buf_size(conn->outgoing) > 0) { // has a response
         conn->want_read = false;
         conn->want_write = true;
         // The socket is likely ready to write in a request-response protocol,
@@ -0,0 +1,439 @@
+#include "aof.h"
+#include "mpsc.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <string>
+#include <thread>
+#include <vector>
+
+static void die(const char *msg) {
+  fprintf(stderr, "[%d] %s\n", errno, msg);
+  abort();
+}
+
+// a thread that appends, its flushes are numbered
+struct AofWriter {
+  uint64_t flushed = 0;            // the last flush
+  std::atomic<uint64_t> synced{0}; // the last flush on disk
+  int wake_fd = -1;                // signaled by the I/O thread
+};
+
+// the records a thread queued since its last flush
+struct AofChunk {
+  MNode node;
+  std::string main;    // for the live log
+  std::string rewrite; // for the compacted log
+  bool walked = false; // the last records of the sender for the rewrite
+  AofWriter *writer = NULL;
+  uint64_t seq = 0;    // of the flush
+  bool notify = false; // signal the writer once it's on disk
+};
+
+// rewrite once the log is this big, and twice its size after the last one
+const size_t k_rewrite_min = 64 << 20;
+
+static struct {
+  bool enabled = false;
+  std::string path;
+  int fsync = AOF_FSYNC_EVERYSEC;
+  uint32_t nwriters = 0;
+  size_t load_size = 0; // the valid part when opened
+  MQueue chunks;
+  int wake_fd = -1;
+  std::atomic<bool> rewrite_req{false};
+  std::atomic<uint64_t> rewrite_gen{0};  // the last rewrite started
+  std::atomic<uint64_t> rewrite_done{0}; // the last rewrite finished
+  // owned by the I/O thread
+  int fd = -1;
+  int tmp_fd = -1;   // the compacted log, while rewriting
+  uint32_t nwalked = 0;
+  size_t size = 0;
+  size_t base_size = 0; // the size after the last rewrite
+  bool dirty = false;   // written but not synced
+  uint64_t synced_ms = 0;
+} g_aof;
+
+static thread_local AofChunk *t_chunk = NULL;
+static thread_local AofWriter *t_writer = NULL; // lives as long as the process
+
+static void aof_loop();
+
+static uint64_t get_monotonic_msec() {
+  struct timespec tv = {0, 0};
+  clock_gettime(CLOCK_MONOTONIC, &tv);
+  return uint64_t(tv.tv_sec) * 1000 + tv.tv_nsec / 1000 / 1000;
+}
+
+static std::string tmp_path() { return g_aof.path + ".rewrite"; }
+
+// the length of the complete records at the start of the file
+static size_t valid_prefix(const uint8_t *data, size_t size) {
+  size_t pos = 0;
+  while (size - pos >= 4) {
+    uint32_t len = 0;
+    memcpy(&len, data + pos, 4);
+    if (len > size - pos - 4) {
+      break;
+    }
+    pos += 4 + len;
+  }
+  return pos;
+}
+
+bool aof_open(const char *path, int policy, uint32_t nwriters) {
+  g_aof.path = path;
+  g_aof.fsync = policy;
+  g_aof.nwriters = nwriters;
+  g_aof.fd = open(path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+  if (g_aof.fd < 0) {
+    return false;
+  }
+  struct stat st = {};
+  if (fstat(g_aof.fd, &st)) {
+    return false;
+  }
+
+  // a crash can leave half a record at the end
+  size_t size = (size_t)st.st_size;
+  if (size > 0) {
+    void *data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, g_aof.fd, 0);
+    if (data == MAP_FAILED) {
+      return false;
+    }
+    size_t valid = valid_prefix((const uint8_t *)data, size);
+    munmap(data, size);
+    if (valid < size) {
+      fprintf(stderr, "aof: dropping a torn record, %zu bytes\n",
+              size - valid);
+      if (ftruncate(g_aof.fd, (off_t)valid)) {
+        return false;
+      }
+      size = valid;
+    }
+  }
+  g_aof.load_size = g_aof.size = g_aof.base_size = size;
+  (void)unlink(tmp_path().c_str()); // left by an unfinished rewrite
+
+  g_aof.wake_fd = eventfd(0, EFD_CLOEXEC);
+  if (g_aof.wake_fd < 0) {
+    return false;
+  }
+  g_aof.enabled = true;
+  std::thread(aof_loop).detach();
+  return true;
+}
+
+bool aof_enabled() { return g_aof.enabled; }
+
+bool aof_load(void (*f)(const uint8_t *body, size_t len, void *arg),
+              void *arg) {
+  if (g_aof.load_size == 0) {
+    return true;
+  }
+  // the live log can be replaced by a rewrite meanwhile, the mapping of
+  // the old one stays valid
+  int fd = open(g_aof.path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return false;
+  }
+  size_t size = g_aof.load_size;
+  void *data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED) {
+    return false;
+  }
+  madvise(data, size, MADV_SEQUENTIAL);
+
+  const uint8_t *cur = (const uint8_t *)data;
+  const uint8_t *end = cur + valid_prefix(cur, size);
+  while (cur < end) {
+    uint32_t len = 0;
+    memcpy(&len, cur, 4);
+    f(cur + 4, len, arg);
+    cur += 4 + len;
+  }
+  munmap(data, size);
+  return true;
+}
+
+static void put_u32(std::string &s, uint32_t v) { s.append((char *)&v, 4); }
+
+// the same message format as a request
+static void encode(std::string &s, const std::string_view *args, size_t n) {
+  size_t len = 4;
+  for (size_t i = 0; i < n; i++) {
+    len += 4 + args[i].size();
+  }
+  put_u32(s, (uint32_t)len);
+  put_u32(s, (uint32_t)n);
+  for (size_t i = 0; i < n; i++) {
+    put_u32(s, (uint32_t)args[i].size());
+    s.append(args[i].data(), args[i].size());
+  }
+}
+
+static AofWriter *writer() {
+  if (!t_writer) {
+    t_writer = new AofWriter();
+  }
+  return t_writer;
+}
+
+void aof_append(const std::string_view *args, size_t n, uint32_t dest) {
+  if (!t_chunk) {
+    t_chunk = new AofChunk();
+  }
+  if (dest & AOF_MAIN) {
+    encode(t_chunk->main, args, n);
+  }
+  if (dest & AOF_REWRITE) {
+    encode(t_chunk->rewrite, args, n);
+  }
+}
+
+static void wake_io() {
+  uint64_t one = 1;
+  ssize_t rv = write(g_aof.wake_fd, &one, sizeof(one));
+  (void)rv; // only fails if the counter is saturated
+}
+
+void aof_flush() {
+  AofChunk *chunk = t_chunk;
+  if (!chunk) {
+    return;
+  }
+  t_chunk = NULL;
+
+  // not touched once pushed, the I/O thread frees it
+  chunk->writer = writer();
+  chunk->seq = ++chunk->writer->flushed;
+  if (mq_push(&g_aof.chunks, &chunk->node)) {
+    wake_io(); // the queue was empty, the I/O thread may be asleep
+  }
+}
+
+void aof_set_wake_fd(int fd) { writer()->wake_fd = fd; }
+
+uint64_t aof_ticket() {
+  if (g_aof.fsync != AOF_FSYNC_ALWAYS || !t_chunk || t_chunk->main.empty()) {
+    return 0;
+  }
+  t_chunk->notify = true;
+  return writer()->flushed + 1; // the next flush
+}
+
+uint64_t aof_synced() {
+  return writer()->synced.load(std::memory_order_acquire);
+}
+
+void aof_rewrite() {
+  g_aof.rewrite_req.store(true);
+  wake_io();
+}
+
+bool aof_rewrite_begun(uint64_t *gen) {
+  uint64_t cur = g_aof.rewrite_gen.load(std::memory_order_acquire);
+  if (cur == *gen) {
+    return false;
+  }
+  *gen = cur;
+  return true;
+}
+
+void aof_rewrite_walked() {
+  if (!t_chunk) {
+    t_chunk = new AofChunk();
+  }
+  t_chunk->walked = true;
+  aof_flush();
+}
+
+bool aof_rewrite_active(uint64_t gen) {
+  return g_aof.rewrite_done.load(std::memory_order_acquire) < gen;
+}
+
+// I/O thread from here on
+
+static void write_all(int fd, std::vector<struct iovec> &iov) {
+  size_t i = 0;
+  while (i < iov.size()) {
+    int n = (int)std::min(iov.size() - i, (size_t)IOV_MAX);
+    ssize_t rv = writev(fd, &iov[i], n);
+    if (rv < 0 && errno == EINTR) {
+      continue;
+    }
+    if (rv < 0) {
+      die("aof: writev()");
+    }
+    // skip what was written, partial writes are rare for files
+    size_t done = (size_t)rv;
+    while (i < iov.size() && done >= iov[i].iov_len) {
+      done -= iov[i].iov_len;
+      i++;
+    }
+    if (done) {
+      iov[i].iov_base = (uint8_t *)iov[i].iov_base + done;
+      iov[i].iov_len -= done;
+    }
+  }
+  iov.clear();
+}
+
+static void sync_fd(int fd) {
+  if (fdatasync(fd)) {
+    die("aof: fdatasync()");
+  }
+}
+
+static void rewrite_start() {
+  g_aof.tmp_fd = open(tmp_path().c_str(),
+                      O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC,
+                      0644);
+  if (g_aof.tmp_fd < 0) {
+    perror("aof: can't start a rewrite");
+    return;
+  }
+  g_aof.nwalked = 0;
+  // the writers see it from their loops, the file is ready before that
+  g_aof.rewrite_gen.fetch_add(1, std::memory_order_release);
+}
+
+// the compacted log is complete, it becomes the live one
+static void rewrite_finish() {
+  sync_fd(g_aof.tmp_fd);
+  if (rename(tmp_path().c_str(), g_aof.path.c_str())) {
+    die("aof: rename()");
+  }
+  // make the rename durable
+  size_t slash = g_aof.path.rfind('/');
+  std::string dir = slash == std::string::npos ? "." :
+                    g_aof.path.substr(0, slash + 1);
+  int dfd = open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (dfd >= 0) {
+    (void)fsync(dfd);
+    close(dfd);
+  }
+
+  close(g_aof.fd);
+  g_aof.fd = g_aof.tmp_fd;
+  g_aof.tmp_fd = -1;
+  struct stat st = {};
+  (void)fstat(g_aof.fd, &st);
+  g_aof.size = g_aof.base_size = (size_t)st.st_size;
+  g_aof.dirty = false;
+  g_aof.rewrite_done.store(g_aof.rewrite_gen.load(),
+                           std::memory_order_release);
+  fprintf(stderr, "aof: rewritten, %zu bytes\n", g_aof.size);
+}
+
+static void add_iov(std::vector<struct iovec> &iov, std::string &data) {
+  if (!data.empty()) {
+    iov.push_back({(void *)data.data(), data.size()});
+  }
+}
+
+// write a batch of chunks, each thread's records stay in order
+static void write_chunks(MNode *node, std::vector<AofChunk *> &done) {
+  std::vector<struct iovec> main, rewrite;
+  while (node) {
+    AofChunk *chunk = (AofChunk *)node; // the first member
+    node = node->next;
+    done.push_back(chunk);
+
+    add_iov(main, chunk->main);
+    g_aof.size += chunk->main.size();
+    g_aof.dirty |= !chunk->main.empty();
+    // after the switch, the records for the rewrite are in the live log
+    if (g_aof.tmp_fd >= 0) {
+      add_iov(rewrite, chunk->rewrite);
+    }
+    if (g_aof.tmp_fd >= 0 && chunk->walked &&
+        ++g_aof.nwalked == g_aof.nwriters) {
+      // switch in the middle of the batch, the rest goes to the new log
+      write_all(g_aof.fd, main);
+      write_all(g_aof.tmp_fd, rewrite);
+      rewrite_finish();
+    }
+  }
+  write_all(g_aof.fd, main);
+  if (g_aof.tmp_fd >= 0) {
+    write_all(g_aof.tmp_fd, rewrite);
+  }
+}
+
+static void aof_loop() {
+  std::vector<AofChunk *> done;
+  while (true) {
+    // wait for records, or for the next periodic fsync
+    int timeout_ms = -1;
+    if (g_aof.dirty && g_aof.fsync == AOF_FSYNC_EVERYSEC) {
+      uint64_t next_ms = g_aof.synced_ms + 1000;
+      uint64_t now_ms = get_monotonic_msec();
+      timeout_ms = next_ms > now_ms ? (int)(next_ms - now_ms) : 0;
+    }
+    struct pollfd pfd = {g_aof.wake_fd, POLLIN, 0};
+    int rv = poll(&pfd, 1, timeout_ms);
+    if (rv < 0 && errno != EINTR) {
+      die("aof: poll()");
+    }
+    if (rv > 0) {
+      // reset the eventfd before draining, so a push after this is not missed
+      uint64_t cnt = 0;
+      ssize_t err = read(g_aof.wake_fd, &cnt, sizeof(cnt));
+      (void)err;
+    }
+
+    if (g_aof.rewrite_req.exchange(false) && g_aof.tmp_fd < 0) {
+      rewrite_start();
+    }
+
+    // many commands from many threads per write() and fsync
+    write_chunks(mq_pop_all(&g_aof.chunks), done);
+
+    uint64_t now_ms = get_monotonic_msec();
+    bool sync = false;
+    if (g_aof.fsync == AOF_FSYNC_ALWAYS) {
+      sync = g_aof.dirty;
+    } else if (g_aof.fsync == AOF_FSYNC_EVERYSEC) {
+      sync = g_aof.dirty && now_ms >= g_aof.synced_ms + 1000;
+    }
+    if (sync) {
+      sync_fd(g_aof.fd);
+      g_aof.dirty = false;
+      g_aof.synced_ms = now_ms;
+    }
+
+    // group commit: the replies held by the writers for any of these
+    // chunks are released by the one fsync above
+    for (AofChunk *chunk : done) {
+      AofWriter *w = chunk->writer;
+      w->synced.store(chunk->seq, std::memory_order_release);
+      if (chunk->notify && w->wake_fd >= 0) {
+        uint64_t one = 1;
+        ssize_t err = write(w->wake_fd, &one, sizeof(one));
+        (void)err; // only fails if the counter is saturated
+      }
+      delete chunk;
+    }
+    done.clear();
+
+    // compact the log once it has grown enough
+    if (g_aof.tmp_fd < 0 && g_aof.size >= k_rewrite_min &&
+        g_aof.size >= 2 * g_aof.base_size) {
+      rewrite_start();
+    }
+  }
+}
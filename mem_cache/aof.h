@@ -0,0 +1,55 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string_view>
+
+// an append-only log of the mutating commands, in the request format;
+// the event loops queue records, an I/O thread writes them in batches
+
+// fsync policies
+enum {
+  AOF_FSYNC_ALWAYS = 0,   // on disk before the reply is sent
+  AOF_FSYNC_EVERYSEC = 1, // up to a second of writes can be lost
+  AOF_FSYNC_NO = 2,       // left to the OS
+};
+
+// where a record goes
+enum {
+  AOF_MAIN = 1,    // the live log
+  AOF_REWRITE = 2, // the compacted log being built
+};
+
+// drop a torn record at the end, and open the log for appending;
+// `nwriters` threads append to it, each takes part in a rewrite
+bool aof_open(const char *path, int policy, uint32_t nwriters);
+bool aof_enabled();
+// call `f` with the body of each record that was in the log when opened
+bool aof_load(void (*f)(const uint8_t *body, size_t len, void *arg),
+              void *arg);
+
+// queue a record on the calling thread
+void aof_append(const std::string_view *args, size_t n, uint32_t dest);
+// hand the queued records to the I/O thread, once per loop iteration;
+// the flushes of a thread are numbered from 1
+void aof_flush();
+
+// with the `always` policy, a reply waits until its change is on disk,
+// without blocking the thread: it's held until aof_synced() reaches the
+// ticket of the change, the I/O thread signals `fd` when it moves
+void aof_set_wake_fd(int fd);
+// the flush the records queued so far go out with, 0 if nothing waits
+uint64_t aof_ticket();
+// the last flush of the calling thread that's on disk
+uint64_t aof_synced();
+
+// compaction: the I/O thread starts a rewrite, then every writer puts its
+// keys in the compacted log as they were at that point, together with
+// the changes made after; the compacted log then replaces the live one
+void aof_rewrite();
+// true once per rewrite, when the writer should start walking its keys
+bool aof_rewrite_begun(uint64_t *gen);
+// the writer has walked all its keys
+void aof_rewrite_walked();
+// false once the compacted log has replaced the live one
+bool aof_rewrite_active(uint64_t gen);
@@ -0,0 +1,32 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// AVL tree node, should be embedded into the payload;
+// `cnt` is the size of the subtree, for rank and offset queries
+struct AVLNode {
+  AVLNode *parent = NULL;
+  AVLNode *left = NULL;
+  AVLNode *right = NULL;
+  uint32_t height = 0; // subtree height
+  uint32_t cnt = 0;    // subtree size
+};
+
+inline void avl_init(AVLNode *node) {
+  node->left = node->right = node->parent = NULL;
+  node->height = 1;
+  node->cnt = 1;
+}
+
+inline uint32_t avl_height(AVLNode *node) { return node ? node->height : 0; }
+inline uint32_t avl_cnt(AVLNode *node) { return node ? node->cnt : 0; }
+
+// both return the new root
+// fix the tree after the node was inserted as a leaf
+AVLNode *avl_fix(AVLNode *node);
+AVLNode *avl_del(AVLNode *node);
+// the node `offset` positions away in sorted order, NULL if out of range
+AVLNode *avl_offset(AVLNode *node, int64_t offset);
+// the position of the node in sorted order
+int64_t avl_rank(AVLNode *node);
@@ -0,0 +1,63 @@
+// microbenchmark: the old FNV-style hash vs str_hash across key sizes
+// g++ -std=c++17 -O2 bench_hash.cpp hash.cpp -o bench_hash
+#include <chrono>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <vector>
+// proj
+#include "hash.h"
+
+// the hash used before str_hash
+static uint64_t fnv_hash(const uint8_t *data, size_t len) {
+  uint32_t h = 0x811C9DC5;
+  for (size_t i = 0; i < len; i++) {
+    h = (h + data[i]) * 0x01000193;
+  }
+  return h;
+}
+
+// hashes `nkeys` keys of `len` bytes back to back, `rounds` times,
+// returns ns per hash
+static double bench(uint64_t (*hash)(const uint8_t *, size_t),
+                    const std::vector<uint8_t> &keys, size_t len,
+                    size_t nkeys, size_t rounds, uint64_t &sink) {
+  auto start = std::chrono::steady_clock::now();
+  for (size_t r = 0; r < rounds; r++) {
+    for (size_t i = 0; i < nkeys; i++) {
+      // the key depends on the last hash, so calls can't be batched
+      size_t k = (i + (sink & 1)) % nkeys;
+      sink += hash(&keys[k * len], len);
+    }
+  }
+  auto end = std::chrono::steady_clock::now();
+  double ns = std::chrono::duration<double, std::nano>(end - start).count();
+  return ns / (double)(rounds * nkeys);
+}
+
+int main() {
+  hash_init(0);
+
+  const size_t sizes[] = {4, 8, 16, 24, 32, 64, 128, 256, 1024, 4096};
+  const size_t k_total = 64 << 20; // bytes hashed per size and hash
+
+  printf("%8s %12s %12s %12s %12s\n", "len", "fnv ns", "fnv GB/s",
+         "str_hash ns", "str_hash GB/s");
+  uint64_t sink = 0;
+  for (size_t len : sizes) {
+    // enough keys to leave L1, not so many to leave L2
+    size_t nkeys = 256 * 1024 / len;
+    std::vector<uint8_t> keys(nkeys * len);
+    for (uint8_t &b : keys) {
+      b = (uint8_t)rand();
+    }
+    size_t rounds = k_total / (nkeys * len);
+
+    double fnv = bench(fnv_hash, keys, len, nkeys, rounds, sink);
+    double wy = bench(str_hash, keys, len, nkeys, rounds, sink);
+    printf("%8zu %12.2f %12.2f %12.2f %12.2f\n", len, fnv, len / fnv, wy,
+           len / wy);
+  }
+
+  return sink == 42; // keep the results alive
+}
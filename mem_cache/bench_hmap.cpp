@@ -0,0 +1,386 @@
+// microbenchmark: HMap inserts, hits, misses and deletes across table
+// sizes, ops/s with hardware counters per op, and per-op latencies,
+// including the ops that run while a rehash migrates the keys
+// g++ -std=c++17 -O2 bench_hmap.cpp hashtable.cpp hash.cpp hist.cpp
+//   reclaim.cpp slab.cpp mpsc.cpp -lpthread -o bench_hmap
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <x86intrin.h>
+#include <vector>
+// proj
+#include "hash.h"
+#include "hashtable.h"
+#include "hist.h"
+
+struct Item {
+  HNode node;
+  uint64_t key = 0;
+};
+
+static Item *item_of(HNode *node) { return (Item *)node; }
+
+static bool item_eq(HNode *lhs, HNode *rhs) {
+  return item_of(lhs)->key == item_of(rhs)->key;
+}
+
+static uint64_t key_hash(uint64_t key) {
+  return str_hash((const uint8_t *)&key, sizeof(key));
+}
+
+// xorshift64*, cheap enough not to show up in the results
+static uint64_t rng_next(uint64_t *state) {
+  uint64_t x = *state;
+  x ^= x >> 12;
+  x ^= x << 25;
+  x ^= x >> 27;
+  *state = x;
+  return x * 0x2545f4914f6cdd1dull;
+}
+
+static uint64_t gcd(uint64_t a, uint64_t b) {
+  while (b) {
+    uint64_t t = a % b;
+    a = b;
+    b = t;
+  }
+  return a;
+}
+
+// i -> i * step mod n visits 0..n-1 once each in a scattered order
+static uint64_t perm_step(uint64_t n) {
+  uint64_t step = 2654435761ull % n;
+  while (step == 0 || gcd(step, n) != 1) {
+    step++;
+  }
+  return step;
+}
+
+static uint64_t perm(uint64_t i, uint64_t step, uint64_t n) {
+  return (uint64_t)((unsigned __int128)i * step % n);
+}
+
+static uint64_t get_monotonic_nsec() {
+  struct timespec tv = {0, 0};
+  clock_gettime(CLOCK_MONOTONIC, &tv);
+  return uint64_t(tv.tv_sec) * 1000000000 + tv.tv_nsec;
+}
+
+// TSC ticks per ns, the per-op latencies are taken with rdtsc
+static double g_tsc_per_ns = 1;
+
+// rdtsc isn't ordered, without the fences an op's loads could still be
+// in flight when the clock is read
+static uint64_t tsc_read() {
+  _mm_lfence();
+  uint64_t tsc = __rdtsc();
+  _mm_lfence();
+  return tsc;
+}
+
+// the smallest step of the TSC, some VMs only update it every few ns
+static double tsc_resolution_ns() {
+  uint64_t least = UINT64_MAX;
+  for (int i = 0; i < 1000; i++) {
+    uint64_t t0 = __rdtsc();
+    uint64_t t1 = t0;
+    while (t1 == t0) {
+      t1 = __rdtsc();
+    }
+    least = t1 - t0 < least ? t1 - t0 : least;
+  }
+  return (double)least / g_tsc_per_ns;
+}
+
+static void tsc_calibrate() {
+  uint64_t t0 = get_monotonic_nsec();
+  uint64_t c0 = __rdtsc();
+  while (get_monotonic_nsec() - t0 < 50 * 1000000) {
+  }
+  uint64_t t1 = get_monotonic_nsec();
+  uint64_t c1 = __rdtsc();
+  g_tsc_per_ns = (double)(c1 - c0) / (double)(t1 - t0);
+}
+
+// hardware counters of this thread, the ones the CPU or VM doesn't have
+// are left out
+struct PerfEvent {
+  const char *name;
+  uint32_t type;
+  uint64_t config;
+};
+
+const uint64_t k_l1d_read_miss = PERF_COUNT_HW_CACHE_L1D |
+                                 (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                                 (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+const uint64_t k_dtlb_read_miss = PERF_COUNT_HW_CACHE_DTLB |
+                                  (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                                  (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+
+static const PerfEvent k_events[] = {
+    {"cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+    {"instrs", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+    {"L1D-miss", PERF_TYPE_HW_CACHE, k_l1d_read_miss},
+    {"LLC-miss", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES},
+    {"dTLB-miss", PERF_TYPE_HW_CACHE, k_dtlb_read_miss},
+};
+const size_t k_nevents = sizeof(k_events) / sizeof(k_events[0]);
+
+static int g_perf_fds[k_nevents];
+
+static void perf_init() {
+  for (size_t i = 0; i < k_nevents; i++) {
+    struct perf_event_attr attr = {};
+    attr.size = sizeof(attr);
+    attr.type = k_events[i].type;
+    attr.config = k_events[i].config;
+    attr.disabled = 1;
+    attr.exclude_kernel = 1; // allowed without privileges
+    attr.exclude_hv = 1;
+    // more events than counters are multiplexed, and scaled back up
+    attr.read_format =
+        PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+    g_perf_fds[i] = (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+    if (g_perf_fds[i] < 0) {
+      fprintf(stderr, "no %s counter: %s\n", k_events[i].name,
+              strerror(errno));
+    }
+  }
+}
+
+static void perf_start() {
+  for (int fd : g_perf_fds) {
+    if (fd >= 0) {
+      ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+      ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+    }
+  }
+}
+
+// the counts since perf_start(), -1 for the missing ones
+static void perf_stop(double (&counts)[k_nevents]) {
+  for (size_t i = 0; i < k_nevents; i++) {
+    counts[i] = -1;
+    int fd = g_perf_fds[i];
+    if (fd < 0) {
+      continue;
+    }
+    ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+    uint64_t vals[3] = {}; // value, time enabled, time running
+    if (read(fd, vals, sizeof(vals)) == (ssize_t)sizeof(vals) && vals[2]) {
+      counts[i] = (double)vals[0] * (double)vals[1] / (double)vals[2];
+    }
+  }
+}
+
+enum {
+  OP_INSERT = 0,
+  OP_HIT = 1,
+  OP_MISS = 2,
+  OP_DELETE = 3,
+};
+
+static const char *const k_op_names[] = {"insert", "hit", "miss", "delete"};
+
+// runs `nops` of an op on the table, untimed unless `lat` is given;
+// the inserts and deletes go through every item once
+struct Run {
+  HMap *hmap;
+  std::vector<Item> *items;
+  uint64_t step;     // of the insert/delete order
+  uint64_t rng = 1;
+  Hist *lat = NULL;  // all the timed ops
+  Hist *busy = NULL; // the timed ops that found a rehash going on
+  Hist *grow = NULL; // the timed inserts that started one
+};
+
+static void timed_add(Run *run, uint64_t ticks, bool busy, bool grow) {
+  uint64_t ns = (uint64_t)((double)ticks / g_tsc_per_ns);
+  hist_add(run->lat, ns);
+  if (busy && run->busy) {
+    hist_add(run->busy, ns);
+  }
+  if (grow) {
+    hist_add(run->grow, ns);
+  }
+}
+
+static uint64_t sink = 0;
+
+static void run_op(Run *run, int op, uint64_t nops) {
+  uint64_t n = run->items->size();
+  Item *items = run->items->data();
+  for (uint64_t i = 0; i < nops; i++) {
+    Item probe;
+    Item *item = NULL;
+    if (op == OP_INSERT || op == OP_DELETE) {
+      item = &items[perm(i, run->step, n)];
+      probe.key = item->key;
+    } else {
+      probe.key = rng_next(&run->rng) % n + (op == OP_MISS ? n : 0);
+    }
+
+    bool busy = hm_rehashing(run->hmap);
+    uint64_t t0 = run->lat ? tsc_read() : 0;
+    probe.node.hcode = key_hash(probe.key);
+    if (op == OP_INSERT) {
+      item->node.hcode = probe.node.hcode;
+      hm_insert(run->hmap, &item->node);
+    } else if (op == OP_DELETE) {
+      sink += hm_delete(run->hmap, &probe.node, &item_eq) != NULL;
+    } else {
+      sink += hm_lookup(run->hmap, &probe.node, &item_eq) != NULL;
+    }
+    if (run->lat) {
+      uint64_t ticks = tsc_read() - t0;
+      bool grow = !busy && hm_rehashing(run->hmap) && op == OP_INSERT;
+      timed_add(run, ticks, busy, grow);
+    }
+  }
+}
+
+// lookups per size, the keys repeat in small tables
+const uint64_t k_lookups = 2000000;
+
+static void print_header() {
+  printf("%-16s %8s %7s %7s %7s %7s %8s", "op", "Mops/s", "ns/op", "p50",
+         "p99", "p99.9", "max");
+  for (const PerfEvent &ev : k_events) {
+    printf(" %9s", ev.name);
+  }
+  printf("\n");
+}
+
+static void print_lat(const Hist *h) {
+  printf(" %7llu %7llu %7llu %8llu",
+         (unsigned long long)hist_quantile(h, 0.5),
+         (unsigned long long)hist_quantile(h, 0.99),
+         (unsigned long long)hist_quantile(h, 0.999),
+         (unsigned long long)h->max);
+}
+
+static void print_row(const char *name, uint64_t nops, uint64_t ns,
+                      const Hist *lat, const double (&counts)[k_nevents]) {
+  printf("%-16s %8.2f %7.1f", name, (double)nops * 1e3 / (double)ns,
+         (double)ns / (double)nops);
+  print_lat(lat);
+  for (double c : counts) {
+    if (c < 0) {
+      printf(" %9s", "-");
+    } else {
+      printf(" %9.2f", c / (double)nops);
+    }
+  }
+  printf("\n");
+}
+
+// a latency-only row, for the ops that ran during a rehash
+static void print_sub(const char *name, const Hist *lat) {
+  if (lat->total == 0) {
+    return;
+  }
+  char label[32];
+  snprintf(label, sizeof(label), " %s", name);
+  printf("%-16s %8s %7.1f", label, "-",
+         (double)lat->sum / (double)lat->total);
+  print_lat(lat);
+  printf("  (%llu ops)\n", (unsigned long long)lat->total);
+}
+
+static void bench_size(uint64_t n) {
+  std::vector<Item> items(n);
+  for (uint64_t i = 0; i < n; i++) {
+    items[i].key = i;
+  }
+  HMap hmap;
+  Run run;
+  run.hmap = &hmap;
+  run.items = &items;
+  run.step = perm_step(n);
+  uint64_t nlookups = n > k_lookups ? n : k_lookups;
+
+  // the untimed pass: throughput and counters
+  uint64_t nops[4] = {n, nlookups, nlookups, n};
+  uint64_t ns[4] = {};
+  double counts[4][k_nevents];
+  size_t slots = 0;
+  for (int op = OP_INSERT; op <= OP_DELETE; op++) {
+    perf_start();
+    uint64_t t0 = get_monotonic_nsec();
+    run_op(&run, op, nops[op]);
+    ns[op] = get_monotonic_nsec() - t0;
+    perf_stop(counts[op]);
+    if (op == OP_INSERT) {
+      slots = hmap.newer.mask + 1 + (hmap.older.ctrl ? hmap.older.mask + 1 : 0);
+    }
+  }
+  hm_clear(&hmap);
+
+  // the timed pass: latencies
+  Hist *lat = new Hist[4];
+  Hist *busy = new Hist[4];
+  Hist *grow = new Hist();
+  for (int op = OP_INSERT; op <= OP_DELETE; op++) {
+    run.lat = &lat[op];
+    run.busy = &busy[op];
+    run.grow = grow;
+    run_op(&run, op, nops[op]);
+  }
+  // lookups against 2 tables: a rehash to twice the size, then hits
+  // until it's done
+  for (uint64_t i = 0; i < n; i++) {
+    items[i].node.hcode = key_hash(items[i].key);
+    hm_insert(&hmap, &items[i].node);
+  }
+  while (hm_rehashing(&hmap)) {
+    hm_rehash(&hmap, 1000000000);
+  }
+  hm_reserve(&hmap, 2 * hm_size(&hmap));
+  Hist *hit_busy = new Hist();
+  run.lat = hit_busy;
+  run.busy = NULL;
+  while (hm_rehashing(&hmap)) {
+    run_op(&run, OP_HIT, 1);
+  }
+  hm_clear(&hmap);
+
+  printf("\n%llu keys, %zu slots, %.1f MB table\n", (unsigned long long)n,
+         slots, (double)slots * (sizeof(HNode *) + 1) / (1 << 20));
+  print_header();
+  for (int op = OP_INSERT; op <= OP_DELETE; op++) {
+    print_row(k_op_names[op], nops[op], ns[op], &lat[op], counts[op]);
+    if (op == OP_INSERT) {
+      print_sub("starts rehash", grow);
+    }
+    print_sub("in rehash", &busy[op]);
+    if (op == OP_HIT) {
+      print_sub("in 2x rehash", hit_busy);
+    }
+  }
+  delete[] lat;
+  delete[] busy;
+  delete grow;
+  delete hit_busy;
+}
+
+int main(int argc, char **argv) {
+  // the biggest table, 100M keys takes about 4 GB
+  uint64_t max = argc > 1 ? strtoull(argv[1], NULL, 10) : 10000000;
+
+  hash_init(0);
+  tsc_calibrate();
+  perf_init();
+  printf("latencies in ns with a %.1f ns timer, counters per op\n",
+         tsc_resolution_ns());
+  for (uint64_t n = 1000; n <= max; n *= 10) {
+    bench_size(n);
+  }
+  return sink == 42; // keep the results alive
+}
@@ -0,0 +1,583 @@
+// load generator: threads x connections, each with up to `depth` requests
+// in flight, a GET/SET mix over uniform or zipfian keys, in a closed loop
+// or at a fixed total rate, with latencies in an HdrHistogram-style histogram
+// g++ -std=c++17 -O2 bench_load.cpp kvclient.cpp hist.cpp buffer.cpp mpsc.cpp
+//   -lpthread -o bench_load
+#include <assert.h>
+#include <errno.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+#include <atomic>
+#include <charconv>
+#include <deque>
+#include <random>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+// proj
+#include "buffer.h"
+#include "hist.h"
+#include "kvclient.h"
+
+static void die(const char *msg) {
+  int err = errno;
+  fprintf(stderr, "[%d] %s\n", err, msg);
+  abort();
+}
+
+static uint64_t get_monotonic_nsec() {
+  struct timespec tv = {0, 0};
+  clock_gettime(CLOCK_MONOTONIC, &tv);
+  return uint64_t(tv.tv_sec) * 1000000000 + tv.tv_nsec;
+}
+
+struct Config {
+  const char *ip = "127.0.0.1";
+  uint16_t port = 1234;
+  uint32_t nthreads = 1;
+  uint32_t nconns = 4;   // per thread
+  uint32_t depth = 1;    // requests in flight per connection
+  uint64_t nkeys = 100000;
+  double zipf = 0;       // the exponent, 0 for uniform keys
+  uint32_t vsize = 32;
+  uint32_t sets = 1;     // sets:gets
+  uint32_t gets = 10;
+  uint64_t rate = 0;     // total requests/s, 0 for a closed loop
+  uint32_t secs = 10;
+  bool fill = false;     // set every key first
+  uint64_t seed = 1;
+};
+
+static Config g_cfg;
+
+// zipfian ranks with O(1) sampling, as in "Quickly Generating Billion-Record
+// Synthetic Databases" (Gray et al.), the rank is then scattered over the
+// keys so the popular ones aren't all next to each other
+struct Zipf {
+  double theta = 0;
+  double alpha = 0;
+  double zetan = 0;
+  double eta = 0;
+};
+
+static Zipf g_zipf;
+
+static double zeta(uint64_t n, double theta) {
+  double sum = 0;
+  for (uint64_t i = 1; i <= n; i++) {
+    sum += 1 / pow((double)i, theta);
+  }
+  return sum;
+}
+
+static void zipf_init(Zipf *z, uint64_t n, double theta) {
+  z->theta = theta;
+  z->alpha = 1 / (1 - theta);
+  z->zetan = zeta(n, theta);
+  z->eta = (1 - pow(2.0 / (double)n, 1 - theta)) /
+           (1 - zeta(2, theta) / z->zetan);
+}
+
+static uint64_t mix64(uint64_t x) {
+  x ^= x >> 30;
+  x *= 0xbf58476d1ce4e5b9ull;
+  x ^= x >> 27;
+  x *= 0x94d049bb133111ebull;
+  x ^= x >> 31;
+  return x;
+}
+
+static uint64_t pick_key(std::mt19937_64 &rng) {
+  uint64_t n = g_cfg.nkeys;
+  if (g_cfg.zipf == 0) {
+    return rng() % n;
+  }
+  double u = (double)(rng() >> 11) * 0x1.0p-53;
+  double uz = u * g_zipf.zetan;
+  uint64_t rank = 0;
+  if (uz < 1) {
+    rank = 0;
+  } else if (uz < 1 + pow(0.5, g_zipf.theta)) {
+    rank = 1;
+  } else {
+    rank = (uint64_t)((double)n * pow(g_zipf.eta * u - g_zipf.eta + 1,
+                                      g_zipf.alpha));
+  }
+  return mix64(rank) % n;
+}
+
+static std::string_view key_name(uint64_t key, char (&buf)[32]) {
+  memcpy(buf, "key:", 4);
+  char *end = std::to_chars(buf + 4, buf + sizeof(buf), key).ptr;
+  return std::string_view(buf, end - buf);
+}
+
+// a request in flight
+struct Op {
+  uint64_t start_ns = 0; // when it was sent, or due to be in an open loop
+  bool set = false;
+};
+
+struct LConn {
+  int fd = -1;
+  uint32_t events = 0;   // registered with epoll
+  RecvBuf incoming;
+  std::string outgoing;  // encoded, not written yet from `written`
+  size_t written = 0;
+  std::deque<Op> inflight;
+  uint64_t next_ns = 0;  // open loop: when the next request is due
+};
+
+struct Worker {
+  uint32_t id = 0;
+  std::mt19937_64 rng;
+  std::vector<LConn *> conns;
+  int epfd = -1;
+  int timer_fd = -1; // wakes the loop when the next request is due
+  std::string value;
+  // results
+  Hist get_lat;
+  Hist set_lat;
+  uint64_t hits = 0;
+  uint64_t errors = 0;
+};
+
+static int conn_open() {
+  int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd < 0) {
+    die("socket()");
+  }
+  struct sockaddr_in addr = {};
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(g_cfg.port);
+  if (inet_pton(AF_INET, g_cfg.ip, &addr.sin_addr) != 1) {
+    fprintf(stderr, "bad address %s\n", g_cfg.ip);
+    exit(1);
+  }
+  if (connect(fd, (const struct sockaddr *)&addr, sizeof(addr))) {
+    die("connect()");
+  }
+  int val = 1;
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &val, sizeof(val));
+  return fd;
+}
+
+static void write_all(int fd, const std::string &data) {
+  size_t off = 0;
+  while (off < data.size()) {
+    ssize_t rv = write(fd, data.data() + off, data.size() - off);
+    if (rv <= 0) {
+      die("write()");
+    }
+    off += (size_t)rv;
+  }
+}
+
+const size_t k_min_read = 64 * 1024;
+
+// the next complete reply of a blocking connection
+static KVVal read_reply(LConn *conn) {
+  while (true) {
+    size_t size = rbuf_size(&conn->incoming);
+    if (size >= 4) {
+      const uint8_t *data = rbuf_data(&conn->incoming);
+      uint32_t len = 0;
+      memcpy(&len, data, 4);
+      KVVal val;
+      if (size >= 4 + (size_t)len) {
+        if (kv_decode(data + 4, len, &val) != (int64_t)len) {
+          fprintf(stderr, "bad response\n");
+          exit(1);
+        }
+        rbuf_consume(&conn->incoming, 4 + len);
+        return val; // valid until the next read
+      }
+    }
+    size_t avail = 0;
+    uint8_t *space = rbuf_space(&conn->incoming, k_min_read, &avail);
+    ssize_t rv = read(conn->fd, space, avail);
+    if (rv <= 0) {
+      die("read()");
+    }
+    rbuf_commit(&conn->incoming, (size_t)rv);
+  }
+}
+
+// this worker's share of the keys, in pipelined MSETs
+static void prefill(Worker *w) {
+  const uint64_t k_batch = 100;
+  const uint32_t k_window = 16; // MSETs in flight
+  LConn *conn = w->conns[0];
+  uint64_t begin = g_cfg.nkeys * w->id / g_cfg.nthreads;
+  uint64_t end = g_cfg.nkeys * (w->id + 1) / g_cfg.nthreads;
+  uint32_t inflight = 0;
+  std::vector<std::string> names;
+  std::vector<std::string_view> cmd;
+  for (uint64_t start = begin; start < end; start += k_batch) {
+    names.clear();
+    cmd.assign(1, "mset");
+    for (uint64_t key = start; key < end && key < start + k_batch; key++) {
+      char buf[32];
+      names.emplace_back(key_name(key, buf));
+    }
+    for (const std::string &name : names) {
+      cmd.push_back(name);
+      cmd.push_back(w->value);
+    }
+    std::string req;
+    kv_encode(req, cmd);
+    write_all(conn->fd, req);
+    if (++inflight == k_window) {
+      read_reply(conn);
+      inflight--;
+    }
+  }
+  while (inflight-- > 0) {
+    read_reply(conn);
+  }
+}
+
+static void send_op(Worker *w, LConn *conn, uint64_t start_ns) {
+  Op op;
+  op.start_ns = start_ns;
+  op.set = w->rng() % (g_cfg.sets + g_cfg.gets) < g_cfg.sets;
+  char buf[32];
+  std::string_view key = key_name(pick_key(w->rng), buf);
+  if (op.set) {
+    kv_encode(conn->outgoing, {"set", key, w->value});
+  } else {
+    kv_encode(conn->outgoing, {"get", key});
+  }
+  conn->inflight.push_back(op);
+}
+
+static void conn_flush(Worker *w, LConn *conn) {
+  while (conn->written < conn->outgoing.size()) {
+    ssize_t rv = write(conn->fd, conn->outgoing.data() + conn->written,
+                       conn->outgoing.size() - conn->written);
+    if (rv < 0 && errno == EAGAIN) {
+      break;
+    }
+    if (rv <= 0) {
+      die("write()");
+    }
+    conn->written += (size_t)rv;
+  }
+  if (conn->written == conn->outgoing.size()) {
+    conn->outgoing.clear();
+    conn->written = 0;
+  }
+
+  // only wait for writable with something left to write
+  uint32_t events = EPOLLIN;
+  if (!conn->outgoing.empty()) {
+    events |= EPOLLOUT;
+  }
+  if (events != conn->events) {
+    struct epoll_event ev = {};
+    ev.events = events;
+    ev.data.ptr = conn;
+    int op = conn->events == 0 ? EPOLL_CTL_ADD : EPOLL_CTL_MOD;
+    if (epoll_ctl(w->epfd, op, conn->fd, &ev)) {
+      die("epoll_ctl()");
+    }
+    conn->events = events;
+  }
+}
+
+// the replies read so far, timed at `now`
+static void conn_replies(Worker *w, LConn *conn, uint64_t now, bool refill) {
+  while (rbuf_size(&conn->incoming) >= 4) {
+    const uint8_t *data = rbuf_data(&conn->incoming);
+    uint32_t len = 0;
+    memcpy(&len, data, 4);
+    if (rbuf_size(&conn->incoming) < 4 + (size_t)len) {
+      break;
+    }
+    KVVal val;
+    if (conn->inflight.empty() ||
+        kv_decode(data + 4, len, &val) != (int64_t)len) {
+      fprintf(stderr, "bad response\n");
+      exit(1);
+    }
+
+    Op op = conn->inflight.front();
+    conn->inflight.pop_front();
+    uint64_t lat = now > op.start_ns ? now - op.start_ns : 0;
+    hist_add(op.set ? &w->set_lat : &w->get_lat, lat);
+    if (kv_tag(val) == KV_ERR) {
+      w->errors++;
+    } else if (!op.set && kv_tag(val) == KV_STR) {
+      w->hits++;
+    }
+    rbuf_consume(&conn->incoming, 4 + len);
+
+    if (refill) {
+      send_op(w, conn, now); // a closed loop keeps `depth` in flight
+    }
+  }
+}
+
+static void conn_read(Worker *w, LConn *conn, bool refill) {
+  while (true) {
+    size_t avail = 0;
+    uint8_t *space = rbuf_space(&conn->incoming, k_min_read, &avail);
+    ssize_t rv = read(conn->fd, space, avail);
+    if (rv < 0 && errno == EAGAIN) {
+      return;
+    }
+    if (rv <= 0) {
+      die("read()");
+    }
+    rbuf_commit(&conn->incoming, (size_t)rv);
+    conn_replies(w, conn, get_monotonic_nsec(), refill);
+    if ((size_t)rv < avail) {
+      return;
+    }
+  }
+}
+
+static std::atomic<uint32_t> g_ready{0};
+static std::atomic<uint64_t> g_start_ns{0};
+
+const int k_max_events = 64;
+
+static void worker_run(Worker *w) {
+  w->rng.seed(g_cfg.seed * 1000003 + w->id);
+  w->value.assign(g_cfg.vsize, 'x');
+  w->epfd = epoll_create1(EPOLL_CLOEXEC);
+  w->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  if (w->epfd < 0 || w->timer_fd < 0) {
+    die("epoll_create1()");
+  }
+  struct epoll_event ev = {};
+  ev.events = EPOLLIN;
+  ev.data.ptr = NULL;
+  if (epoll_ctl(w->epfd, EPOLL_CTL_ADD, w->timer_fd, &ev)) {
+    die("epoll_ctl()");
+  }
+  for (uint32_t i = 0; i < g_cfg.nconns; i++) {
+    LConn *conn = new LConn();
+    conn->fd = conn_open();
+    w->conns.push_back(conn);
+  }
+  if (g_cfg.fill) {
+    prefill(w);
+  }
+  for (LConn *conn : w->conns) {
+    fcntl(conn->fd, F_SETFL, fcntl(conn->fd, F_GETFL, 0) | O_NONBLOCK);
+  }
+
+  // everyone starts together
+  g_ready.fetch_add(1);
+  uint64_t start = 0;
+  while ((start = g_start_ns.load()) == 0) {
+    std::this_thread::yield();
+  }
+  uint64_t end = start + g_cfg.secs * 1000000000ull;
+
+  bool open_loop = g_cfg.rate > 0;
+  uint64_t interval = 0; // per connection, in an open loop
+  if (open_loop) {
+    uint64_t total = (uint64_t)g_cfg.nthreads * g_cfg.nconns;
+    interval = 1000000000ull * total / g_cfg.rate;
+    interval = interval ? interval : 1;
+  }
+  for (LConn *conn : w->conns) {
+    if (open_loop) {
+      conn->next_ns = start + w->rng() % interval; // spread out the phases
+    } else {
+      for (uint32_t i = 0; i < g_cfg.depth; i++) {
+        send_op(w, conn, start);
+      }
+    }
+    conn_flush(w, conn);
+  }
+
+  struct epoll_event events[k_max_events];
+  while (true) {
+    uint64_t now = get_monotonic_nsec();
+    if (now >= end) {
+      break;
+    }
+    // an open loop sends what's due, a request that waits for a free slot
+    // is still timed from when it was due
+    uint64_t wake = end;
+    if (open_loop) {
+      for (LConn *conn : w->conns) {
+        while (conn->next_ns <= now && conn->inflight.size() < g_cfg.depth) {
+          send_op(w, conn, conn->next_ns);
+          conn->next_ns += interval;
+        }
+        conn_flush(w, conn);
+        if (conn->inflight.size() < g_cfg.depth && conn->next_ns < wake) {
+          wake = conn->next_ns;
+        }
+      }
+    }
+
+    // epoll_wait() only has ms timeouts, too coarse for the schedule
+    struct itimerspec its = {};
+    its.it_value.tv_sec = (time_t)(wake / 1000000000);
+    its.it_value.tv_nsec = (long)(wake % 1000000000);
+    if (timerfd_settime(w->timer_fd, TFD_TIMER_ABSTIME, &its, NULL)) {
+      die("timerfd_settime()");
+    }
+    int n = epoll_wait(w->epfd, events, k_max_events, -1);
+    if (n < 0 && errno != EINTR) {
+      die("epoll_wait()");
+    }
+    for (int i = 0; i < n; i++) {
+      LConn *conn = (LConn *)events[i].data.ptr;
+      if (!conn) {
+        uint64_t expired = 0;
+        ssize_t rv = read(w->timer_fd, &expired, sizeof(expired));
+        (void)rv; // disarmed again in the meantime is fine too
+        continue;
+      }
+      if (events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP)) {
+        conn_read(w, conn, !open_loop);
+      }
+      conn_flush(w, conn);
+    }
+  }
+
+  for (LConn *conn : w->conns) {
+    close(conn->fd);
+    delete conn;
+  }
+  close(w->timer_fd);
+  close(w->epfd);
+}
+
+static void print_lat(const char *name, const Hist *h) {
+  printf("%-4s %10.1f %10.1f %10.1f %10.1f %10.1f\n", name,
+         h->total ? (double)h->sum / (double)h->total / 1e3 : 0.0,
+         (double)hist_quantile(h, 0.5) / 1e3,
+         (double)hist_quantile(h, 0.99) / 1e3,
+         (double)hist_quantile(h, 0.999) / 1e3, (double)h->max / 1e3);
+}
+
+static void usage(const char *argv0) {
+  fprintf(stderr,
+          "usage: %s [-h ip] [-p port] [-t threads] [-c conns/thread]\n"
+          "  [-d depth] [-n keys] [-z zipf exponent in (0, 1), 0: uniform]\n"
+          "  [-v value bytes] [-r sets:gets] [-R total req/s, 0: closed loop]\n"
+          "  [-T secs] [-f (set every key first)] [-s seed]\n",
+          argv0);
+  exit(1);
+}
+
+int main(int argc, char **argv) {
+  for (int i = 1; i < argc; i++) {
+    bool arg = i + 1 < argc;
+    if (!strcmp(argv[i], "-h") && arg) {
+      g_cfg.ip = argv[++i];
+    } else if (!strcmp(argv[i], "-p") && arg) {
+      g_cfg.port = (uint16_t)atoi(argv[++i]);
+    } else if (!strcmp(argv[i], "-t") && arg) {
+      g_cfg.nthreads = (uint32_t)atoi(argv[++i]);
+    } else if (!strcmp(argv[i], "-c") && arg) {
+      g_cfg.nconns = (uint32_t)atoi(argv[++i]);
+    } else if (!strcmp(argv[i], "-d") && arg) {
+      g_cfg.depth = (uint32_t)atoi(argv[++i]);
+    } else if (!strcmp(argv[i], "-n") && arg) {
+      g_cfg.nkeys = strtoull(argv[++i], NULL, 10);
+    } else if (!strcmp(argv[i], "-z") && arg) {
+      g_cfg.zipf = atof(argv[++i]);
+    } else if (!strcmp(argv[i], "-v") && arg) {
+      g_cfg.vsize = (uint32_t)atoi(argv[++i]);
+    } else if (!strcmp(argv[i], "-r") && arg) {
+      if (sscanf(argv[++i], "%u:%u", &g_cfg.sets, &g_cfg.gets) != 2) {
+        usage(argv[0]);
+      }
+    } else if (!strcmp(argv[i], "-R") && arg) {
+      g_cfg.rate = strtoull(argv[++i], NULL, 10);
+    } else if (!strcmp(argv[i], "-T") && arg) {
+      g_cfg.secs = (uint32_t)atoi(argv[++i]);
+    } else if (!strcmp(argv[i], "-f")) {
+      g_cfg.fill = true;
+    } else if (!strcmp(argv[i], "-s") && arg) {
+      g_cfg.seed = strtoull(argv[++i], NULL, 10);
+    } else {
+      usage(argv[0]);
+    }
+  }
+  if (!g_cfg.nthreads || !g_cfg.nconns || !g_cfg.depth || !g_cfg.nkeys ||
+      g_cfg.sets + g_cfg.gets == 0 || g_cfg.zipf < 0 || g_cfg.zipf >= 1) {
+    usage(argv[0]);
+  }
+  if (g_cfg.zipf > 0) {
+    zipf_init(&g_zipf, g_cfg.nkeys, g_cfg.zipf);
+  }
+
+  printf("%u threads x %u conns, depth %u, %llu keys %s %.2f, "
+         "%u B values, sets:gets %u:%u, %s, %u s, seed %llu\n",
+         g_cfg.nthreads, g_cfg.nconns, g_cfg.depth,
+         (unsigned long long)g_cfg.nkeys, g_cfg.zipf > 0 ? "zipf" : "uniform",
+         g_cfg.zipf, g_cfg.vsize, g_cfg.sets, g_cfg.gets,
+         g_cfg.rate ? "open loop" : "closed loop", g_cfg.secs,
+         (unsigned long long)g_cfg.seed);
+  if (g_cfg.rate) {
+    printf("target %llu req/s\n", (unsigned long long)g_cfg.rate);
+  }
+
+  std::vector<Worker *> workers;
+  std::vector<std::thread> threads;
+  for (uint32_t i = 0; i < g_cfg.nthreads; i++) {
+    Worker *w = new Worker();
+    w->id = i;
+    workers.push_back(w);
+    threads.emplace_back(worker_run, w);
+  }
+  while (g_ready.load() < g_cfg.nthreads) {
+    usleep(1000);
+  }
+  g_start_ns.store(get_monotonic_nsec());
+  for (std::thread &t : threads) {
+    t.join();
+  }
+
+  Hist *get_lat = new Hist();
+  Hist *set_lat = new Hist();
+  Hist *all_lat = new Hist();
+  uint64_t hits = 0;
+  uint64_t errors = 0;
+  for (Worker *w : workers) {
+    hist_merge(get_lat, &w->get_lat);
+    hist_merge(set_lat, &w->set_lat);
+    hits += w->hits;
+    errors += w->errors;
+    delete w;
+  }
+  hist_merge(all_lat, get_lat);
+  hist_merge(all_lat, set_lat);
+
+  double secs = (double)g_cfg.secs;
+  printf("%.0f req/s (get %.0f, set %.0f), get hits %.1f%%, errors %llu\n",
+         (double)all_lat->total / secs, (double)get_lat->total / secs,
+         (double)set_lat->total / secs,
+         get_lat->total ? 100.0 * (double)hits / (double)get_lat->total : 0.0,
+         (unsigned long long)errors);
+  printf("usec       mean        p50        p99      p99.9        max\n");
+  print_lat("get", get_lat);
+  print_lat("set", set_lat);
+  print_lat("all", all_lat);
+  delete get_lat;
+  delete set_lat;
+  delete all_lat;
+  return 0;
+}
@@ -0,0 +1,298 @@
+#include "buffer.h"
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+static void die_oom() { abort(); }
+
+static uint8_t *chunk_data(BufChunk *c) { return (uint8_t *)(c + 1); }
+
+// standard chunks are 16K including the header, bigger ones are
+// only allocated for appends that don't fit in a standard chunk
+const uint32_t k_chunk_cap = 16 * 1024 - sizeof(BufChunk);
+
+// recently freed standard chunks, so a busy connection doesn't hit malloc
+// and an idle connection doesn't hold any memory
+const size_t k_max_free_chunks = 64;
+
+static thread_local struct {
+  BufChunk *list = NULL;
+  size_t size = 0;
+} t_free_chunks;
+
+static BufChunk *chunk_new(size_t min_cap) {
+  BufChunk *c = NULL;
+  if (min_cap <= k_chunk_cap && t_free_chunks.list) {
+    c = t_free_chunks.list;
+    t_free_chunks.list = c->next;
+    t_free_chunks.size--;
+  } else {
+    uint32_t cap = min_cap <= k_chunk_cap ? k_chunk_cap : (uint32_t)min_cap;
+    c = (BufChunk *)malloc(sizeof(BufChunk) + cap);
+    if (!c) {
+      die_oom();
+    }
+    c->cap = cap;
+  }
+  c->prev = c->next = NULL;
+  c->head = c->tail = 0;
+  return c;
+}
+
+static void chunk_del(BufChunk *c) {
+  if (c->cap == k_chunk_cap && t_free_chunks.size < k_max_free_chunks) {
+    c->next = t_free_chunks.list;
+    t_free_chunks.list = c;
+    t_free_chunks.size++;
+  } else {
+    free(c);
+  }
+}
+
+Buffer::~Buffer() { buf_clear(this); }
+
+size_t buf_size(const Buffer *buf) { return buf->size; }
+
+void buf_append(Buffer *buf, const void *data, size_t len) {
+  const uint8_t *src = (const uint8_t *)data;
+  while (len > 0) {
+    BufChunk *c = buf->last;
+    if (!c || c->tail == c->cap) {
+      // the tail is full, link a new chunk
+      c = chunk_new(len);
+      c->prev = buf->last;
+      if (buf->last) {
+        buf->last->next = c;
+      } else {
+        buf->first = c;
+      }
+      buf->last = c;
+    }
+
+    size_t n = c->cap - c->tail;
+    if (n > len) {
+      n = len;
+    }
+    memcpy(chunk_data(c) + c->tail, src, n);
+    c->tail += (uint32_t)n;
+    buf->size += n;
+    src += n;
+    len -= n;
+  }
+}
+
+// find the chunk containing `pos`, searching from the back since
+// the bytes being patched are usually the most recent ones
+static BufChunk *chunk_at(const Buffer *buf, size_t pos, size_t *off) {
+  assert(pos < buf->size);
+  size_t end = buf->size;
+  for (BufChunk *c = buf->last; c; c = c->prev) {
+    size_t start = end - (c->tail - c->head);
+    if (pos >= start) {
+      *off = c->head + (pos - start);
+      return c;
+    }
+    end = start;
+  }
+  assert(!"unreachable");
+  return NULL;
+}
+
+// overwrite bytes that are already in the buffer
+void buf_patch(Buffer *buf, size_t pos, const void *data, size_t len) {
+  assert(pos + len <= buf->size);
+  if (len == 0) {
+    return;
+  }
+
+  const uint8_t *src = (const uint8_t *)data;
+  size_t off = 0;
+  for (BufChunk *c = chunk_at(buf, pos, &off); len > 0; c = c->next) {
+    size_t n = c->tail - off;
+    if (n > len) {
+      n = len;
+    }
+    memcpy(chunk_data(c) + off, src, n);
+    src += n;
+    len -= n;
+    off = c->next ? c->next->head : 0;
+  }
+}
+
+// copy out bytes without consuming them
+void buf_peek(const Buffer *buf, size_t pos, void *out, size_t len) {
+  assert(pos + len <= buf->size);
+  if (len == 0) {
+    return;
+  }
+
+  uint8_t *dst = (uint8_t *)out;
+  size_t off = 0;
+  for (BufChunk *c = chunk_at(buf, pos, &off); len > 0; c = c->next) {
+    size_t n = c->tail - off;
+    if (n > len) {
+      n = len;
+    }
+    memcpy(dst, chunk_data(c) + off, n);
+    dst += n;
+    len -= n;
+    off = c->next ? c->next->head : 0;
+  }
+}
+
+// drop bytes from the back
+void buf_truncate(Buffer *buf, size_t size) {
+  while (buf->size > size) {
+    BufChunk *c = buf->last;
+    size_t n = c->tail - c->head;
+    if (buf->size - n >= size) {
+      // drop the whole chunk
+      buf->last = c->prev;
+      if (buf->last) {
+        buf->last->next = NULL;
+      } else {
+        buf->first = NULL;
+      }
+      buf->size -= n;
+      chunk_del(c);
+    } else {
+      c->tail -= (uint32_t)(buf->size - size);
+      buf->size = size;
+    }
+  }
+}
+
+// remove from the front
+void buf_consume(Buffer *buf, size_t n) {
+  assert(n <= buf->size);
+  buf->size -= n;
+  while (n > 0) {
+    BufChunk *c = buf->first;
+    size_t avail = c->tail - c->head;
+    if (n < avail) {
+      c->head += (uint32_t)n;
+      break;
+    }
+
+    // the whole chunk is consumed
+    n -= avail;
+    buf->first = c->next;
+    if (buf->first) {
+      buf->first->prev = NULL;
+    } else {
+      buf->last = NULL;
+    }
+    chunk_del(c);
+  }
+
+  // keep the last chunk for appending, unless it's fully consumed
+  if (buf->size == 0 && buf->first) {
+    buf_clear(buf);
+  }
+}
+
+// move everything from `src` to the back of `dst` without copying
+void buf_splice(Buffer *dst, Buffer *src) {
+  if (!src->first) {
+    return;
+  }
+
+  if (dst->last) {
+    dst->last->next = src->first;
+    src->first->prev = dst->last;
+  } else {
+    dst->first = src->first;
+  }
+  dst->last = src->last;
+  dst->size += src->size;
+
+  src->first = src->last = NULL;
+  src->size = 0;
+}
+
+void buf_clear(Buffer *buf) {
+  BufChunk *c = buf->first;
+  while (c) {
+    BufChunk *next = c->next;
+    chunk_del(c);
+    c = next;
+  }
+  buf->first = buf->last = NULL;
+  buf->size = 0;
+}
+
+// fill an iovec for writing from the front, returns the no of entries
+size_t buf_iov(const Buffer *buf, struct iovec *iov, size_t max_iov) {
+  size_t n = 0;
+  for (BufChunk *c = buf->first; c && n < max_iov; c = c->next) {
+    if (c->tail == c->head) {
+      continue;
+    }
+    iov[n].iov_base = chunk_data(c) + c->head;
+    iov[n].iov_len = c->tail - c->head;
+    n++;
+  }
+  return n;
+}
+
+RecvBuf::~RecvBuf() { free(data); }
+
+// returns the free space at the back, at least `min_free` bytes,
+// the data is moved to the front first if that makes enough room
+uint8_t *rbuf_space(RecvBuf *buf, size_t min_free, size_t *avail) {
+  if (buf->cap - buf->tail < min_free) {
+    size_t size = rbuf_size(buf);
+    if (buf->head > 0) {
+      // only the unparsed remainder is moved, usually a partial message
+      memmove(buf->data, buf->data + buf->head, size);
+      buf->head = 0;
+      buf->tail = size;
+    }
+
+    if (buf->cap - buf->tail < min_free) {
+      size_t cap = buf->cap ? buf->cap * 2 : min_free;
+      if (cap < size + min_free) {
+        cap = size + min_free;
+      }
+      uint8_t *data = (uint8_t *)realloc(buf->data, cap);
+      if (!data) {
+        die_oom();
+      }
+      buf->data = data;
+      buf->cap = cap;
+    }
+  }
+
+  *avail = buf->cap - buf->tail;
+  return buf->data + buf->tail;
+}
+
+// the free space returned by `rbuf_space()` has been filled with `n` bytes
+void rbuf_commit(RecvBuf *buf, size_t n) {
+  assert(buf->tail + n <= buf->cap);
+  buf->tail += n;
+}
+
+void rbuf_append(RecvBuf *buf, const uint8_t *data, size_t len) {
+  size_t avail = 0;
+  memcpy(rbuf_space(buf, len, &avail), data, len);
+  rbuf_commit(buf, len);
+}
+
+// buffers larger than this are released once drained
+const size_t k_max_idle_cap = 1 << 20;
+
+// remove from the front
+void rbuf_consume(RecvBuf *buf, size_t n) {
+  assert(n <= rbuf_size(buf));
+  buf->head += n;
+  if (buf->head == buf->tail) {
+    // empty, rewind without moving anything
+    buf->head = buf->tail = 0;
+    if (buf->cap > k_max_idle_cap) {
+      free(buf->data);
+      buf->data = NULL;
+      buf->cap = 0;
+    }
+  }
+}
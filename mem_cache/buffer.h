@@ -0,0 +1,62 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/uio.h>
+
+// a piece of a `Buffer`, the payload follows the header
+struct BufChunk {
+  BufChunk *prev = NULL;
+  BufChunk *next = NULL;
+  uint32_t cap = 0;  // payload capacity
+  uint32_t head = 0; // consumed from the front up to
+  uint32_t tail = 0; // filled up to
+};
+
+// output buffer made of a list of chunks,
+// appending never moves existing data, consuming from the front is O(1),
+// and the chunks can be written with a single `writev()`
+struct Buffer {
+  BufChunk *first = NULL;
+  BufChunk *last = NULL;
+  size_t size = 0; // no of bytes
+
+  Buffer() = default;
+  Buffer(const Buffer &) = delete;
+  Buffer &operator=(const Buffer &) = delete;
+  ~Buffer();
+};
+
+size_t buf_size(const Buffer *buf);
+void buf_append(Buffer *buf, const void *data, size_t len);
+void buf_patch(Buffer *buf, size_t pos, const void *data, size_t len);
+void buf_peek(const Buffer *buf, size_t pos, void *out, size_t len);
+void buf_truncate(Buffer *buf, size_t size);
+void buf_consume(Buffer *buf, size_t n);
+void buf_splice(Buffer *dst, Buffer *src);
+void buf_clear(Buffer *buf);
+size_t buf_iov(const Buffer *buf, struct iovec *iov, size_t max_iov);
+
+// input buffer, a contiguous byte array consumed from the front,
+// so a parsed message can be referenced in place
+struct RecvBuf {
+  uint8_t *data = NULL;
+  size_t cap = 0;
+  size_t head = 0; // consumed from the front up to
+  size_t tail = 0; // filled up to
+
+  RecvBuf() = default;
+  RecvBuf(const RecvBuf &) = delete;
+  RecvBuf &operator=(const RecvBuf &) = delete;
+  ~RecvBuf();
+};
+
+inline size_t rbuf_size(const RecvBuf *buf) { return buf->tail - buf->head; }
+inline const uint8_t *rbuf_data(const RecvBuf *buf) {
+  return buf->data + buf->head;
+}
+
+uint8_t *rbuf_space(RecvBuf *buf, size_t min_free, size_t *avail);
+void rbuf_commit(RecvBuf *buf, size_t n);
+void rbuf_append(RecvBuf *buf, const uint8_t *data, size_t len);
+void rbuf_consume(RecvBuf *buf, size_t n);
@@ -1,15 +1,13 @@
-#include <assert.h>
+// a one-shot CLI over the client library
+// g++ -std=c++17 -O2 client.cpp kvclient.cpp buffer.cpp mpsc.cpp -lpthread
 #include <errno.h>
-#include <netinet/ip.h>
-#include <arpa/inet.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
-#include <string.h>
-#include <string>
-#include <sys/socket.h>
-#include <unistd.h>
+#include <string_view>
 #include <vector>
+// proj
+#include "kvclient.h"
 
 static void msg(const char *msg) { fprintf(stderr, "%s\n", msg); }
 
@@ -19,221 +17,58 @@ static void die(const char *msg) {
   abort();
 }
 
-static int32_t read_full(int fd, char *buf, size_t n) {
-  while (n > 0) {
-    ssize_t rv = read(fd, buf, n);
-    if (rv <= 0) {
-      return -1; // error, or unexpected EOF
-    }
-    assert((size_t)rv <= n);
-    n -= (size_t)rv;
-    buf += rv;
-  }
-  return 0;
-}
-
-static int32_t write_all(int fd, const char *buf, size_t n) {
-  while (n > 0) {
-    ssize_t rv = write(fd, buf, n);
-    if (rv <= 0) {
-      return -1; // error
-    }
-    assert((size_t)rv <= n);
-    n -= (size_t)rv;
-    buf += rv;
-  }
-  return 0;
-}
-
-const size_t k_max_msg = 4096;
-
-static int32_t send_req(int fd, const std::vector<std::string> &cmd) {
-  uint32_t len = 4;
-  for (const std::string &s : cmd) {
-    len += 4 + s.size();
-  }
-  if (len > k_max_msg) {
-    return -1;
-  }
-
-  char wbuf[4 + k_max_msg];
-  memcpy(&wbuf[0], &len, 4); // assume little endian
-  uint32_t n = (uint32_t)cmd.size();
-  memcpy(&wbuf[4], &n, 4);
-  size_t cur = 8;
-  for (const std::string &s : cmd) {
-    uint32_t p = (uint32_t)s.size();
-    memcpy(&wbuf[cur], &p, 4);
-    memcpy(&wbuf[cur + 4], s.data(), s.size());
-    cur += 4 + s.size();
-  }
-  return write_all(fd, wbuf, 4 + len);
-}
-
-enum {
-  TAG_NIL = 0, // nil
-  TAG_ERR = 1, // error code + msg
-  TAG_STR = 2, // string
-  TAG_INT = 3, // int64
-  TAG_DBL = 4, // double
-  TAG_ARR = 5, // array
-};
-
-static int32_t print_response(const uint8_t *data, size_t size) {
-  if (size < 1) {
-    msg("bad response");
-    return -1;
-  }
-  switch (data[0]) {
-  case TAG_NIL:
+static void print_response(KVVal val) {
+  switch (kv_tag(val)) {
+  case KV_NIL:
     printf("(nil)\n");
-    return 1;
-  case TAG_ERR:
-    if (size < 1 + 8) {
-      msg("bad response");
-      return -1;
-    }
-    {
-      int32_t code = 0;
-      uint32_t len = 0;
-      memcpy(&code, &data[1], 4);
-      memcpy(&len, &data[1 + 4], 4);
-      if (size < 1 + 8 + len) {
-        msg("bad response");
-        return -1;
-      }
-      printf("(err) %d %.*s\n", code, len, &data[1 + 8]);
-      return 1 + 8 + len;
+    break;
+  case KV_ERR: {
+    std::string_view err = kv_str(val);
+    printf("(err) %d %.*s\n", kv_err_code(val), (int)err.size(), err.data());
+    break;
+  }
+  case KV_STR: {
+    std::string_view str = kv_str(val);
+    printf("(str) %.*s\n", (int)str.size(), str.data());
+    break;
+  }
+  case KV_INT:
+    printf("(int) %ld\n", kv_int(val));
+    break;
+  case KV_DBL:
+    printf("(dbl) %g\n", kv_dbl(val));
+    break;
+  case KV_ARR: {
+    printf("(arr) len=%u\n", kv_arr_len(val));
+    KVIter it = kv_iter(val);
+    KVVal elem;
+    while (kv_next(&it, &elem)) {
+      print_response(elem);
     }
-  case TAG_STR:
-    if (size < 1 + 4) {
-      msg("bad response");
-      return -1;
-    }
-    {
-      uint32_t len = 0;
-      memcpy(&len, &data[1], 4);
-      if (size < 1 + 4 + len) {
-        msg("bad response");
-        return -1;
-      }
-      printf("(str) %.*s\n", len, &data[1 + 4]);
-      return 1 + 4 + len;
-    }
-  case TAG_INT:
-    if (size < 1 + 8) {
-      msg("bad response");
-      return -1;
-    }
-    {
-      int64_t val = 0;
-      memcpy(&val, &data[1], 8);
-      printf("(int) %ld\n", val);
-      return 1 + 8;
-    }
-  case TAG_DBL:
-    if (size < 1 + 8) {
-      msg("bad response");
-      return -1;
-    }
-    {
-      double val = 0;
-      memcpy(&val, &data[1], 8);
-      printf("(dbl) %g\n", val);
-      return 1 + 8;
-    }
-  case TAG_ARR:
-    if (size < 1 + 4) {
-      msg("bad response");
-      return -1;
-    }
-    {
-      uint32_t len = 0;
-      memcpy(&len, &data[1], 4);
-      printf("(arr) len=%u\n", len);
-      size_t arr_bytes = 1 + 4;
-      for (uint32_t i = 0; i < len; ++i) {
-        int32_t rv = print_response(&data[arr_bytes], size - arr_bytes);
-        if (rv < 0) {
-          return rv;
-        }
-        arr_bytes += (size_t)rv;
-      }
-      printf("(arr) end\n");
-      return (int32_t)arr_bytes;
-    }
-  default:
-    msg("bad response");
-    return -1;
-  }
-}
-
-static int32_t read_res(int fd) {
-  // 4 bytes header
-  char rbuf[4 + k_max_msg + 1];
-  errno = 0;
-  int32_t err = read_full(fd, rbuf, 4);
-  if (err) {
-    if (errno == 0) {
-      msg("EOF");
-    } else {
-      msg("read() error");
-    }
-    return err;
-  }
-
-  uint32_t len = 0;
-  memcpy(&len, rbuf, 4); // assume little endian
-  if (len > k_max_msg) {
-    msg("too long");
-    return -1;
-  }
-
-  // reply body
-  err = read_full(fd, &rbuf[4], len);
-  if (err) {
-    msg("read() error");
-    return err;
+    printf("(arr) end\n");
+    break;
   }
-
-  // print the result
-  int32_t rv = print_response((uint8_t *)&rbuf[4], len);
-  if (rv > 0 && (uint32_t)rv != len) {
-    msg("bad response");
-    rv = -1;
   }
-  return rv;
 }
 
 int main(int argc, char **argv) {
-  int fd = socket(AF_INET, SOCK_STREAM, 0);
-  if (fd < 0) {
-    die("socket()");
+  KVPool *pool = kv_pool_open("127.0.0.1", 1234, 1);
+  if (!pool) {
+    die("kv_pool_open()");
   }
 
-  struct sockaddr_in addr = {};
-  addr.sin_family = AF_INET;
-  addr.sin_port = ntohs(1234);
-  addr.sin_addr.s_addr = ntohl(INADDR_LOOPBACK); // 127.0.0.1
-  int rv = connect(fd, (const struct sockaddr *)&addr, sizeof(addr));
-  if (rv) {
-    die("connect");
-  }
-
-  std::vector<std::string> cmd;
+  std::vector<std::string_view> cmd;
   for (int i = 1; i < argc; ++i) {
     cmd.push_back(argv[i]);
   }
-  int32_t err = send_req(fd, cmd);
-  if (err) {
-    goto L_DONE;
-  }
-  err = read_res(fd);
-  if (err) {
-    goto L_DONE;
+  KVFuture fut;
+  kv_call(pool, &fut, cmd);
+  if (const KVVal *val = kv_wait(&fut)) {
+    print_response(*val);
+  } else {
+    msg("request failed");
   }
 
-L_DONE:
-  close(fd);
+  kv_pool_close(pool);
   return 0;
 }
@@ -0,0 +1,90 @@
+#include "deque.h"
+#include <assert.h>
+
+// move the packed items into a deque
+static void dq_convert(Deque *dq) {
+  Packed *pk = &dq->packed;
+  dq->items = new std::deque<std::string>();
+  for (size_t pos = 0; pos < pk->size; pos = pk_next(pk, pos)) {
+    dq->items->emplace_back(pk_get(pk, pos));
+  }
+  pk_clear(pk);
+}
+
+void dq_push(Deque *dq, std::string_view val, bool front) {
+  if (!dq->items) {
+    Packed *pk = &dq->packed;
+    if (pk_fits(pk, 1, val.size())) {
+      pk_insert(pk, front ? 0 : pk->size, val);
+      return;
+    }
+    dq_convert(dq); // too big to stay packed
+  }
+
+  if (front) {
+    dq->items->emplace_front(val);
+  } else {
+    dq->items->emplace_back(val);
+  }
+}
+
+bool dq_pop(Deque *dq, bool front, std::string &out) {
+  if (dq->items) {
+    if (dq->items->empty()) {
+      return false;
+    }
+    if (front) {
+      out.swap(dq->items->front());
+      dq->items->pop_front();
+    } else {
+      out.swap(dq->items->back());
+      dq->items->pop_back();
+    }
+    return true;
+  }
+
+  Packed *pk = &dq->packed;
+  if (pk->count == 0) {
+    return false;
+  }
+  size_t pos = 0;
+  if (!front) {
+    // find the last one
+    for (size_t next = pk_next(pk, pos); next < pk->size;) {
+      pos = next;
+      next = pk_next(pk, pos);
+    }
+  }
+  out.assign(pk_get(pk, pos));
+  pk_erase(pk, pos);
+  return true;
+}
+
+size_t dq_size(Deque *dq) {
+  return dq->items ? dq->items->size() : dq->packed.count;
+}
+
+void dq_range(Deque *dq, size_t start, size_t stop,
+              void (*f)(std::string_view, void *), void *arg) {
+  assert(start <= stop && stop < dq_size(dq));
+  if (dq->items) {
+    for (size_t i = start; i <= stop; i++) {
+      f((*dq->items)[i], arg);
+    }
+    return;
+  }
+
+  Packed *pk = &dq->packed;
+  size_t pos = 0;
+  for (size_t i = 0; i <= stop; i++, pos = pk_next(pk, pos)) {
+    if (i >= start) {
+      f(pk_get(pk, pos), arg);
+    }
+  }
+}
+
+void dq_clear(Deque *dq) {
+  delete dq->items;
+  dq->items = NULL;
+  pk_clear(&dq->packed);
+}
@@ -0,0 +1,24 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <deque>
+#include <string>
+#include <string_view>
+// proj
+#include "packed.h"
+
+// a list value, packed while it's small, a `std::deque` after that
+struct Deque {
+  Packed packed;
+  std::deque<std::string> *items = NULL; // set once converted
+};
+
+void dq_push(Deque *dq, std::string_view val, bool front);
+// returns false if empty
+bool dq_pop(Deque *dq, bool front, std::string &out);
+size_t dq_size(Deque *dq);
+// calls `f` with the items at [start, stop], which must be in range
+void dq_range(Deque *dq, size_t start, size_t stop,
+              void (*f)(std::string_view, void *), void *arg);
+void dq_clear(Deque *dq);
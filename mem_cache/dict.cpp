@@ -0,0 +1,214 @@
+#include "dict.h"
+#include <algorithm>
+#include <assert.h>
+#include <new>
+#include <string.h>
+// proj
+#include "hash.h"
+#include "slab.h"
+
+#define container_of(ptr, T, member) ((T *)((char *)ptr - offsetof(T, member)))
+
+// a field/value pair, the bytes follow the header
+struct DictNode {
+  HNode node;
+  uint32_t flen = 0;
+  uint32_t vlen = 0;
+  uint32_t cap = 0; // bytes after the header
+};
+
+static char *dnode_data(DictNode *dn) { return (char *)(dn + 1); }
+
+static std::string_view dnode_field(DictNode *dn) {
+  return std::string_view(dnode_data(dn), dn->flen);
+}
+
+static std::string_view dnode_val(DictNode *dn) {
+  return std::string_view(dnode_data(dn) + dn->flen, dn->vlen);
+}
+
+static DictNode *dnode_new(std::string_view field, std::string_view val,
+                           uint64_t hcode) {
+  size_t size = slab_size(sizeof(DictNode) + field.size() + val.size());
+  DictNode *dn = new (slab_alloc(size)) DictNode();
+  dn->node.hcode = hcode;
+  dn->flen = (uint32_t)field.size();
+  dn->vlen = (uint32_t)val.size();
+  dn->cap = (uint32_t)(size - sizeof(DictNode));
+  memcpy(dnode_data(dn), field.data(), field.size());
+  memcpy(dnode_data(dn) + field.size(), val.data(), val.size());
+  return dn;
+}
+
+static void dnode_del(DictNode *dn) {
+  slab_free(dn, sizeof(DictNode) + dn->cap);
+}
+
+// a helper structure for the hashtable lookup
+struct DKey {
+  HNode node;
+  std::string_view field;
+};
+
+static bool dnode_eq(HNode *node, HNode *key) {
+  DictNode *dn = container_of(node, DictNode, node);
+  return dnode_field(dn) == container_of(key, DKey, node)->field;
+}
+
+static void dkey_init(DKey &key, std::string_view field) {
+  key.field = field;
+  key.node.hcode = str_hash((uint8_t *)field.data(), field.size());
+}
+
+// the byte position of the field in the packed pairs, or `size`
+static size_t packed_find(Packed *pk, std::string_view field) {
+  size_t pos = 0;
+  while (pos < pk->size && pk_get(pk, pos) != field) {
+    pos = pk_next(pk, pk_next(pk, pos)); // skip the value
+  }
+  return pos;
+}
+
+// move the packed pairs into a hashtable
+static void dict_convert(Dict *dict) {
+  Packed *pk = &dict->packed;
+  dict->map = new HMap();
+  for (size_t pos = 0; pos < pk->size;) {
+    std::string_view field = pk_get(pk, pos);
+    pos = pk_next(pk, pos);
+    std::string_view val = pk_get(pk, pos);
+    pos = pk_next(pk, pos);
+
+    DKey key;
+    dkey_init(key, field);
+    hm_insert(dict->map, &dnode_new(field, val, key.node.hcode)->node);
+  }
+  pk_clear(pk);
+}
+
+bool dict_set(Dict *dict, std::string_view field, std::string_view val) {
+  if (!dict->map) {
+    Packed *pk = &dict->packed;
+    size_t pos = packed_find(pk, field);
+    if (pos < pk->size && pk_fits(pk, 0, val.size())) {
+      pk_replace(pk, pk_next(pk, pos), val); // update the value
+      return false;
+    }
+    if (pos == pk->size && pk_fits(pk, 2, std::max(field.size(), val.size()))) {
+      pk_insert(pk, pk->size, field); // append the pair
+      pk_insert(pk, pk->size, val);
+      return true;
+    }
+    dict_convert(dict); // too big to stay packed
+  }
+
+  DKey key;
+  dkey_init(key, field);
+  HNode *node = hm_lookup(dict->map, &key.node, &dnode_eq);
+  DictNode *dn = node ? container_of(node, DictNode, node) : NULL;
+  if (dn && dn->flen + val.size() <= dn->cap) {
+    // update in place
+    memcpy(dnode_data(dn) + dn->flen, val.data(), val.size());
+    dn->vlen = (uint32_t)val.size();
+    return false;
+  }
+  if (dn) {
+    // outgrown, replaced by a bigger one
+    hm_delete(dict->map, &key.node, &dnode_eq);
+    dnode_del(dn);
+  }
+  hm_insert(dict->map, &dnode_new(field, val, key.node.hcode)->node);
+  return dn == NULL;
+}
+
+bool dict_get(Dict *dict, std::string_view field, std::string_view *val) {
+  if (!dict->map) {
+    Packed *pk = &dict->packed;
+    size_t pos = packed_find(pk, field);
+    if (pos == pk->size) {
+      return false;
+    }
+    *val = pk_get(pk, pk_next(pk, pos));
+    return true;
+  }
+
+  DKey key;
+  dkey_init(key, field);
+  HNode *node = hm_lookup(dict->map, &key.node, &dnode_eq);
+  if (!node) {
+    return false;
+  }
+  *val = dnode_val(container_of(node, DictNode, node));
+  return true;
+}
+
+bool dict_del(Dict *dict, std::string_view field) {
+  if (!dict->map) {
+    Packed *pk = &dict->packed;
+    size_t pos = packed_find(pk, field);
+    if (pos == pk->size) {
+      return false;
+    }
+    pk_erase(pk, pk_next(pk, pos)); // the value
+    pk_erase(pk, pos);              // the field
+    return true;
+  }
+
+  DKey key;
+  dkey_init(key, field);
+  HNode *node = hm_delete(dict->map, &key.node, &dnode_eq);
+  if (node) {
+    dnode_del(container_of(node, DictNode, node));
+  }
+  return node != NULL;
+}
+
+size_t dict_size(Dict *dict) {
+  return dict->map ? hm_size(dict->map) : dict->packed.count / 2;
+}
+
+struct ForeachArg {
+  bool (*f)(std::string_view, std::string_view, void *);
+  void *arg;
+};
+
+static bool cb_foreach(HNode *node, void *arg) {
+  ForeachArg *fa = (ForeachArg *)arg;
+  DictNode *dn = container_of(node, DictNode, node);
+  return fa->f(dnode_field(dn), dnode_val(dn), fa->arg);
+}
+
+void dict_foreach(Dict *dict,
+                  bool (*f)(std::string_view, std::string_view, void *),
+                  void *arg) {
+  if (dict->map) {
+    ForeachArg fa = {f, arg};
+    return hm_foreach(dict->map, &cb_foreach, &fa);
+  }
+
+  Packed *pk = &dict->packed;
+  for (size_t pos = 0; pos < pk->size;) {
+    std::string_view field = pk_get(pk, pos);
+    pos = pk_next(pk, pos);
+    std::string_view val = pk_get(pk, pos);
+    pos = pk_next(pk, pos);
+    if (!f(field, val, arg)) {
+      return;
+    }
+  }
+}
+
+static bool cb_del(HNode *node, void *) {
+  dnode_del(container_of(node, DictNode, node));
+  return true;
+}
+
+void dict_clear(Dict *dict) {
+  if (dict->map) {
+    hm_foreach(dict->map, &cb_del, NULL);
+    hm_clear(dict->map);
+    delete dict->map;
+    dict->map = NULL;
+  }
+  pk_clear(&dict->packed);
+}
@@ -0,0 +1,26 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string_view>
+// proj
+#include "hashtable.h"
+#include "packed.h"
+
+// a hash of fields, packed field/value pairs while it's small,
+// a hashtable of `DictNode`s after that
+struct Dict {
+  Packed packed;
+  HMap *map = NULL; // set once converted
+};
+
+// returns true if the field was added, false if its value was updated
+bool dict_set(Dict *dict, std::string_view field, std::string_view val);
+bool dict_get(Dict *dict, std::string_view field, std::string_view *val);
+bool dict_del(Dict *dict, std::string_view field);
+size_t dict_size(Dict *dict);
+// stops when `f` returns false
+void dict_foreach(Dict *dict,
+                  bool (*f)(std::string_view, std::string_view, void *),
+                  void *arg);
+void dict_clear(Dict *dict);
@@ -0,0 +1,97 @@
+#include "hash.h"
+#include <string.h>
+#include <sys/random.h>
+#include <time.h>
+#include <unistd.h>
+
+// the wyhash constants, odd and with half of the bits set
+static const uint64_t k_secret[4] = {
+    0x2d358dccaa6c78a5ull, 0x8bb84b93962eacc9ull,
+    0x4b33a62ed433d4a3ull, 0x4d5a2da51de1aa47ull};
+
+// set once at startup, then only read by all the threads
+static uint64_t g_seed = 0;
+
+// 64x64 -> 128 bit multiply, the low and high halves
+static void mum(uint64_t *a, uint64_t *b) {
+  __uint128_t r = (__uint128_t)*a * *b;
+  *a = (uint64_t)r;
+  *b = (uint64_t)(r >> 64);
+}
+
+static uint64_t mix(uint64_t a, uint64_t b) {
+  mum(&a, &b);
+  return a ^ b;
+}
+
+// unaligned little endian loads
+static uint64_t read_u64(const uint8_t *p) {
+  uint64_t v;
+  memcpy(&v, p, 8);
+  return v;
+}
+
+static uint64_t read_u32(const uint8_t *p) {
+  uint32_t v;
+  memcpy(&v, p, 4);
+  return v;
+}
+
+// 1 to 3 bytes, first, middle and last
+static uint64_t read_small(const uint8_t *p, size_t len) {
+  return ((uint64_t)p[0] << 16) | ((uint64_t)p[len >> 1] << 8) | p[len - 1];
+}
+
+void hash_init(uint64_t seed) {
+  if (seed == 0 && getrandom(&seed, sizeof(seed), 0) != sizeof(seed)) {
+    // no entropy source, still better than a constant
+    struct timespec ts = {};
+    clock_gettime(CLOCK_REALTIME, &ts);
+    seed = ((uint64_t)ts.tv_sec << 32) ^ (uint64_t)ts.tv_nsec ^ getpid();
+  }
+  g_seed = mix(seed ^ k_secret[0], k_secret[1]);
+}
+
+uint64_t str_hash(const uint8_t *data, size_t len) {
+  const uint8_t *p = data;
+  uint64_t seed = g_seed;
+  uint64_t a = 0, b = 0;
+
+  if (len <= 16) {
+    // short keys, overlapping loads instead of a loop
+    if (len >= 4) {
+      size_t off = (len >> 3) << 2;
+      a = (read_u32(p) << 32) | read_u32(p + off);
+      b = (read_u32(p + len - 4) << 32) | read_u32(p + len - 4 - off);
+    } else if (len > 0) {
+      a = read_small(p, len);
+    }
+  } else {
+    size_t i = len;
+    if (i > 48) {
+      // 3 independent lanes, so the multiplies overlap
+      uint64_t see1 = seed, see2 = seed;
+      do {
+        seed = mix(read_u64(p) ^ k_secret[1], read_u64(p + 8) ^ seed);
+        see1 = mix(read_u64(p + 16) ^ k_secret[2], read_u64(p + 24) ^ see1);
+        see2 = mix(read_u64(p + 32) ^ k_secret[3], read_u64(p + 40) ^ see2);
+        p += 48;
+        i -= 48;
+      } while (i > 48);
+      seed ^= see1 ^ see2;
+    }
+    while (i > 16) {
+      seed = mix(read_u64(p) ^ k_secret[1], read_u64(p + 8) ^ seed);
+      p += 16;
+      i -= 16;
+    }
+    // the last 16 bytes, may overlap with the ones already mixed
+    a = read_u64(p + i - 16);
+    b = read_u64(p + i - 8);
+  }
+
+  a ^= k_secret[1];
+  b ^= seed;
+  mum(&a, &b);
+  return mix(a ^ k_secret[0] ^ len, b ^ k_secret[1]);
+}
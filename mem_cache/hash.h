@@ -0,0 +1,10 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// seeds the string hash, must be called before any hashing;
+// a zero seed picks a random one
+void hash_init(uint64_t seed);
+// a 64-bit string hash in the wyhash family
+uint64_t str_hash(const uint8_t *data, size_t len);
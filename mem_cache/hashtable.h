@@ -5,15 +5,18 @@
 
 // hashtable node, should be embedded into the payload
 struct HNode {
-  HNode *next = NULL;
   uint64_t hcode = 0;
 };
 
-// a simple fixed-sized hashtable
+// a fixed-sized open addressing table (swiss table)
+// slots are probed in groups of 16, each slot has a 1-byte control tag
+// that's either empty, deleted or 7 bits of the hash code
 struct HTab {
-  HNode **tab = NULL; // array of slots
-  size_t mask = 0;    // pow of 2 arr size, 2^n - 1
-  size_t size = 0;    // no of keys
+  uint8_t *ctrl = NULL; // control tags, the slots follow in the same block
+  HNode **slots = NULL; // array of slots
+  size_t mask = 0;      // pow of 2 arr size, 2^n - 1
+  size_t size = 0;      // no of keys
+  size_t used = 0;      // no of keys + tombstones
 };
 
 // the real hashtable interface
@@ -22,11 +25,32 @@ struct HMap {
   HTab newer;
   HTab older;
   size_t migration_pos = 0;
+  uint32_t step_work = 128; // migrated by each operation, fit to a time
 };
 
 HNode *hm_lookup(HMap *hmap, HNode *key, bool (*eq)(HNode *, HNode *));
 void hm_insert(HMap *hmap, HNode *node);
 HNode *hm_delete(HMap *hmap, HNode *key, bool (*eq)(HNode *, HNode *));
 void hm_clear(HMap *hmap);
+// make room for `n` keys in total without another resize
+void hm_reserve(HMap *hmap, size_t n);
+// insert keys that aren't in the map yet, a big batch is sorted by home
+// group and put in with one pass over the table
+void hm_insert_bulk(HMap *hmap, HNode **nodes, size_t n);
 size_t hm_size(HMap *hmap);
+// hints for a batch of lookups: the home groups of all the keys first,
+// then the nodes whose tags match, then the lookups themselves, so the
+// cache misses overlap instead of one waiting for another
+void hm_prefetch_group(HMap *hmap, uint64_t hcode);
+void hm_prefetch_nodes(HMap *hmap, uint64_t hcode);
+// true while the keys are moved to a new table, a step that fits a small
+// time budget is taken by every operation; hm_rehash() migrates more in
+// the caller's idle time
+bool hm_rehashing(HMap *hmap);
+void hm_rehash(HMap *hmap, uint64_t budget_ns);
 void hm_foreach(HMap *hmap, bool (*f)(HNode *, void *), void *arg);
+// visit the keys of one step of a scan, starting from cursor 0;
+// returns the next cursor, 0 when done. Keys present for the whole scan
+// are visited at least once, even across rehashing.
+uint64_t hm_scan(HMap *hmap, uint64_t cursor, void (*f)(HNode *, void *),
+                 void *arg);
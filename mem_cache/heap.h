@@ -0,0 +1,14 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// min-heap item, the owner keeps its position in `*ref` so it can be
+// updated or removed in O(log n)
+struct HeapItem {
+  uint64_t val = 0;     // the key, e.g. a deadline
+  uint32_t *ref = NULL; // owner's index into the heap
+};
+
+// restore the heap property after the item at `pos` was changed
+void heap_update(HeapItem *a, size_t pos, size_t len);
@@ -0,0 +1,69 @@
+#include "hist.h"
+#include <string.h>
+
+static size_t hist_index(uint64_t val) {
+  const uint64_t sub = 1ull << k_hist_sub_bits;
+  if (val < sub) {
+    return (size_t)val;
+  }
+  // the top k_hist_sub_bits + 1 bits pick the bucket
+  uint32_t exp = 63 - (uint32_t)__builtin_clzll(val);
+  uint32_t shift = exp - k_hist_sub_bits;
+  return (size_t)((shift + 1) * sub + ((val >> shift) - sub));
+}
+
+// the highest value that falls in a bucket
+static uint64_t hist_top(size_t idx) {
+  const uint64_t sub = 1ull << k_hist_sub_bits;
+  if (idx < sub) {
+    return idx;
+  }
+  uint32_t shift = (uint32_t)(idx >> k_hist_sub_bits) - 1;
+  uint64_t low = ((idx & (sub - 1)) + sub) << shift;
+  return low + ((1ull << shift) - 1);
+}
+
+void hist_add(Hist *h, uint64_t val) {
+  h->counts[hist_index(val)]++;
+  h->total++;
+  h->sum += val;
+  if (val > h->max) {
+    h->max = val;
+  }
+}
+
+void hist_merge(Hist *dst, const Hist *src) {
+  for (size_t i = 0; i < k_hist_buckets; i++) {
+    dst->counts[i] += src->counts[i];
+  }
+  dst->total += src->total;
+  dst->sum += src->sum;
+  if (src->max > dst->max) {
+    dst->max = src->max;
+  }
+}
+
+void hist_clear(Hist *h) {
+  memset(h->counts, 0, sizeof(h->counts));
+  h->total = h->sum = h->max = 0;
+}
+
+uint64_t hist_quantile(const Hist *h, double q) {
+  if (h->total == 0) {
+    return 0;
+  }
+  // the rank of the value, 1-based
+  uint64_t rank = (uint64_t)(q * (double)h->total + 0.5);
+  if (rank < 1) {
+    rank = 1;
+  }
+  uint64_t seen = 0;
+  for (size_t i = 0; i < k_hist_buckets; i++) {
+    seen += h->counts[i];
+    if (seen >= rank) {
+      uint64_t top = hist_top(i);
+      return top < h->max ? top : h->max;
+    }
+  }
+  return h->max;
+}
@@ -0,0 +1,23 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// linear sub-buckets per power of 2, the relative error is under 1/2^7
+const uint32_t k_hist_sub_bits = 7;
+const size_t k_hist_buckets = (65 - k_hist_sub_bits) << k_hist_sub_bits;
+
+// a log-linear histogram like HdrHistogram: values below 2^7 are exact,
+// above that each power of 2 is split into 2^7 equal buckets
+struct Hist {
+  uint64_t counts[k_hist_buckets] = {};
+  uint64_t total = 0; // no of values
+  uint64_t sum = 0;
+  uint64_t max = 0;
+};
+
+void hist_add(Hist *h, uint64_t val);
+void hist_merge(Hist *dst, const Hist *src);
+void hist_clear(Hist *h);
+// the value at quantile `q` in [0, 1], as the top of its bucket
+uint64_t hist_quantile(const Hist *h, double q);
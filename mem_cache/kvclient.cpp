@@ -0,0 +1,537 @@
+#include "kvclient.h"
+#include <assert.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+#include <linux/futex.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <functional>
+#include <thread>
+// proj
+#include "buffer.h"
+
+static void die(const char *msg) {
+  int err = errno;
+  fprintf(stderr, "[%d] %s\n", err, msg);
+  abort();
+}
+
+// the same limit as the server's
+const size_t k_max_msg = 32 << 20;
+
+static uint32_t load_u32(const uint8_t *p) {
+  uint32_t v = 0;
+  memcpy(&v, p, 4); // assume little endian
+  return v;
+}
+
+// a value nested this deep is rejected instead of overflowing the stack
+const uint32_t k_max_depth = 64;
+
+static int64_t decode(const uint8_t *data, size_t size, uint32_t depth) {
+  if (size < 1) {
+    return -1;
+  }
+  switch (data[0]) {
+  case KV_NIL:
+    return 1;
+  case KV_ERR:
+    if (size < 1 + 8 || size - (1 + 8) < load_u32(&data[1 + 4])) {
+      return -1;
+    }
+    return 1 + 8 + (int64_t)load_u32(&data[1 + 4]);
+  case KV_STR:
+    if (size < 1 + 4 || size - (1 + 4) < load_u32(&data[1])) {
+      return -1;
+    }
+    return 1 + 4 + (int64_t)load_u32(&data[1]);
+  case KV_INT:
+  case KV_DBL:
+    return size < 1 + 8 ? -1 : 1 + 8;
+  case KV_ARR: {
+    if (size < 1 + 4 || depth >= k_max_depth) {
+      return -1;
+    }
+    uint32_t n = load_u32(&data[1]);
+    size_t pos = 1 + 4;
+    for (uint32_t i = 0; i < n; i++) {
+      int64_t rv = decode(&data[pos], size - pos, depth + 1);
+      if (rv < 0) {
+        return -1;
+      }
+      pos += (size_t)rv;
+    }
+    return (int64_t)pos;
+  }
+  default:
+    return -1;
+  }
+}
+
+int64_t kv_decode(const uint8_t *data, size_t size, KVVal *val) {
+  int64_t rv = decode(data, size, 0);
+  if (rv >= 0) {
+    val->data = data;
+    val->size = (uint32_t)rv;
+  }
+  return rv;
+}
+
+uint8_t kv_tag(KVVal val) { return val.data[0]; }
+
+std::string_view kv_str(KVVal val) {
+  if (val.data[0] == KV_ERR) {
+    return {(const char *)&val.data[1 + 8], load_u32(&val.data[1 + 4])};
+  }
+  assert(val.data[0] == KV_STR);
+  return {(const char *)&val.data[1 + 4], load_u32(&val.data[1])};
+}
+
+int32_t kv_err_code(KVVal val) {
+  assert(val.data[0] == KV_ERR);
+  return (int32_t)load_u32(&val.data[1]);
+}
+
+int64_t kv_int(KVVal val) {
+  assert(val.data[0] == KV_INT);
+  int64_t v = 0;
+  memcpy(&v, &val.data[1], 8);
+  return v;
+}
+
+double kv_dbl(KVVal val) {
+  assert(val.data[0] == KV_DBL);
+  double v = 0;
+  memcpy(&v, &val.data[1], 8);
+  return v;
+}
+
+uint32_t kv_arr_len(KVVal val) {
+  assert(val.data[0] == KV_ARR);
+  return load_u32(&val.data[1]);
+}
+
+KVIter kv_iter(KVVal arr) {
+  KVIter it;
+  it.pos = &arr.data[1 + 4];
+  it.left = kv_arr_len(arr);
+  return it;
+}
+
+bool kv_next(KVIter *it, KVVal *elem) {
+  if (it->left == 0) {
+    return false;
+  }
+  // already checked as a part of the whole reply
+  int64_t rv = kv_decode(it->pos, k_max_msg, elem);
+  assert(rv > 0);
+  it->pos += rv;
+  it->left--;
+  return true;
+}
+
+struct KVConn {
+  int fd = -1;
+  bool connecting = false;
+  uint32_t events = 0;  // registered with epoll
+  KVReq *head = NULL;   // in flight, the replies come back in this order
+  KVReq *tail = NULL;
+  KVReq *unsent = NULL; // the first one not fully written
+  RecvBuf incoming;
+};
+
+struct KVPool {
+  struct sockaddr_in addr = {};
+  std::vector<KVConn *> conns;
+  MQueue submit;                 // requests from any thread
+  int wake_fd = -1;              // eventfd, kicked when `submit` was empty
+  int epfd = -1;
+  std::atomic<bool> stop{false};
+  std::atomic<uint32_t> next{0}; // for the requests without a key
+  std::thread thread;
+};
+
+static KVReq *req_of(MNode *node) { return (KVReq *)node; }
+
+// every request on the connection fails, it's opened again on next use
+static void conn_fail(KVConn *conn) {
+  if (conn->fd >= 0) {
+    close(conn->fd); // also out of epoll
+  }
+  conn->fd = -1;
+  conn->connecting = false;
+  conn->events = 0;
+  rbuf_consume(&conn->incoming, rbuf_size(&conn->incoming));
+
+  KVReq *req = conn->head;
+  conn->head = conn->tail = conn->unsent = NULL;
+  while (req) {
+    KVReq *next = req_of(req->node.next);
+    req->done(req, NULL);
+    req = next;
+  }
+}
+
+static bool conn_open(KVPool *pool, KVConn *conn) {
+  int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (fd < 0) {
+    return false;
+  }
+  int val = 1;
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &val, sizeof(val));
+  int rv = connect(fd, (const struct sockaddr *)&pool->addr,
+                   sizeof(pool->addr));
+  if (rv < 0 && errno != EINPROGRESS) {
+    close(fd);
+    return false;
+  }
+  conn->fd = fd;
+  conn->connecting = rv < 0; // done when writable
+  return true;
+}
+
+// the socket is writable, so the connect() has finished
+static void conn_connected(KVConn *conn) {
+  int err = 0;
+  socklen_t len = sizeof(err);
+  if (getsockopt(conn->fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err) {
+    return conn_fail(conn);
+  }
+  conn->connecting = false;
+}
+
+const size_t k_max_iov = 64;
+
+// write the pending requests with as few syscalls as possible
+static void conn_write(KVConn *conn) {
+  while (conn->unsent && !conn->connecting) {
+    struct iovec iov[k_max_iov];
+    size_t n = 0;
+    for (KVReq *req = conn->unsent; req && n < k_max_iov;
+         req = req_of(req->node.next)) {
+      iov[n].iov_base = &req->wire[req->sent];
+      iov[n].iov_len = req->wire.size() - req->sent;
+      n++;
+    }
+    struct msghdr hdr = {};
+    hdr.msg_iov = iov;
+    hdr.msg_iovlen = n;
+    ssize_t rv = sendmsg(conn->fd, &hdr, MSG_NOSIGNAL);
+    if (rv < 0 && errno == EAGAIN) {
+      return; // wait for EPOLLOUT
+    }
+    if (rv < 0) {
+      return conn_fail(conn);
+    }
+
+    size_t written = (size_t)rv;
+    while (written > 0) {
+      KVReq *req = conn->unsent;
+      size_t left = req->wire.size() - req->sent;
+      if (written < left) {
+        req->sent += (uint32_t)written;
+        break;
+      }
+      written -= left;
+      req->sent = (uint32_t)req->wire.size();
+      conn->unsent = req_of(req->node.next);
+    }
+  }
+}
+
+// match the complete replies with the requests, in order
+static void conn_replies(KVConn *conn) {
+  while (rbuf_size(&conn->incoming) >= 4) {
+    const uint8_t *data = rbuf_data(&conn->incoming);
+    uint32_t len = load_u32(data);
+    if (len > k_max_msg) {
+      return conn_fail(conn);
+    }
+    if (rbuf_size(&conn->incoming) < 4 + (size_t)len) {
+      return; // want read
+    }
+
+    KVReq *req = conn->head;
+    KVVal val;
+    if (!req || req == conn->unsent ||
+        kv_decode(data + 4, len, &val) != (int64_t)len) {
+      return conn_fail(conn); // not a reply to anything we sent
+    }
+    conn->head = req_of(req->node.next);
+    if (!conn->head) {
+      conn->tail = NULL;
+    }
+    // the value is read in place, the buffer moves on afterwards
+    req->done(req, &val);
+    rbuf_consume(&conn->incoming, 4 + len);
+  }
+}
+
+const size_t k_min_read = 64 * 1024;
+
+static void conn_read(KVConn *conn) {
+  while (conn->fd >= 0) {
+    size_t avail = 0;
+    uint8_t *space = rbuf_space(&conn->incoming, k_min_read, &avail);
+    ssize_t rv = read(conn->fd, space, avail);
+    if (rv < 0 && errno == EAGAIN) {
+      return;
+    }
+    if (rv <= 0) {
+      return conn_fail(conn); // an error, or closed by the server
+    }
+    rbuf_commit(&conn->incoming, (size_t)rv);
+    conn_replies(conn);
+    if ((size_t)rv < avail) {
+      return; // drained
+    }
+  }
+}
+
+// sync the epoll interest, writable is only wanted with data to send
+static void conn_settle(KVPool *pool, uint32_t id) {
+  KVConn *conn = pool->conns[id];
+  if (conn->fd < 0) {
+    return;
+  }
+  uint32_t events = EPOLLIN;
+  if (conn->connecting || conn->unsent) {
+    events |= EPOLLOUT;
+  }
+  if (events == conn->events) {
+    return;
+  }
+  struct epoll_event ev = {};
+  ev.events = events;
+  ev.data.u32 = id;
+  int op = conn->events == 0 ? EPOLL_CTL_ADD : EPOLL_CTL_MOD;
+  if (epoll_ctl(pool->epfd, op, conn->fd, &ev)) {
+    die("epoll_ctl()");
+  }
+  conn->events = events;
+}
+
+// append the submitted requests to their connections
+static void take_requests(KVPool *pool) {
+  MNode *node = mq_pop_all(&pool->submit);
+  while (node) {
+    KVReq *req = req_of(node);
+    node = node->next;
+    req->node.next = NULL;
+
+    KVConn *conn = pool->conns[req->conn];
+    if (conn->fd < 0 && !conn_open(pool, conn)) {
+      req->done(req, NULL);
+      continue;
+    }
+    if (conn->tail) {
+      conn->tail->node.next = &req->node;
+    } else {
+      conn->head = req;
+    }
+    conn->tail = req;
+    if (!conn->unsent) {
+      conn->unsent = req;
+    }
+  }
+}
+
+const uint32_t k_wake_id = (uint32_t)-1;
+const int k_max_events = 64;
+
+static void pool_loop(KVPool *pool) {
+  struct epoll_event events[k_max_events];
+  while (!pool->stop.load(std::memory_order_acquire)) {
+    int n = epoll_wait(pool->epfd, events, k_max_events, -1);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n < 0) {
+      die("epoll_wait()");
+    }
+
+    for (int i = 0; i < n; i++) {
+      uint32_t id = events[i].data.u32;
+      if (id == k_wake_id) {
+        uint64_t cnt = 0;
+        ssize_t rv = read(pool->wake_fd, &cnt, sizeof(cnt));
+        (void)rv; // nothing to read is fine too
+        continue;
+      }
+      KVConn *conn = pool->conns[id];
+      if (conn->fd >= 0 && conn->connecting) {
+        conn_connected(conn);
+      }
+      if (conn->fd >= 0 &&
+          (events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP))) {
+        conn_read(conn);
+      }
+    }
+
+    take_requests(pool);
+    for (uint32_t id = 0; id < pool->conns.size(); id++) {
+      conn_write(pool->conns[id]);
+      conn_settle(pool, id);
+    }
+  }
+}
+
+KVPool *kv_pool_open(const char *ip, uint16_t port, uint32_t nconns) {
+  KVPool *pool = new KVPool();
+  pool->addr.sin_family = AF_INET;
+  pool->addr.sin_port = htons(port);
+  if (nconns == 0 || inet_pton(AF_INET, ip, &pool->addr.sin_addr) != 1) {
+    delete pool;
+    errno = EINVAL;
+    return NULL;
+  }
+  pool->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  pool->epfd = epoll_create1(EPOLL_CLOEXEC);
+  struct epoll_event ev = {};
+  ev.events = EPOLLIN;
+  ev.data.u32 = k_wake_id;
+  if (pool->wake_fd < 0 || pool->epfd < 0 ||
+      epoll_ctl(pool->epfd, EPOLL_CTL_ADD, pool->wake_fd, &ev)) {
+    int err = errno;
+    close(pool->wake_fd);
+    close(pool->epfd);
+    delete pool;
+    errno = err;
+    return NULL;
+  }
+  for (uint32_t i = 0; i < nconns; i++) {
+    pool->conns.push_back(new KVConn());
+  }
+  pool->thread = std::thread(pool_loop, pool);
+  return pool;
+}
+
+static void wake_pool(KVPool *pool) {
+  uint64_t one = 1;
+  ssize_t rv = write(pool->wake_fd, &one, sizeof(one));
+  (void)rv; // only fails if the counter is saturated
+}
+
+void kv_pool_close(KVPool *pool) {
+  pool->stop.store(true, std::memory_order_release);
+  wake_pool(pool);
+  pool->thread.join();
+
+  // the thread is gone, everything is ours now
+  MNode *node = mq_pop_all(&pool->submit);
+  while (node) {
+    KVReq *req = req_of(node);
+    node = node->next;
+    req->done(req, NULL);
+  }
+  for (KVConn *conn : pool->conns) {
+    conn_fail(conn);
+    delete conn;
+  }
+  close(pool->wake_fd);
+  close(pool->epfd);
+  delete pool;
+}
+
+// the request as the server reads it:
+// len | nstr | len | str1 | len | str2 | ... | len | strn
+bool kv_encode(std::string &out, const std::vector<std::string_view> &cmd) {
+  size_t len = 4;
+  for (std::string_view s : cmd) {
+    len += 4 + s.size();
+  }
+  if (len > k_max_msg) {
+    return false;
+  }
+
+  size_t start = out.size();
+  out.resize(start + 4 + len);
+  uint8_t *p = (uint8_t *)&out[start];
+  uint32_t u = (uint32_t)len;
+  memcpy(p, &u, 4);
+  u = (uint32_t)cmd.size();
+  memcpy(p + 4, &u, 4);
+  p += 8;
+  for (std::string_view s : cmd) {
+    u = (uint32_t)s.size();
+    memcpy(p, &u, 4);
+    memcpy(p + 4, s.data(), s.size());
+    p += 4 + s.size();
+  }
+  return true;
+}
+
+void kv_send(KVPool *pool, KVReq *req,
+             const std::vector<std::string_view> &cmd) {
+  req->wire.clear();
+  if (!kv_encode(req->wire, cmd)) {
+    return req->done(req, NULL); // the server would drop the connection
+  }
+  req->sent = 0;
+  uint32_t n = (uint32_t)pool->conns.size();
+  if (cmd.size() >= 2) {
+    req->conn = (uint32_t)(std::hash<std::string_view>()(cmd[1]) % n);
+  } else {
+    req->conn = pool->next.fetch_add(1, std::memory_order_relaxed) % n;
+  }
+  if (mq_push(&pool->submit, &req->node)) {
+    wake_pool(pool); // the queue was empty, the thread may be asleep
+  }
+}
+
+// futex states of a KVFuture
+enum {
+  FUT_PENDING = 0,
+  FUT_WAITED = 1, // pending, and someone is asleep on it
+  FUT_DONE = 2,
+  FUT_FAILED = 3,
+};
+
+static void future_done(KVReq *req, const KVVal *reply) {
+  KVFuture *fut = (KVFuture *)req->arg;
+  if (reply) {
+    fut->body.assign((const char *)reply->data, reply->size);
+    fut->val.data = (const uint8_t *)fut->body.data();
+    fut->val.size = reply->size;
+  }
+  uint32_t old = fut->state.exchange(reply ? FUT_DONE : FUT_FAILED,
+                                     std::memory_order_acq_rel);
+  if (old == FUT_WAITED) {
+    syscall(SYS_futex, &fut->state, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+  }
+}
+
+void kv_call(KVPool *pool, KVFuture *fut,
+             const std::vector<std::string_view> &cmd) {
+  fut->state.store(FUT_PENDING, std::memory_order_relaxed);
+  fut->req.done = &future_done;
+  fut->req.arg = fut;
+  kv_send(pool, &fut->req, cmd);
+}
+
+bool kv_ready(KVFuture *fut) {
+  return fut->state.load(std::memory_order_acquire) >= FUT_DONE;
+}
+
+const KVVal *kv_wait(KVFuture *fut) {
+  uint32_t state = fut->state.load(std::memory_order_acquire);
+  while (state < FUT_DONE) {
+    if (state == FUT_PENDING &&
+        !fut->state.compare_exchange_weak(state, FUT_WAITED,
+                                          std::memory_order_acquire)) {
+      continue; // reloaded
+    }
+    syscall(SYS_futex, &fut->state, FUTEX_WAIT_PRIVATE, FUT_WAITED, NULL,
+            NULL, 0);
+    state = fut->state.load(std::memory_order_acquire);
+  }
+  return state == FUT_DONE ? &fut->val : NULL;
+}
@@ -0,0 +1,86 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <atomic>
+#include <string>
+#include <string_view>
+#include <vector>
+// proj
+#include "mpsc.h"
+
+// the reply tags, the same as the server's
+enum {
+  KV_NIL = 0, // nil
+  KV_ERR = 1, // error code + msg
+  KV_STR = 2, // string
+  KV_INT = 3, // int64
+  KV_DBL = 4, // double
+  KV_ARR = 5, // array
+};
+
+// a decoded value, a view into the reply bytes,
+// only checked once by kv_decode() for the whole reply
+struct KVVal {
+  const uint8_t *data = NULL; // the tag, then the payload
+  uint32_t size = 0;          // of the whole value
+};
+
+// returns the size of the value at `data`, -1 if it's malformed
+int64_t kv_decode(const uint8_t *data, size_t size, KVVal *val);
+uint8_t kv_tag(KVVal val);
+std::string_view kv_str(KVVal val); // KV_STR, or the message of KV_ERR
+int32_t kv_err_code(KVVal val);
+int64_t kv_int(KVVal val);
+double kv_dbl(KVVal val);
+uint32_t kv_arr_len(KVVal val);
+
+// the elements of an array, in order
+struct KVIter {
+  const uint8_t *pos = NULL;
+  uint32_t left = 0;
+};
+
+KVIter kv_iter(KVVal arr);
+bool kv_next(KVIter *it, KVVal *elem);
+
+// append a request to `out`, false if it's over the server's limit
+bool kv_encode(std::string &out, const std::vector<std::string_view> &cmd);
+
+// a request, owned by the caller until it's done
+struct KVReq {
+  MNode node;       // link in the submit queue, then in a connection
+  std::string wire; // the encoded request
+  uint32_t sent = 0; // bytes of `wire` written
+  uint32_t conn = 0; // picked by the key
+  // called on the pool thread, `reply` is only valid during the call and
+  // is NULL if the request failed with its connection; it must not block
+  void (*done)(KVReq *req, const KVVal *reply) = NULL;
+  void *arg = NULL;
+};
+
+// a request waited on by the caller, the reply is copied into it
+struct KVFuture {
+  KVReq req;
+  std::atomic<uint32_t> state{0}; // see kv_wait()
+  std::string body;
+  KVVal val;
+};
+
+// a few connections to one server, driven by a thread of their own;
+// any thread can send requests, many of them in flight per connection
+struct KVPool;
+
+// `nconns` connections, opened on first use and again after an error
+KVPool *kv_pool_open(const char *ip, uint16_t port, uint32_t nconns);
+// the requests still in flight fail
+void kv_pool_close(KVPool *pool);
+
+// requests with the same key go to the same connection, in order
+void kv_send(KVPool *pool, KVReq *req,
+             const std::vector<std::string_view> &cmd);
+void kv_call(KVPool *pool, KVFuture *fut,
+             const std::vector<std::string_view> &cmd);
+bool kv_ready(KVFuture *fut);
+// blocks until the reply, NULL if the request failed
+const KVVal *kv_wait(KVFuture *fut);
@@ -0,0 +1,26 @@
+#include "mpsc.h"
+
+// returns true if the queue was empty,
+// which means the consumer may be asleep and needs a wakeup
+bool mq_push(MQueue *q, MNode *node) {
+  MNode *head = q->head.load(std::memory_order_relaxed);
+  do {
+    node->next = head;
+  } while (!q->head.compare_exchange_weak(head, node, std::memory_order_release,
+                                          std::memory_order_relaxed));
+  return head == NULL;
+}
+
+// detach the whole stack and reverse it into FIFO order,
+// no ABA problem since nodes are never popped one by one
+MNode *mq_pop_all(MQueue *q) {
+  MNode *node = q->head.exchange(NULL, std::memory_order_acquire);
+  MNode *fifo = NULL;
+  while (node) {
+    MNode *next = node->next;
+    node->next = fifo;
+    fifo = node;
+    node = next;
+  }
+  return fifo;
+}
@@ -0,0 +1,18 @@
+#pragma once
+
+#include <atomic>
+#include <stddef.h>
+
+// queue node, should be embedded into the payload
+struct MNode {
+  MNode *next = NULL;
+};
+
+// a lock-free multi-producer single-consumer queue,
+// producers push with a CAS, the consumer takes everything with one swap
+struct MQueue {
+  std::atomic<MNode *> head{NULL};
+};
+
+bool mq_push(MQueue *q, MNode *node);
+MNode *mq_pop_all(MQueue *q);
@@ -0,0 +1,73 @@
+#include "packed.h"
+#include <assert.h>
+#include <string.h>
+// proj
+#include "slab.h"
+
+static uint32_t pk_len(const Packed *pk, size_t pos) {
+  uint32_t len = 0;
+  memcpy(&len, &pk->data[pos], 4);
+  return len;
+}
+
+std::string_view pk_get(const Packed *pk, size_t pos) {
+  assert(pos < pk->size);
+  return std::string_view((const char *)&pk->data[pos + 4], pk_len(pk, pos));
+}
+
+size_t pk_next(const Packed *pk, size_t pos) {
+  return pos + 4 + pk_len(pk, pos);
+}
+
+// grow the allocation, at least doubling
+static void pk_reserve(Packed *pk, size_t size) {
+  if (size <= pk->cap) {
+    return;
+  }
+  size_t cap = slab_size(size < 2 * pk->cap ? 2 * pk->cap : size);
+  uint8_t *data = (uint8_t *)slab_alloc(cap);
+  if (pk->size) {
+    memcpy(data, pk->data, pk->size);
+  }
+  slab_free(pk->data, pk->cap);
+  pk->data = data;
+  pk->cap = (uint32_t)cap;
+}
+
+// resize the `old_len` bytes at `pos` to `new_len`, moving the rest
+static void pk_splice(Packed *pk, size_t pos, size_t old_len, size_t new_len) {
+  pk_reserve(pk, pk->size - old_len + new_len);
+  uint8_t *tail = &pk->data[pos + old_len];
+  memmove(&pk->data[pos + new_len], tail, pk->size - pos - old_len);
+  pk->size = (uint32_t)(pk->size - old_len + new_len);
+}
+
+void pk_insert(Packed *pk, size_t pos, std::string_view str) {
+  assert(pos <= pk->size);
+  uint32_t len = (uint32_t)str.size();
+  pk_splice(pk, pos, 0, 4 + len);
+  memcpy(&pk->data[pos], &len, 4);
+  memcpy(&pk->data[pos + 4], str.data(), len);
+  pk->count++;
+}
+
+void pk_erase(Packed *pk, size_t pos) {
+  pk_splice(pk, pos, 4 + pk_len(pk, pos), 0);
+  pk->count--;
+}
+
+void pk_replace(Packed *pk, size_t pos, std::string_view str) {
+  uint32_t len = (uint32_t)str.size();
+  pk_splice(pk, pos, 4 + pk_len(pk, pos), 4 + len);
+  memcpy(&pk->data[pos], &len, 4);
+  memcpy(&pk->data[pos + 4], str.data(), len);
+}
+
+void pk_clear(Packed *pk) {
+  slab_free(pk->data, pk->cap);
+  *pk = Packed{};
+}
+
+bool pk_fits(const Packed *pk, size_t n, size_t elem_size) {
+  return pk->count + n <= k_packed_max_count && elem_size <= k_packed_max_elem;
+}
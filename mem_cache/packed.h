@@ -0,0 +1,29 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string_view>
+
+// a small array of strings packed into one allocation, each element is
+// a u32 length followed by the bytes; containers use it while they're
+// small and switch to a real data structure past these limits
+const size_t k_packed_max_count = 128;
+const size_t k_packed_max_elem = 64;
+
+struct Packed {
+  uint8_t *data = NULL;
+  uint32_t size = 0;  // bytes used
+  uint32_t cap = 0;   // bytes allocated
+  uint32_t count = 0; // no of elements
+};
+
+// elements are addressed by byte position,
+// the first one is at 0 and the end is at `size`
+std::string_view pk_get(const Packed *pk, size_t pos);
+size_t pk_next(const Packed *pk, size_t pos);
+void pk_insert(Packed *pk, size_t pos, std::string_view str);
+void pk_erase(Packed *pk, size_t pos);
+void pk_replace(Packed *pk, size_t pos, std::string_view str);
+void pk_clear(Packed *pk);
+// whether `n` more elements of this size stay under the limits
+bool pk_fits(const Packed *pk, size_t n, size_t elem_size);
@@ -0,0 +1,77 @@
+#include "reclaim.h"
+#include "mpsc.h"
+#include "slab.h"
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/eventfd.h>
+#include <thread>
+#include <unistd.h>
+
+#define container_of(ptr, T, member) ((T *)((char *)ptr - offsetof(T, member)))
+
+struct ReclaimJob {
+  MNode node;
+  void (*fn)(void *) = NULL;
+  void *arg = NULL;
+  SlabHeap *owner = NULL; // where the slab frees go
+};
+
+static MQueue g_jobs;
+static int g_wake_fd = -1;
+static thread_local bool g_is_reclaimer = false;
+
+static void reclaim_loop() {
+  g_is_reclaimer = true;
+  while (true) {
+    // reset the eventfd before draining, so a push after this is not missed
+    uint64_t cnt = 0;
+    ssize_t rv = read(g_wake_fd, &cnt, sizeof(cnt)); // blocks
+    (void)rv;
+
+    MNode *node = mq_pop_all(&g_jobs);
+    SlabHeap *owner = NULL;
+    while (node) {
+      ReclaimJob *job = container_of(node, ReclaimJob, node);
+      node = node->next;
+      // consecutive jobs of a thread share a batch
+      if (job->owner != owner) {
+        if (owner) {
+          slab_remote_end();
+        }
+        owner = job->owner;
+        slab_remote_begin(owner);
+      }
+      job->fn(job->arg);
+      delete job;
+    }
+    if (owner) {
+      slab_remote_end();
+    }
+  }
+}
+
+bool reclaim_init() {
+  g_wake_fd = eventfd(0, EFD_CLOEXEC);
+  if (g_wake_fd < 0) {
+    return false;
+  }
+  std::thread(reclaim_loop).detach();
+  return true;
+}
+
+void reclaim_call(void (*fn)(void *), void *arg) {
+  if (g_wake_fd < 0 || g_is_reclaimer) {
+    return fn(arg);
+  }
+
+  ReclaimJob *job = new ReclaimJob();
+  job->fn = fn;
+  job->arg = arg;
+  job->owner = slab_heap();
+  if (mq_push(&g_jobs, &job->node)) {
+    // the queue was empty, the reclaimer may be asleep
+    uint64_t one = 1;
+    ssize_t rv = write(g_wake_fd, &one, sizeof(one));
+    (void)rv; // only fails if the counter is saturated
+  }
+}
@@ -0,0 +1,8 @@
+#pragma once
+
+// a background thread for the frees that are too slow for an event loop,
+// slab memory is handed back to the thread that queued the work
+bool reclaim_init();
+// run `fn(arg)` on the reclaimer thread, `arg` must not be shared;
+// runs it right away if there is no reclaimer, or on the reclaimer itself
+void reclaim_call(void (*fn)(void *), void *arg);
@@ -1,8 +1,10 @@
 // stdlib
 #include <assert.h>
 #include <cstddef>
+#include <math.h>
 #include <cstdint>
 #include <errno.h>
+#include <stdarg.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -12,13 +14,38 @@
 #include <fcntl.h>
 #include <netinet/ip.h>
 #include <poll.h>
+#include <signal.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
+#include <time.h>
 #include <unistd.h>
+#include <x86intrin.h>
 // C++
+#include <algorithm>
+#include <charconv>
+#include <new>
 #include <string>
+#include <string_view>
+#include <thread>
 #include <vector>
 // proj
+#include "aof.h"
+#include "buffer.h"
+#include "deque.h"
+#include "dict.h"
+#include "hash.h"
 #include "hashtable.h"
+#include "heap.h"
+#include "hist.h"
+#include "list.h"
+#include "mpsc.h"
+#include "reclaim.h"
+#include "slab.h"
+#include "snapshot.h"
+#include "uring.h"
+#include "zset.h"
 
 #define container_of(ptr, T, member) ((T *)((char *)ptr - offsetof(T, member)))
 
@@ -52,28 +79,47 @@ static void fd_set_nb(int fd) {
 
 const size_t k_max_msg = 32 << 20;
 
-typedef std::vector<uint8_t> Buffer;
-
 struct Conn {
   int fd = -1;
   // app's intentions, for event loop
   bool want_read = false;
   bool want_write = false;
   bool want_close = false;
+  // waiting for a request forwarded to another shard
+  bool pending = false;
+  // with fsync always, the output waits for this flush of the shard's log
+  // to be on disk, see aof_release()
+  uint64_t aof_seq = 0;
+  bool held = false;
+  // the epoll interest currently registered for this fd
+  uint32_t events = 0;
+  // io_uring engine only
+  uint32_t inflight = 0;  // submitted ops that still point to this conn
+  uint8_t recv_state = 0; // RECV_IDLE, RECV_ARMED, RECV_CANCELLING
+  bool send_busy = false; // a send is in flight
+  bool queued = false;    // in the batch of ops for the next submission
+  bool shut = false;      // shutdown() called, waiting for ops to drain
+  // timers, in the idle or the io list of the shard by last activity
+  uint64_t last_active_ms = 0;
+  DList timer_node;
   // buffered input and output
-  std::vector<uint8_t> incoming; // represents request
-  std::vector<uint8_t> outgoing; // represents response
+  RecvBuf incoming; // represents request
+  Buffer outgoing;  // represents response
 };
 
-// append to the back
-static void buf_append(std::vector<uint8_t> &buf, const uint8_t *data,
-                       size_t len) {
-  buf.insert(buf.end(), data, data + len);
-}
+static Conn *conn_new(int connfd, const struct sockaddr_in &client_addr) {
+  uint32_t ip = client_addr.sin_addr.s_addr;
+  fprintf(stderr, "new client from %u.%u.%u.%u:%u\n", ip & 255, (ip >> 8) & 255,
+          (ip >> 16) & 255, ip >> 24, ntohs(client_addr.sin_port));
+
+  // set the new fd to non-blocking
+  fd_set_nb(connfd);
 
-// remove from the front
-static void buf_consume(std::vector<uint8_t> &buf, size_t n) {
-  buf.erase(buf.begin(), buf.begin() + n);
+  // create a struct connection
+  Conn *conn = new Conn();
+  conn->fd = connfd;
+  conn->want_read = true;
+  return conn;
 }
 
 // application callback when the listening socket is ready
@@ -87,18 +133,7 @@ static Conn *handle_accept(int fd) {
     return NULL;
   }
 
-  uint32_t ip = client_addr.sin_addr.s_addr;
-  fprintf(stderr, "new client from %u.%u.%u.%u:%u\n", ip & 255, (ip >> 8) & 255,
-          (ip >> 16) & 255, ip >> 24, ntohs(client_addr.sin_port));
-
-  // set the new fd to non-blocking
-  fd_set_nb(connfd);
-
-  // create a struct connection
-  Conn *conn = new Conn();
-  conn->fd = connfd;
-  conn->want_read = true;
-  return conn;
+  return conn_new(connfd, client_addr);
 }
 
 const size_t k_max_args = 200 * 1000;
@@ -113,13 +148,14 @@ static bool read_u32(const uint8_t *&cur, const uint8_t *end, uint32_t &out) {
   return true;
 }
 
+// no copy, the view points into the receive buffer
 static bool read_str(const uint8_t *&cur, const uint8_t *end, size_t n,
-                     std::string &out) {
+                     std::string_view &out) {
   if (cur + n > end) {
     return false;
   }
 
-  out.assign(cur, cur + n);
+  out = std::string_view((const char *)cur, n);
   cur += n;
   return true;
 }
@@ -129,20 +165,26 @@ static bool read_str(const uint8_t *&cur, const uint8_t *end, size_t n,
 // +------+-----+------+-----+------+-----+-----+------+
 
 static int32_t parse_req(const uint8_t *data, size_t size,
-                         std::vector<std::string> &out) {
+                         std::vector<std::string_view> &out) {
   const uint8_t *end = data + size;
   uint32_t nstr = 0;
 
   if (!read_u32(data, end, nstr)) {
+    return -1;
+  }
+
+  if (nstr > k_max_args) {
     return -1; // safety limit
   }
 
+  // the vector is reused between requests, so no allocation here
+  out.clear();
   while (out.size() < nstr) {
     uint32_t len = 0;
     if (!read_u32(data, end, len)) {
       return -1;
     }
-    out.push_back(std::string());
+    out.push_back(std::string_view());
 
     if (!read_str(data, end, len, out.back())) {
       return -1;
@@ -160,6 +202,8 @@ static int32_t parse_req(const uint8_t *data, size_t size,
 enum {
   ERR_UNKNOWN = 1, // unknown command
   ERR_TOO_BIG = 2, // response too big
+  ERR_BAD_ARG = 3, // malformed argument
+  ERR_BAD_TYP = 4, // the key holds another type
 };
 
 // data types for serialized data
@@ -172,18 +216,20 @@ enum {
   TAG_ARR = 5, // array
 };
 
-static void buf_append_u8(Buffer &buf, uint8_t data) { buf.push_back(data); }
+static void buf_append_u8(Buffer &buf, uint8_t data) {
+  buf_append(&buf, &data, 1);
+}
 
 static void buf_append_u32(Buffer &buf, uint32_t data) {
-  buf_append(buf, (const uint8_t *)&data, 4);
+  buf_append(&buf, &data, 4);
 }
 
 static void buf_append_i64(Buffer &buf, int64_t data) {
-  buf_append(buf, (const uint8_t *)&data, 8);
+  buf_append(&buf, &data, 8);
 }
 
 static void buf_append_dbl(Buffer &buf, double data) {
-  buf_append(buf, (const uint8_t *)&data, 8);
+  buf_append(&buf, &data, 8);
 }
 
 // append serialized data types to the back
@@ -192,7 +238,7 @@ static void out_nil(Buffer &out) { buf_append_u8(out, TAG_NIL); }
 static void out_str(Buffer &out, const char *s, size_t size) {
   buf_append_u8(out, TAG_STR);
   buf_append_u32(out, (uint32_t)size);
-  buf_append(out, (const uint8_t *)s, size);
+  buf_append(&out, s, size);
 }
 
 static void out_int(Buffer &out, int64_t val) {
@@ -209,7 +255,18 @@ static void out_err(Buffer &out, uint32_t code, const std::string &msg) {
   buf_append_u8(out, TAG_ERR);
   buf_append_u32(out, code);
   buf_append_u32(out, (uint32_t)msg.size());
-  buf_append(out, (const uint8_t *)msg.data(), msg.size());
+  buf_append(&out, msg.data(), msg.size());
+}
+
+// for arrays of unknown size, the count is patched in at the end
+static size_t out_begin_arr(Buffer &out) {
+  buf_append_u8(out, TAG_ARR);
+  buf_append_u32(out, 0); // filled by out_end_arr()
+  return buf_size(&out) - 4;
+}
+
+static void out_end_arr(Buffer &out, size_t ctx, uint32_t n) {
+  buf_patch(&out, ctx, &n, 4);
 }
 
 static void out_arr(Buffer &out, uint32_t n) {
@@ -217,354 +274,3280 @@ static void out_arr(Buffer &out, uint32_t n) {
   buf_append_u32(out, n);
 }
 
+// a shard owns a partition of the keyspace and the connections accepted
+// by its event loop, other threads only touch `inbox` and `wake_fd`
+struct Shard {
+  uint32_t id = 0;
+  int listen_fd = -1; // bound with SO_REUSEPORT, one per shard
+  int wake_fd = -1;   // eventfd, signaled when the inbox becomes non-empty
+  MQueue inbox;       // forwarded requests and replies
+};
+
 // global states
-static struct {
-  HMap db; // top-level hashtable
-} g_data;
+static std::vector<Shard *> g_shards;
+static uint64_t g_start_ms = 0;
+static double g_tsc_per_ns = 1; // the command latencies are in TSC ticks
 
-// kv pair for the top level hashtable
-struct Entry {
-  struct HNode node;
-  std::string key;
-  std::string val;
+// what the keys are being walked for
+enum {
+  WALK_NONE = 0,
+  WALK_AOF = 1,  // a log rewrite
+  WALK_SNAP = 2, // a snapshot
 };
 
-// equality comparison for `struct entry`
-static bool entry_eq(HNode *lhs, HNode *rhs) {
-  struct Entry *le = container_of(lhs, struct Entry, node);
-  struct Entry *re = container_of(rhs, struct Entry, node);
+// the commands with latencies of their own, the rest go to the last one
+static const std::string_view k_stat_cmds[] = {
+    "get",     "set",    "mget",    "mset",      "mdel",   "del",
+    "unlink",  "expire", "pexpire", "pexpireat", "ttl",    "pttl",
+    "persist", "zadd",   "zrem",    "zscore",    "zrank",  "zrange",
+    "zquery",  "incr",   "decr",    "incrby",    "decrby", "hset",
+    "hget",    "hdel",   "hlen",    "hgetall",   "lpush",  "rpush",
+    "lpop",    "rpop",   "llen",    "lrange",    "scan",   "bgrewriteaof",
+    "bgsave",  "info",   "other",
+};
+const size_t k_nstat_cmds = sizeof(k_stat_cmds) / sizeof(k_stat_cmds[0]);
+
+// the counters of a shard, only touched by its own thread;
+// `info` gathers them from all the shards, see do_info()
+struct Stats {
+  uint64_t accepted = 0;  // conns
+  uint64_t bytes_in = 0;  // received from the clients
+  uint64_t bytes_out = 0; // sent to them
+  uint64_t forwarded = 0; // requests or parts sent to other shards
+  uint64_t expired = 0;   // keys deleted past their deadline
+  // the time spent in execute(), allocated on first use
+  Hist *lat[k_nstat_cmds] = {};
+  // the commands executed as of a second ago, for the current rate
+  uint64_t sample_ms = 0;
+  uint64_t sample_cmds = 0;
+  uint64_t ops_per_sec = 0;
+};
+
+struct Forward;
+
+// per-thread states, owned by the shard's event loop
+static thread_local struct {
+  Shard *shard = NULL;
+  int epfd = -1;       // the epoll engine
+  Uring *ring = NULL;  // the io_uring engine, if enabled
+  UringBufRing bufs;   // provided buffers for multishot recv
+  struct UringSend *sends = NULL; // msghdrs of the sends being submitted
+  size_t nsends = 0;
+  std::vector<Conn *> io_queue; // conns with ops to submit
+  HMap db; // top-level hashtable, this shard's partition
+  std::vector<HeapItem> heap; // key expiration deadlines
+  // conns by last activity; those with nothing buffered and those
+  // with a partial request or unsent output, which time out sooner
+  DList idle_list;
+  DList io_list;
+  // the args of the request being dispatched, reused between requests
+  std::vector<std::string_view> cmd;
+  // a map of all client connections, keyed by fd
+  std::vector<Conn *> fd2conn;
+  // a walk of the keys for a log rewrite or a snapshot, one at a time,
+  // see persist_tick()
+  uint32_t walk = WALK_NONE;
+  uint64_t walk_cursor = 0;
+  uint32_t dump_epoch = 0;    // its parity marks the entries dumped
+  uint64_t aof_gen = 0;       // the last rewrite taken part in
+  bool aof_rewriting = false; // the changes go to the compacted log too
+  uint64_t snap_gen = 0;      // the last snapshot taken part in
+  Buffer snap_buf;            // serialized entries not handed over yet
+  uint32_t snap_count = 0;    // no of entries in `snap_buf`
+  Stats stats;
+  // replies waiting for their changes to be on disk, by log flush
+  std::vector<Conn *> held_conns;
+  std::vector<Forward *> held_fwds;
+} g_data;
 
-  return le->key == re->key;
+static uint64_t get_monotonic_msec() {
+  struct timespec tv = {0, 0};
+  clock_gettime(CLOCK_MONOTONIC, &tv);
+  return uint64_t(tv.tv_sec) * 1000 + tv.tv_nsec / 1000 / 1000;
 }
 
-// FNV hash
-static uint64_t str_hash(const uint8_t *data, size_t len) {
-  uint32_t h = 0x811C9DC5;
-  for (size_t i = 0; i < len; i++) {
-    h = (h + data[i]) * 0x01000193;
-  }
-  return h;
+static int64_t get_wall_msec() {
+  struct timespec tv = {0, 0};
+  clock_gettime(CLOCK_REALTIME, &tv);
+  return int64_t(tv.tv_sec) * 1000 + tv.tv_nsec / 1000 / 1000;
 }
 
-static void do_get(std::vector<std::string> &cmd, Buffer &out) {
-  // a dummy entry
-  Entry key;
-  key.key.swap(cmd[1]);
-  key.node.hcode = str_hash((uint8_t *)key.key.data(), key.key.size());
-  // hashtable lookup
-  HNode *node = hm_lookup(&g_data.db, &key.node, &entry_eq);
-  if (!node) {
-    return out_nil(out);
+static void tsc_calibrate() {
+  uint64_t t0 = get_monotonic_msec();
+  uint64_t c0 = __rdtsc();
+  while (get_monotonic_msec() - t0 < 20) {
   }
-
-  // copy the value
-  const std::string &val = container_of(node, Entry, node)->val;
-  return out_str(out, val.data(), val.size());
+  uint64_t t1 = get_monotonic_msec();
+  uint64_t c1 = __rdtsc();
+  g_tsc_per_ns = (double)(c1 - c0) / (double)((t1 - t0) * 1000 * 1000);
 }
 
-static void do_set(std::vector<std::string> &cmd, Buffer &out) {
-  // a dummy `Entry` just for the lookup
-  Entry key;
-  key.key.swap(cmd[1]);
-  key.node.hcode = str_hash((uint8_t *)key.key.data(), key.key.size());
-  // hashtable lookup
-  HNode *node = hm_lookup(&g_data.db, &key.node, &entry_eq);
-  if (node) {
-    // found, update the value
-    container_of(node, Entry, node)->val.swap(cmd[2]);
-  } else {
-    // not found, allocate & insert a new pair
-    Entry *ent = new Entry();
-    ent->key.swap(key.key);
-    ent->node.hcode = key.node.hcode;
-    ent->val.swap(cmd[2]);
-    hm_insert(&g_data.db, &ent->node);
+static size_t stats_index(std::vector<std::string_view> &cmd) {
+  if (!cmd.empty()) {
+    for (size_t i = 0; i + 1 < k_nstat_cmds; i++) {
+      if (cmd[0] == k_stat_cmds[i]) {
+        return i;
+      }
+    }
   }
-  return out_nil(out);
+  return k_nstat_cmds - 1;
 }
 
-static void do_del(std::vector<std::string> &cmd, Buffer &out) {
-  // a dummy `Entry` just for the lookup
-  Entry key;
-  key.key.swap(cmd[1]);
-  key.node.hcode = str_hash((uint8_t *)key.key.data(), key.key.size());
-  // hashtable delete
-  HNode *node = hm_delete(&g_data.db, &key.node, &entry_eq);
-  if (node) { // deallocate the pair
-    delete container_of(node, Entry, node);
+// a few ns: a scan of the names, usually over at the first ones, and
+// a bucket increment; no locks or atomics, the shard owns the counters
+static void stats_record(std::vector<std::string_view> &cmd, uint64_t ticks) {
+  Hist *&lat = g_data.stats.lat[stats_index(cmd)];
+  if (!lat) {
+    lat = new Hist();
   }
-  return out_int(out, node ? 1 : 0);
+  hist_add(lat, ticks);
 }
 
-static bool cb_keys(HNode *node, void *arg) {
-  Buffer &out = *(Buffer *)arg;
-  const std::string &key = container_of(node, Entry, node)->key;
-  out_str(out, key.data(), key.size());
-  return true;
+static uint64_t stats_cmds() {
+  uint64_t total = 0;
+  for (Hist *lat : g_data.stats.lat) {
+    total += lat ? lat->total : 0;
+  }
+  return total;
 }
 
-static void do_keys(std::vector<std::string> &, Buffer &out) {
-  out_arr(out, (uint32_t)hm_size(&g_data.db));
-  hm_foreach(&g_data.db, &cb_keys, (void *)&out);
+// the rate of the last whole second
+static void stats_tick(uint64_t now_ms) {
+  Stats &stats = g_data.stats;
+  if (now_ms < stats.sample_ms + 1000) {
+    return;
+  }
+  uint64_t cmds = stats_cmds();
+  stats.ops_per_sec =
+      (cmds - stats.sample_cmds) * 1000 / (now_ms - stats.sample_ms);
+  stats.sample_ms = now_ms;
+  stats.sample_cmds = cmds;
 }
 
-static void do_request(std::vector<std::string> &cmd, Buffer &out) {
-  if (cmd.size() == 2 && cmd[0] == "get") {
-    return do_get(cmd, out);
-  } else if (cmd.size() == 3 && cmd[0] == "set") {
-    return do_set(cmd, out);
-  } else if (cmd.size() == 2 && cmd[0] == "del") {
-    return do_del(cmd, out);
-  } else if (cmd.size() == 1 && cmd[0] == "keys") {
-    return do_keys(cmd, out);
-  } else {
-    return out_err(out, ERR_UNKNOWN, "unknown command");
+const uint64_t k_idle_timeout_ms = 300 * 1000;
+const uint64_t k_io_timeout_ms = 30 * 1000;
+
+// restart the conn's timer, moving it to the tail of its list
+static void conn_touch(Conn *conn) {
+  if (conn->want_close) {
+    return; // its timer is gone for good
   }
+
+  bool busy = rbuf_size(&conn->incoming) > 0 || buf_size(&conn->outgoing) > 0;
+  conn->last_active_ms = get_monotonic_msec();
+  dlist_detach(&conn->timer_node);
+  dlist_insert_before(busy ? &g_data.io_list : &g_data.idle_list,
+                      &conn->timer_node);
 }
 
-static void response_begin(Buffer &out, size_t *header) {
-  *header = out.size();   // messege header position
-  buf_append_u32(out, 0); // reserve space
+const uint32_t k_no_ttl = (uint32_t)-1;
+
+// value types, strings are stored as bytes, the rest as objects
+enum {
+  T_STR = 0,  // string bytes
+  T_ZSET = 1, // a `ZSet`
+  T_INT = 2,  // an int64 counter
+  T_HASH = 3, // a `Dict`
+  T_LIST = 4, // a `Deque`
+};
+
+// kv pair for the top level hashtable,
+// the key and then the value are stored inline after the header,
+// or in a mapped snapshot, see MappedStr
+struct Entry {
+  struct HNode node;
+  uint32_t heap_idx = k_no_ttl; // position in the TTL heap
+  uint32_t type : 4;            // T_STR, T_ZSET, ...
+  uint32_t dumped : 1;          // by the current walk, see entry_dumped()
+  uint32_t mapped : 1;          // a string pointing into the snapshot
+  uint32_t klen : 26;           // fits any key under k_max_msg
+  uint32_t vlen = 0;
+  uint32_t cap = 0; // bytes after the header, incl. slab rounding
+};
+
+static char *entry_data(Entry *ent) { return (char *)(ent + 1); }
+
+// objects are stored after the key, aligned
+static size_t entry_obj_pos(size_t klen) { return (klen + 7) & ~(size_t)7; }
+
+static void *entry_obj(Entry *ent) {
+  assert(ent->type != T_STR);
+  return entry_data(ent) + entry_obj_pos(ent->klen);
 }
 
-static size_t response_size(Buffer &out, size_t header) {
-  return out.size() - header - 4;
+static ZSet *entry_zset(Entry *ent) { return (ZSet *)entry_obj(ent); }
+static int64_t *entry_int(Entry *ent) { return (int64_t *)entry_obj(ent); }
+static Dict *entry_dict(Entry *ent) { return (Dict *)entry_obj(ent); }
+static Deque *entry_deque(Entry *ent) { return (Deque *)entry_obj(ent); }
+
+// a string loaded from a snapshot keeps its bytes in the mapped file,
+// the entry is replaced by a copy when the value changes
+struct MappedStr {
+  const char *key;
+  const char *val;
+};
+
+static MappedStr *entry_mapped(Entry *ent) {
+  return (MappedStr *)entry_data(ent);
 }
 
-static void response_end(Buffer &out, size_t header) {
-  size_t msg_size = response_size(out, header);
-  if (msg_size > k_max_msg) {
-    out.resize(header + 4);
-    out_err(out, ERR_TOO_BIG, "response is too big.");
-    msg_size = response_size(out, header);
-  }
-  // message header
-  uint32_t len = (uint32_t)msg_size;
-  memcpy(&out[header], &len, 4);
+static std::string_view entry_key(Entry *ent) {
+  const char *key = ent->mapped ? entry_mapped(ent)->key : entry_data(ent);
+  return std::string_view(key, ent->klen);
 }
 
-// process one request if there is enough data
-static bool try_one_request(Conn *conn) {
-  // try to parse the protocol: message header
-  if (conn->incoming.size() < 4) {
-    return false; // want read
-  }
-  uint32_t len = 0;
-  memcpy(&len, conn->incoming.data(), 4);
-  if (len > k_max_msg) {
-    msg("too long");
-    conn->want_close = true;
-    return false; // want close
-  }
+static std::string_view entry_val(Entry *ent) {
+  const char *val =
+      ent->mapped ? entry_mapped(ent)->val : entry_data(ent) + ent->klen;
+  return std::string_view(val, ent->vlen);
+}
 
-  // message body
-  if (4 + len > conn->incoming.size()) {
-    return false; // want read
+// one slab object for the header, key and value
+static Entry *entry_alloc(std::string_view key, size_t vsize, uint64_t hcode) {
+  size_t size = slab_size(sizeof(Entry) + vsize);
+  Entry *ent = new (slab_alloc(size)) Entry();
+  ent->node.hcode = hcode;
+  ent->dumped = g_data.dump_epoch & 1; // a walk skips new keys
+  ent->mapped = 0;
+  ent->klen = (uint32_t)key.size();
+  ent->cap = (uint32_t)(size - sizeof(Entry));
+  if (!key.empty()) {
+    memcpy(entry_data(ent), key.data(), key.size()); // NULL for a mapped one
   }
-  const uint8_t *request = &conn->incoming[4];
+  return ent;
+}
 
-  // got one req, perform app logic
-  std::vector<std::string> cmd;
-  if (parse_req(request, len, cmd) < 0) {
-    msg("bad request");
-    conn->want_close = true;
-    return false; // want close
-  }
+static Entry *entry_new(std::string_view key, std::string_view val,
+                        uint64_t hcode) {
+  Entry *ent = entry_alloc(key, key.size() + val.size(), hcode);
+  ent->vlen = (uint32_t)val.size();
+  memcpy(entry_data(ent) + key.size(), val.data(), val.size());
+  return ent;
+}
 
-  size_t header_pos = 0;
-  response_begin(conn->outgoing, &header_pos);
-  do_request(cmd, conn->outgoing);
-  response_end(conn->outgoing, header_pos);
+// the bytes must stay mapped while the entry lives, see snap_hold()
+static Entry *entry_new_mapped(std::string_view key, std::string_view val,
+                               uint64_t hcode) {
+  Entry *ent = entry_alloc(std::string_view(), sizeof(MappedStr), hcode);
+  ent->mapped = 1;
+  ent->klen = (uint32_t)key.size();
+  ent->vlen = (uint32_t)val.size();
+  *entry_mapped(ent) = MappedStr{key.data(), val.data()};
+  return ent;
+}
 
-  // app logic done, remove the req message
-  buf_consume(conn->incoming, 4 + len);
+static size_t obj_size(uint32_t type) {
+  switch (type) {
+  case T_ZSET:
+    return sizeof(ZSet);
+  case T_INT:
+    return sizeof(int64_t);
+  case T_HASH:
+    return sizeof(Dict);
+  default:
+    assert(type == T_LIST);
+    return sizeof(Deque);
+  }
+}
 
-  return true; // success
+// an entry with an empty object of `type`
+static Entry *entry_new_obj(std::string_view key, uint32_t type,
+                            uint64_t hcode) {
+  size_t pos = entry_obj_pos(key.size());
+  Entry *ent = entry_alloc(key, pos + obj_size(type), hcode);
+  ent->type = type;
+  void *obj = entry_obj(ent);
+  switch (type) {
+  case T_ZSET:
+    new (obj) ZSet();
+    break;
+  case T_INT:
+    new (obj) int64_t(0);
+    break;
+  case T_HASH:
+    new (obj) Dict();
+    break;
+  case T_LIST:
+    new (obj) Deque();
+    break;
+  }
+  return ent;
 }
 
-// app callback when the socket is writable
-static void handle_write(Conn *conn) {
-  assert(conn->outgoing.size() > 0);
-  ssize_t rv = write(conn->fd, &conn->outgoing[0], conn->outgoing.size());
-  if (rv < 0 && errno == EAGAIN) {
-    return; // actually not ready
+static void heap_delete(std::vector<HeapItem> &a, size_t pos) {
+  // swap the erased item with the last item
+  a[pos] = a.back();
+  a.pop_back();
+  // update the swapped item
+  if (pos < a.size()) {
+    heap_update(a.data(), pos, a.size());
   }
+}
 
-  if (rv < 0) {
-    msg_errno("write() error");
-    conn->want_close = true;
-    return;
+static void heap_upsert(std::vector<HeapItem> &a, size_t pos, HeapItem t) {
+  if (pos < a.size()) {
+    a[pos] = t; // update an existing item
+  } else {
+    pos = a.size();
+    a.push_back(t); // or add a new item
   }
+  heap_update(a.data(), pos, a.size());
+}
 
-  // remove written data from outgoing
-  buf_consume(conn->outgoing, (size_t)rv);
+// set or remove the TTL, a negative TTL removes it
+static void entry_set_ttl(Entry *ent, int64_t ttl_ms) {
+  if (ttl_ms < 0 && ent->heap_idx != k_no_ttl) {
+    heap_delete(g_data.heap, ent->heap_idx);
+    ent->heap_idx = k_no_ttl;
+  } else if (ttl_ms >= 0) {
+    uint64_t expire_at = get_monotonic_msec() + (uint64_t)ttl_ms;
+    HeapItem item = {expire_at, &ent->heap_idx};
+    heap_upsert(g_data.heap, ent->heap_idx, item);
+  }
+}
 
-  // update the readiness intention
-  if (conn->outgoing.size() == 0) {
-    // all data is written
-    conn->want_read = true;
-    conn->want_write = false;
-  } // else: want write
+static bool entry_expired(Entry *ent) {
+  return ent->heap_idx != k_no_ttl &&
+         g_data.heap[ent->heap_idx].val <= get_monotonic_msec();
 }
 
-// app callback when the socket is readable
-static void handle_read(Conn *conn) {
-  // read some data
-  uint8_t buf[64 * 1024];
-  ssize_t rv = read(conn->fd, buf, sizeof(buf));
-  if (rv < 0 && errno == EAGAIN) {
-    return; // actually not ready
+// frees the value and the entry, can run on the reclaimer thread
+static void entry_destroy(void *arg) {
+  Entry *ent = (Entry *)arg;
+  switch (ent->type) {
+  case T_ZSET:
+    zset_clear(entry_zset(ent));
+    entry_zset(ent)->~ZSet();
+    break;
+  case T_HASH:
+    dict_clear(entry_dict(ent));
+    entry_dict(ent)->~Dict();
+    break;
+  case T_LIST:
+    dq_clear(entry_deque(ent));
+    entry_deque(ent)->~Deque();
+    break;
   }
-
-  // handle IO error
-  if (rv < 0) {
-    msg_errno("read() error");
-    conn->want_close = true;
-    return; // want close
+  if (ent->mapped) {
+    snap_release(1);
   }
+  slab_free(ent, sizeof(Entry) + ent->cap);
+}
 
-  // handle EOF
-  if (rv == 0) {
-    if (conn->incoming.size() == 0) {
-      msg("client closed");
-    } else {
-      msg("unexpected EOF");
-    }
-    conn->want_close = true;
-    return; // want close
+// roughly the no of allocations to free, a big block counts per 64K
+static size_t entry_free_effort(Entry *ent) {
+  switch (ent->type) {
+  case T_ZSET:
+    return zset_size(entry_zset(ent));
+  case T_HASH:
+    return entry_dict(ent)->map ? dict_size(entry_dict(ent)) : 1;
+  case T_LIST:
+    return entry_deque(ent)->items ? dq_size(entry_deque(ent)) : 1;
+  default:
+    return 1 + ent->cap / (64 * 1024);
   }
+}
 
-  // got some new data
-  buf_append(conn->incoming, buf, (size_t)rv);
+// entries that take more than this to free go to the reclaimer
+const size_t k_lazy_free_effort = 64;
 
-  // parse req and generate response
-  while (try_one_request(conn)) {
+// `lazy` always frees in the background
+static void entry_del(Entry *ent, bool lazy = false) {
+  entry_set_ttl(ent, -1); // the heap is the shard's
+  if (lazy || entry_free_effort(ent) > k_lazy_free_effort) {
+    reclaim_call(&entry_destroy, ent);
+  } else {
+    entry_destroy(ent);
   }
+}
 
-  // update the readiness intention
-  if (conn->outgoing.size() > 0) {
-    conn->want_read = false;
-    conn->want_write = true;
+// a hashtable key that points into the request, for lookups
+struct LookupKey {
+  struct HNode node;
+  std::string_view key;
+};
 
-    // the socket is likely ready to write in a req-res protocol,
-    // try to write it without waiting for the next iteration
-    return handle_write(conn);
-  } // else: want read
+// equality comparison for `struct entry` against a lookup key
+static bool entry_eq(HNode *node, HNode *key) {
+  struct Entry *ent = container_of(node, struct Entry, node);
+  struct LookupKey *lk = container_of(key, struct LookupKey, node);
+
+  return entry_key(ent) == lk->key;
 }
 
-int main() {
-  // the listening socket
-  int fd = socket(AF_INET, SOCK_STREAM, 0);
-  if (fd < 0) {
-    die("socket()");
-  }
+static void key_init(LookupKey &key, std::string_view str) {
+  key.key = str;
+  key.node.hcode = str_hash((uint8_t *)str.data(), str.size());
+}
 
-  int val = 1;
-  setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &val, sizeof(val));
+// hashtable lookup, an expired key the timers haven't got to yet
+// is deleted here instead
+static Entry *entry_lookup(LookupKey &key) {
+  HNode *node = hm_lookup(&g_data.db, &key.node, &entry_eq);
+  if (!node) {
+    return NULL;
+  }
 
-  // bind
-  struct sockaddr_in addr = {};
-  addr.sin_family = AF_INET;
-  addr.sin_port = htons(1234);
-  addr.sin_addr.s_addr = htonl(0);
-  int rv = bind(fd, (const sockaddr *)&addr, sizeof(addr));
-  if (rv) {
-    die("bind()");
+  Entry *ent = container_of(node, Entry, node);
+  if (entry_expired(ent)) {
+    hm_delete(&g_data.db, &key.node, &entry_eq);
+    entry_del(ent);
+    g_data.stats.expired++;
+    return NULL;
   }
+  return ent;
+}
 
-  // set the fd to non blocking
-  fd_set_nb(fd);
+// remove a looked up entry
+static void entry_remove(LookupKey &key, Entry *ent) {
+  HNode *node = hm_delete(&g_data.db, &key.node, &entry_eq);
+  assert(node == &ent->node);
+  (void)node;
+  entry_del(ent);
+}
 
-  // listen
-  rv = listen(fd, SOMAXCONN);
-  if (rv) {
-    die("listen()");
+// swap a looked up entry for a new one of the same key, keeping the TTL
+static void entry_replace(LookupKey &key, Entry *old, Entry *ent) {
+  if (old->heap_idx != k_no_ttl) {
+    ent->heap_idx = old->heap_idx;
+    g_data.heap[ent->heap_idx].ref = &ent->heap_idx;
+    old->heap_idx = k_no_ttl;
   }
+  entry_remove(key, old);
+  hm_insert(&g_data.db, &ent->node);
+}
 
-  // a map of all client connections, keyed by fd
-  std::vector<Conn *> fd2conn;
+// the entry at a key, created with an empty object if missing;
+// NULL if it holds another type
+static Entry *entry_upsert(LookupKey &key, uint32_t type) {
+  Entry *ent = entry_lookup(key);
+  if (!ent) {
+    ent = entry_new_obj(key.key, type, key.node.hcode);
+    hm_insert(&g_data.db, &ent->node);
+  }
+  return ent->type == type ? ent : NULL;
+}
 
-  // the event loop
-  std::vector<struct pollfd> poll_args;
+// the shard that owns a key, the hash is remixed so that
+// the shard index doesn't correlate with the hashtable slot bits
+static uint32_t key_shard(uint64_t hcode) {
+  uint64_t h = (hcode * 0x9E3779B97F4A7C15ull) >> 32;
+  return (uint32_t)(h % g_shards.size());
+}
 
-  while (true) {
-    // prepare the args for `poll()`
-    poll_args.clear();
+static bool str2int(std::string_view s, int64_t &out) {
+  const char *end = s.data() + s.size();
+  std::from_chars_result res = std::from_chars(s.data(), end, out);
+  return res.ec == std::errc() && res.ptr == end;
+}
 
-    // put the listening socket in the first position
-    struct pollfd pfd = {fd, POLLIN, 0};
-    poll_args.push_back(pfd);
+static bool str2dbl(std::string_view s, double &out) {
+  const char *end = s.data() + s.size();
+  std::from_chars_result res = std::from_chars(s.data(), end, out);
+  return res.ec == std::errc() && res.ptr == end && !std::isnan(out);
+}
 
-    // the rest are connection sockets
-    for (Conn *conn : fd2conn) {
-      if (!conn) {
-        continue;
-      }
+static bool str2u64(std::string_view s, uint64_t &out) {
+  const char *end = s.data() + s.size();
+  std::from_chars_result res = std::from_chars(s.data(), end, out);
+  return res.ec == std::errc() && res.ptr == end;
+}
 
-      // always poll() for error
-      struct pollfd pfd = {conn->fd, POLLERR, 0};
+// the keys of a multi-key command are every `step` args from cmd[1],
+// 0 if it's not one
+static size_t multi_step(std::vector<std::string_view> &cmd) {
+  if (cmd.size() >= 2 && (cmd[0] == "mget" || cmd[0] == "mdel")) {
+    return 1;
+  }
+  if (cmd.size() >= 3 && cmd.size() % 2 == 1 && cmd[0] == "mset") {
+    return 2;
+  }
+  return 0;
+}
 
-      // poll() flags from the app's intent
-      if (conn->want_read) {
-        pfd.events |= POLLIN;
-      }
+static uint32_t arg_shard(std::string_view arg) {
+  return key_shard(str_hash((uint8_t *)arg.data(), arg.size()));
+}
 
-      if (conn->want_write) {
-        pfd.events |= POLLOUT;
-      }
+// a multi-key command whose keys are on several shards, or one for all
+// of them, see multi_request()
+const uint32_t k_split_shards = (uint32_t)-1;
 
-      poll_args.push_back(pfd);
-    }
+// which shard should execute the command
+static uint32_t cmd_shard(std::vector<std::string_view> &cmd) {
+  if (g_shards.size() == 1) {
+    return 0;
+  }
 
-    // wait for readiness
-    int rv = poll(poll_args.data(), (nfds_t)poll_args.size(), -1);
-    if (rv < 0 && errno == EINTR) {
-      continue; // not an error
+  if (size_t step = multi_step(cmd)) {
+    uint32_t owner = arg_shard(cmd[1]);
+    for (size_t i = 1 + step; i < cmd.size(); i += step) {
+      if (arg_shard(cmd[i]) != owner) {
+        return k_split_shards;
+      }
     }
+    return owner;
+  }
 
-    if (rv < 0) {
-      die("poll");
-    }
+  if (cmd.size() == 1 && cmd[0] == "info") {
+    return k_split_shards; // stats from every shard
+  }
 
-    // handle the listening socket
-    if (poll_args[0].revents) {
-      if (Conn *conn = handle_accept(fd)) {
-        // put it into the map
-        if (fd2conn.size() <= (size_t)conn->fd) {
-          fd2conn.resize(conn->fd + 1);
-        }
-        assert(!fd2conn[conn->fd]);
-        fd2conn[conn->fd] = conn;
-      }
+  if (cmd.size() >= 2 && cmd[0] == "scan") {
+    // the low part of the cursor is the shard being scanned
+    uint64_t cursor = 0;
+    if (str2u64(cmd[1], cursor)) {
+      return (uint32_t)(cursor % g_shards.size());
     }
+    return g_data.shard->id; // let it fail locally
+  }
 
-    // handle connections sockets
-    for (size_t i = 1; i < poll_args.size(); ++i) { // note: skip the first
-      uint32_t ready = poll_args[i].revents;
-      if (ready == 0) {
-        continue;
-      }
+  if (cmd.size() >= 2) {
+    return arg_shard(cmd[1]);
+  }
 
-      Conn *conn = fd2conn[poll_args[i].fd];
+  return g_data.shard->id; // no key, run it locally
+}
 
-      if (ready & POLLIN) {
-        assert(conn->want_read);
-        handle_read(conn);
-      }
+// a string or a counter as a string
+static void out_str_val(Buffer &out, Entry *ent) {
+  if (ent->type == T_INT) {
+    // counters read back as strings
+    char buf[24];
+    char *end = std::to_chars(buf, buf + sizeof(buf), *entry_int(ent)).ptr;
+    return out_str(out, buf, end - buf);
+  }
+  // copy the value
+  std::string_view val = entry_val(ent);
+  return out_str(out, val.data(), val.size());
+}
 
-      if (ready & POLLOUT) {
-        assert(conn->want_write);
-        handle_write(conn);
-      }
+static void do_get(std::vector<std::string_view> &cmd, Buffer &out) {
+  // the key is looked up in place
+  LookupKey key;
+  key_init(key, cmd[1]);
+  Entry *ent = entry_lookup(key);
+  if (!ent) {
+    return out_nil(out);
+  }
+  if (ent->type != T_STR && ent->type != T_INT) {
+    return out_err(out, ERR_BAD_TYP, "not a string value");
+  }
+  return out_str_val(out, ent);
+}
 
-      // close the socket from socket error or app logic
-      if ((ready & POLLERR) || conn->want_close) {
-        (void)close(conn->fd);
-        fd2conn[conn->fd] = NULL;
-        delete conn;
-      }
-    } // for each connection socket
-  }   // the event loop
+// a new value for an existing key, dropping its TTL
+static void entry_set_str(LookupKey &key, Entry *ent, std::string_view val) {
+  if (ent->type == T_STR && !ent->mapped &&
+      ent->klen + val.size() <= ent->cap) {
+    // the new value fits, update it in place
+    memcpy(entry_data(ent) + ent->klen, val.data(), val.size());
+    ent->vlen = (uint32_t)val.size();
+    entry_set_ttl(ent, -1); // a new value doesn't keep the old TTL
+    return;
+  }
+  // outgrown or another type, replaced by a new one
+  entry_remove(key, ent);
+  ent = entry_new(key.key, val, key.node.hcode);
+  hm_insert(&g_data.db, &ent->node);
+}
+
+static void do_set(std::vector<std::string_view> &cmd, Buffer &out) {
+  LookupKey key;
+  key_init(key, cmd[1]);
+  if (Entry *ent = entry_lookup(key)) {
+    entry_set_str(key, ent, cmd[2]);
+    return out_nil(out);
+  }
+  // only now the key and value are copied
+  Entry *ent = entry_new(key.key, cmd[2], key.node.hcode);
+  hm_insert(&g_data.db, &ent->node);
+  return out_nil(out);
+}
+
+// del key / unlink key, unlink always frees in the background
+static void do_del(std::vector<std::string_view> &cmd, Buffer &out) {
+  LookupKey key;
+  key_init(key, cmd[1]);
+  // hashtable delete
+  HNode *node = hm_delete(&g_data.db, &key.node, &entry_eq);
+  bool found = false;
+  if (node) { // deallocate the pair
+    Entry *ent = container_of(node, Entry, node);
+    found = !entry_expired(ent);
+    entry_del(ent, cmd[0] == "unlink");
+  }
+  return out_int(out, found ? 1 : 0);
+}
+
+// keys looked up together, see hm_prefetch_group()
+const size_t k_prefetch_batch = 16;
+
+// the keys of a multi-key command, from cmd[1] every `step` args, hashed
+static std::vector<LookupKey> &keys_batch(std::vector<std::string_view> &cmd,
+                                          size_t step) {
+  static thread_local std::vector<LookupKey> keys;
+  keys.resize((cmd.size() - 1) / step);
+  for (size_t i = 0; i < keys.size(); i++) {
+    key_init(keys[i], cmd[1 + i * step]);
+  }
+  return keys;
+}
+
+// before looking up keys[i], the table slots and entries of the next
+// batch of keys are loaded together, so the cache misses overlap
+static void keys_prefetch(std::vector<LookupKey> &keys, size_t i) {
+  if (i % k_prefetch_batch != 0) {
+    return;
+  }
+  size_t end = std::min(i + k_prefetch_batch, keys.size());
+  for (size_t j = i; j < end; j++) {
+    hm_prefetch_group(&g_data.db, keys[j].node.hcode);
+  }
+  for (size_t j = i; j < end; j++) {
+    hm_prefetch_nodes(&g_data.db, keys[j].node.hcode);
+  }
+}
+
+// mget key..., nil for a key that's missing or not a string
+static void do_mget(std::vector<std::string_view> &cmd, Buffer &out) {
+  std::vector<LookupKey> &keys = keys_batch(cmd, 1);
+  out_arr(out, (uint32_t)keys.size());
+  for (size_t i = 0; i < keys.size(); i++) {
+    keys_prefetch(keys, i);
+    Entry *ent = entry_lookup(keys[i]);
+    if (ent && (ent->type == T_STR || ent->type == T_INT)) {
+      out_str_val(out, ent);
+    } else {
+      out_nil(out);
+    }
+  }
+}
+
+static bool node_less(HNode *a, HNode *b) {
+  if (a->hcode != b->hcode) {
+    return a->hcode < b->hcode;
+  }
+  Entry *x = container_of(a, Entry, node);
+  Entry *y = container_of(b, Entry, node);
+  return entry_key(x) < entry_key(y);
+}
+
+// mset key value [key value...], the new keys are put in the table
+// together with hm_insert_bulk()
+static void do_mset(std::vector<std::string_view> &cmd, Buffer &out) {
+  std::vector<LookupKey> &keys = keys_batch(cmd, 2);
+  static thread_local std::vector<HNode *> added;
+  added.clear();
+  for (size_t i = 0; i < keys.size(); i++) {
+    keys_prefetch(keys, i);
+    std::string_view val = cmd[2 + i * 2];
+    if (Entry *ent = entry_lookup(keys[i])) {
+      entry_set_str(keys[i], ent, val);
+    } else {
+      Entry *fresh = entry_new(keys[i].key, val, keys[i].node.hcode);
+      added.push_back(&fresh->node);
+    }
+  }
+  // a key repeated in the command is new more than once, the last wins
+  std::stable_sort(added.begin(), added.end(), &node_less);
+  size_t n = 0;
+  for (size_t i = 0; i < added.size(); i++) {
+    if (i + 1 < added.size() && !node_less(added[i], added[i + 1])) {
+      entry_del(container_of(added[i], Entry, node));
+      continue;
+    }
+    added[n++] = added[i];
+  }
+  hm_insert_bulk(&g_data.db, added.data(), n);
+  return out_nil(out);
+}
+
+// mdel key..., the no of keys deleted
+static void do_mdel(std::vector<std::string_view> &cmd, Buffer &out) {
+  std::vector<LookupKey> &keys = keys_batch(cmd, 1);
+  int64_t n = 0;
+  for (size_t i = 0; i < keys.size(); i++) {
+    keys_prefetch(keys, i);
+    if (HNode *node = hm_delete(&g_data.db, &keys[i].node, &entry_eq)) {
+      Entry *ent = container_of(node, Entry, node);
+      n += entry_expired(ent) ? 0 : 1;
+      entry_del(ent);
+    }
+  }
+  return out_int(out, n);
+}
+
+// x + y, clamped to the int64 range
+static int64_t add_sat(int64_t x, int64_t y) {
+  int64_t sum = 0;
+  if (__builtin_add_overflow(x, y, &sum)) {
+    return y > 0 ? INT64_MAX : INT64_MIN;
+  }
+  return sum;
+}
+
+// expire key seconds / pexpire key milliseconds /
+// pexpireat key unix-milliseconds, the form in the log
+static void do_expire(std::vector<std::string_view> &cmd, Buffer &out) {
+  int64_t ttl_ms = 0;
+  if (!str2int(cmd[2], ttl_ms)) {
+    return out_err(out, ERR_BAD_ARG, "expect int64");
+  }
+  if (cmd[0] == "expire") {
+    if (ttl_ms > INT64_MAX / 1000 || ttl_ms < INT64_MIN / 1000) {
+      return out_err(out, ERR_BAD_ARG, "invalid expire time");
+    }
+    ttl_ms *= 1000;
+  } else if (cmd[0] == "pexpireat") {
+    ttl_ms = add_sat(ttl_ms, -get_wall_msec());
+  }
+
+  LookupKey key;
+  key_init(key, cmd[1]);
+  Entry *ent = entry_lookup(key);
+  if (!ent) {
+    return out_int(out, 0);
+  }
+  if (ttl_ms <= 0) {
+    // already expired
+    entry_remove(key, ent);
+  } else {
+    entry_set_ttl(ent, ttl_ms);
+  }
+  return out_int(out, 1);
+}
+
+// ttl key / pttl key, -2 if there's no such key, -1 if it has no TTL
+static void do_ttl(std::vector<std::string_view> &cmd, Buffer &out) {
+  LookupKey key;
+  key_init(key, cmd[1]);
+  Entry *ent = entry_lookup(key);
+  if (!ent) {
+    return out_int(out, -2);
+  }
+  if (ent->heap_idx == k_no_ttl) {
+    return out_int(out, -1);
+  }
+
+  uint64_t expire_at = g_data.heap[ent->heap_idx].val;
+  uint64_t now_ms = get_monotonic_msec();
+  int64_t ttl_ms = expire_at > now_ms ? (int64_t)(expire_at - now_ms) : 0;
+  return out_int(out, cmd[0] == "pttl" ? ttl_ms : (ttl_ms + 500) / 1000);
+}
+
+static void do_persist(std::vector<std::string_view> &cmd, Buffer &out) {
+  LookupKey key;
+  key_init(key, cmd[1]);
+  Entry *ent = entry_lookup(key);
+  if (!ent || ent->heap_idx == k_no_ttl) {
+    return out_int(out, 0);
+  }
+  entry_set_ttl(ent, -1);
+  return out_int(out, 1);
+}
+
+// read-only stand-ins for missing keys
+static const ZSet k_empty_zset;
+static const Dict k_empty_dict;
+static const Deque k_empty_deque;
+
+// the object at a key for reading; a missing key is the `empty` object,
+// another type is NULL
+static void *expect_obj(std::string_view name, uint32_t type,
+                        const void *empty) {
+  LookupKey key;
+  key_init(key, name);
+  Entry *ent = entry_lookup(key);
+  if (!ent) {
+    return (void *)empty;
+  }
+  return ent->type == type ? entry_obj(ent) : NULL;
+}
+
+static ZSet *expect_zset(std::string_view name) {
+  return (ZSet *)expect_obj(name, T_ZSET, &k_empty_zset);
+}
+
+static Dict *expect_dict(std::string_view name) {
+  return (Dict *)expect_obj(name, T_HASH, &k_empty_dict);
+}
+
+static Deque *expect_deque(std::string_view name) {
+  return (Deque *)expect_obj(name, T_LIST, &k_empty_deque);
+}
+
+// zadd zset score name
+static void do_zadd(std::vector<std::string_view> &cmd, Buffer &out) {
+  double score = 0;
+  if (!str2dbl(cmd[2], score)) {
+    return out_err(out, ERR_BAD_ARG, "expect float");
+  }
+
+  // look up or create the zset
+  LookupKey key;
+  key_init(key, cmd[1]);
+  Entry *ent = entry_upsert(key, T_ZSET);
+  if (!ent) {
+    return out_err(out, ERR_BAD_TYP, "expect zset");
+  }
+
+  // add or update the tuple
+  const std::string_view &name = cmd[3];
+  bool added = zset_insert(entry_zset(ent), name.data(), name.size(), score);
+  return out_int(out, (int64_t)added);
+}
+
+// zrem zset name
+static void do_zrem(std::vector<std::string_view> &cmd, Buffer &out) {
+  LookupKey key;
+  key_init(key, cmd[1]);
+  Entry *ent = entry_lookup(key);
+  if (ent && ent->type != T_ZSET) {
+    return out_err(out, ERR_BAD_TYP, "expect zset");
+  }
+
+  ZSet *zset = ent ? entry_zset(ent) : NULL;
+  ZNode *znode = zset ? zset_lookup(zset, cmd[2].data(), cmd[2].size()) : NULL;
+  if (!znode) {
+    return out_int(out, 0);
+  }
+  zset_delete(zset, znode);
+  if (zset_size(zset) == 0) {
+    // an empty zset is the same as no key
+    entry_remove(key, ent);
+  }
+  return out_int(out, 1);
+}
+
+// zscore zset name
+static void do_zscore(std::vector<std::string_view> &cmd, Buffer &out) {
+  ZSet *zset = expect_zset(cmd[1]);
+  if (!zset) {
+    return out_err(out, ERR_BAD_TYP, "expect zset");
+  }
+
+  ZNode *znode = zset_lookup(zset, cmd[2].data(), cmd[2].size());
+  return znode ? out_dbl(out, znode->score) : out_nil(out);
+}
+
+// zrank zset name, the 0-based position by score
+static void do_zrank(std::vector<std::string_view> &cmd, Buffer &out) {
+  ZSet *zset = expect_zset(cmd[1]);
+  if (!zset) {
+    return out_err(out, ERR_BAD_TYP, "expect zset");
+  }
+
+  ZNode *znode = zset_lookup(zset, cmd[2].data(), cmd[2].size());
+  return znode ? out_int(out, znode_rank(znode)) : out_nil(out);
+}
+
+// zrange zset start stop, by rank, inclusive; negative ranks count from
+// the end; replies with name and score pairs
+static void do_zrange(std::vector<std::string_view> &cmd, Buffer &out) {
+  int64_t start = 0;
+  int64_t stop = 0;
+  if (!str2int(cmd[2], start) || !str2int(cmd[3], stop)) {
+    return out_err(out, ERR_BAD_ARG, "expect int");
+  }
+  ZSet *zset = expect_zset(cmd[1]);
+  if (!zset) {
+    return out_err(out, ERR_BAD_TYP, "expect zset");
+  }
+
+  // clamp to the valid ranks
+  int64_t size = (int64_t)zset_size(zset);
+  if (start < 0) {
+    start = std::max<int64_t>(start + size, 0);
+  }
+  if (stop < 0) {
+    stop += size;
+  }
+  stop = std::min(stop, size - 1);
+  if (start > stop) {
+    return out_arr(out, 0);
+  }
+
+  out_arr(out, (uint32_t)((stop - start + 1) * 2));
+  ZNode *znode = zset_at(zset, start);
+  for (int64_t i = start; i <= stop; i++) {
+    out_str(out, znode->name, znode->len);
+    out_dbl(out, znode->score);
+    znode = znode_offset(znode, +1);
+  }
+}
+
+// zquery zset score name offset limit, for pagination by score:
+// up to `limit` pairs from the first one >= (score, name), `offset` skipped
+static void do_zquery(std::vector<std::string_view> &cmd, Buffer &out) {
+  double score = 0;
+  if (!str2dbl(cmd[2], score)) {
+    return out_err(out, ERR_BAD_ARG, "expect float");
+  }
+  const std::string_view &name = cmd[3];
+  int64_t offset = 0;
+  int64_t limit = 0;
+  if (!str2int(cmd[4], offset) || !str2int(cmd[5], limit)) {
+    return out_err(out, ERR_BAD_ARG, "expect int");
+  }
+  ZSet *zset = expect_zset(cmd[1]);
+  if (!zset) {
+    return out_err(out, ERR_BAD_TYP, "expect zset");
+  }
+
+  // seek to the key
+  if (limit <= 0) {
+    return out_arr(out, 0);
+  }
+  ZNode *znode = zset_seekge(zset, score, name.data(), name.size());
+  znode = znode_offset(znode, offset);
+
+  // output
+  size_t ctx = out_begin_arr(out);
+  int64_t n = 0;
+  while (znode && n < limit) {
+    out_str(out, znode->name, znode->len);
+    out_dbl(out, znode->score);
+    znode = znode_offset(znode, +1);
+    n++;
+  }
+  return out_end_arr(out, ctx, (uint32_t)(n * 2));
+}
+
+// incr key / decr key / incrby key n / decrby key n
+static void do_incr(std::vector<std::string_view> &cmd, Buffer &out) {
+  int64_t delta = 1;
+  if (cmd.size() == 3 && !str2int(cmd[2], delta)) {
+    return out_err(out, ERR_BAD_ARG, "expect int64");
+  }
+  if (cmd[0] == "decr" || cmd[0] == "decrby") {
+    if (delta == INT64_MIN) {
+      return out_err(out, ERR_BAD_ARG, "increment would overflow");
+    }
+    delta = -delta;
+  }
+
+  LookupKey key;
+  key_init(key, cmd[1]);
+  Entry *ent = entry_lookup(key);
+  if (ent && ent->type == T_STR) {
+    // a string holding a number becomes a counter
+    int64_t val = 0;
+    if (!str2int(entry_val(ent), val)) {
+      return out_err(out, ERR_BAD_TYP, "value is not an integer");
+    }
+    Entry *counter = entry_new_obj(key.key, T_INT, key.node.hcode);
+    *entry_int(counter) = val;
+    entry_replace(key, ent, counter);
+  }
+  ent = entry_upsert(key, T_INT);
+  if (!ent) {
+    return out_err(out, ERR_BAD_TYP, "value is not an integer");
+  }
+
+  int64_t *val = entry_int(ent);
+  int64_t res = 0;
+  if (__builtin_add_overflow(*val, delta, &res)) {
+    return out_err(out, ERR_BAD_ARG, "increment would overflow");
+  }
+  *val = res;
+  return out_int(out, res);
+}
+
+// hset key field value
+static void do_hset(std::vector<std::string_view> &cmd, Buffer &out) {
+  LookupKey key;
+  key_init(key, cmd[1]);
+  Entry *ent = entry_upsert(key, T_HASH);
+  if (!ent) {
+    return out_err(out, ERR_BAD_TYP, "expect hash");
+  }
+  bool added = dict_set(entry_dict(ent), cmd[2], cmd[3]);
+  return out_int(out, (int64_t)added);
+}
+
+// hget key field
+static void do_hget(std::vector<std::string_view> &cmd, Buffer &out) {
+  Dict *dict = expect_dict(cmd[1]);
+  if (!dict) {
+    return out_err(out, ERR_BAD_TYP, "expect hash");
+  }
+  std::string_view val;
+  if (!dict_get(dict, cmd[2], &val)) {
+    return out_nil(out);
+  }
+  return out_str(out, val.data(), val.size());
+}
+
+// hdel key field
+static void do_hdel(std::vector<std::string_view> &cmd, Buffer &out) {
+  LookupKey key;
+  key_init(key, cmd[1]);
+  Entry *ent = entry_lookup(key);
+  if (!ent) {
+    return out_int(out, 0);
+  }
+  if (ent->type != T_HASH) {
+    return out_err(out, ERR_BAD_TYP, "expect hash");
+  }
+
+  bool found = dict_del(entry_dict(ent), cmd[2]);
+  if (dict_size(entry_dict(ent)) == 0) {
+    entry_remove(key, ent); // an empty hash is the same as no key
+  }
+  return out_int(out, (int64_t)found);
+}
+
+// hlen key
+static void do_hlen(std::vector<std::string_view> &cmd, Buffer &out) {
+  Dict *dict = expect_dict(cmd[1]);
+  if (!dict) {
+    return out_err(out, ERR_BAD_TYP, "expect hash");
+  }
+  return out_int(out, (int64_t)dict_size(dict));
+}
+
+static bool cb_hgetall(std::string_view field, std::string_view val,
+                       void *arg) {
+  Buffer &out = *(Buffer *)arg;
+  out_str(out, field.data(), field.size());
+  out_str(out, val.data(), val.size());
+  return true;
+}
+
+// hgetall key, field and value pairs
+static void do_hgetall(std::vector<std::string_view> &cmd, Buffer &out) {
+  Dict *dict = expect_dict(cmd[1]);
+  if (!dict) {
+    return out_err(out, ERR_BAD_TYP, "expect hash");
+  }
+  out_arr(out, (uint32_t)(dict_size(dict) * 2));
+  dict_foreach(dict, &cb_hgetall, (void *)&out);
+}
+
+// lpush key val... / rpush key val...
+static void do_push(std::vector<std::string_view> &cmd, Buffer &out) {
+  LookupKey key;
+  key_init(key, cmd[1]);
+  Entry *ent = entry_upsert(key, T_LIST);
+  if (!ent) {
+    return out_err(out, ERR_BAD_TYP, "expect list");
+  }
+
+  Deque *dq = entry_deque(ent);
+  bool front = cmd[0] == "lpush";
+  for (size_t i = 2; i < cmd.size(); i++) {
+    dq_push(dq, cmd[i], front);
+  }
+  return out_int(out, (int64_t)dq_size(dq));
+}
+
+// lpop key / rpop key
+static void do_pop(std::vector<std::string_view> &cmd, Buffer &out) {
+  LookupKey key;
+  key_init(key, cmd[1]);
+  Entry *ent = entry_lookup(key);
+  if (!ent) {
+    return out_nil(out);
+  }
+  if (ent->type != T_LIST) {
+    return out_err(out, ERR_BAD_TYP, "expect list");
+  }
+
+  Deque *dq = entry_deque(ent);
+  std::string val;
+  bool found = dq_pop(dq, cmd[0] == "lpop", val);
+  if (dq_size(dq) == 0) {
+    entry_remove(key, ent); // an empty list is the same as no key
+  }
+  return found ? out_str(out, val.data(), val.size()) : out_nil(out);
+}
+
+// llen key
+static void do_llen(std::vector<std::string_view> &cmd, Buffer &out) {
+  Deque *dq = expect_deque(cmd[1]);
+  if (!dq) {
+    return out_err(out, ERR_BAD_TYP, "expect list");
+  }
+  return out_int(out, (int64_t)dq_size(dq));
+}
+
+static void cb_lrange(std::string_view val, void *arg) {
+  Buffer &out = *(Buffer *)arg;
+  out_str(out, val.data(), val.size());
+}
+
+// lrange key start stop, inclusive, negative indexes count from the end
+static void do_lrange(std::vector<std::string_view> &cmd, Buffer &out) {
+  int64_t start = 0;
+  int64_t stop = 0;
+  if (!str2int(cmd[2], start) || !str2int(cmd[3], stop)) {
+    return out_err(out, ERR_BAD_ARG, "expect int");
+  }
+  Deque *dq = expect_deque(cmd[1]);
+  if (!dq) {
+    return out_err(out, ERR_BAD_TYP, "expect list");
+  }
+
+  // clamp to the valid indexes
+  int64_t size = (int64_t)dq_size(dq);
+  if (start < 0) {
+    start = std::max<int64_t>(start + size, 0);
+  }
+  if (stop < 0) {
+    stop += size;
+  }
+  stop = std::min(stop, size - 1);
+  if (start > stop) {
+    return out_arr(out, 0);
+  }
+
+  out_arr(out, (uint32_t)(stop - start + 1));
+  dq_range(dq, (size_t)start, (size_t)stop, &cb_lrange, (void *)&out);
+}
+
+// [...] at pat[p], a set of chars and ranges, ^ negates it
+static bool glob_class(std::string_view pat, size_t &p, char c) {
+  p++; // [
+  bool neg = p < pat.size() && pat[p] == '^';
+  p += neg;
+  bool found = false;
+  for (; p < pat.size() && pat[p] != ']'; p++) {
+    if (pat[p] == '\\' && p + 1 < pat.size()) {
+      found |= pat[++p] == c;
+    } else if (p + 2 < pat.size() && pat[p + 1] == '-' && pat[p + 2] != ']') {
+      char lo = pat[p], hi = pat[p + 2];
+      found |= std::min(lo, hi) <= c && c <= std::max(lo, hi);
+      p += 2;
+    } else {
+      found |= pat[p] == c;
+    }
+  }
+  p += p < pat.size(); // ]
+  return found != neg;
+}
+
+// glob-style matching: * ? [...] and \ escapes, backtracking on `*`
+static bool glob_match(std::string_view pat, std::string_view str) {
+  size_t p = 0, s = 0;
+  size_t star = std::string_view::npos, star_s = 0;
+  while (s < str.size()) {
+    if (p < pat.size() && pat[p] == '*') {
+      star = p++;
+      star_s = s;
+      continue;
+    }
+    if (p < pat.size()) {
+      size_t next = p + 1;
+      bool ok = false;
+      if (pat[p] == '?') {
+        ok = true;
+      } else if (pat[p] == '[') {
+        next = p;
+        ok = glob_class(pat, next, str[s]);
+      } else if (pat[p] == '\\' && p + 1 < pat.size()) {
+        ok = pat[p + 1] == str[s];
+        next = p + 2;
+      } else {
+        ok = pat[p] == str[s];
+      }
+      if (ok) {
+        p = next;
+        s++;
+        continue;
+      }
+    }
+    if (star == std::string_view::npos) {
+      return false;
+    }
+    // let the last `*` eat one more char
+    p = star + 1;
+    s = ++star_s;
+  }
+  while (p < pat.size() && pat[p] == '*') {
+    p++;
+  }
+  return p == pat.size();
+}
+
+struct ScanCtx {
+  Buffer *out = NULL;
+  std::string_view pattern = "*";
+  uint32_t n = 0; // keys emitted
+};
+
+static void cb_scan(HNode *node, void *arg) {
+  ScanCtx *ctx = (ScanCtx *)arg;
+  Entry *ent = container_of(node, Entry, node);
+  std::string_view key = entry_key(ent);
+  if (entry_expired(ent)) {
+    return; // not deleted here, the table must not change during a step
+  }
+  if (ctx->pattern != "*" && !glob_match(ctx->pattern, key)) {
+    return;
+  }
+  out_str(*ctx->out, key.data(), key.size());
+  ctx->n++;
+}
+
+// groups visited per key asked for, bounds a step over a sparse table
+const uint64_t k_scan_steps = 10;
+
+// scan cursor [match pattern] [count n]
+// the cursor is the table cursor times the shard count plus the shard,
+// the shards are scanned one after another
+static void do_scan(std::vector<std::string_view> &cmd, Buffer &out) {
+  uint64_t cursor = 0;
+  if (!str2u64(cmd[1], cursor)) {
+    return out_err(out, ERR_BAD_ARG, "invalid cursor");
+  }
+  ScanCtx ctx;
+  ctx.out = &out;
+  int64_t count = 10;
+  for (size_t i = 2; i < cmd.size(); i += 2) {
+    if (i + 1 < cmd.size() && cmd[i] == "match") {
+      ctx.pattern = cmd[i + 1];
+    } else if (i + 1 < cmd.size() && cmd[i] == "count") {
+      if (!str2int(cmd[i + 1], count) || count <= 0) {
+        return out_err(out, ERR_BAD_ARG, "invalid count");
+      }
+    } else {
+      return out_err(out, ERR_BAD_ARG, "syntax error");
+    }
+  }
+
+  uint64_t nshards = g_shards.size();
+  uint64_t shard = cursor % nshards;
+  uint64_t tcursor = cursor / nshards;
+  out_arr(out, 2);
+  size_t cursor_pos = buf_size(&out);
+  out_int(out, 0); // patched below
+  size_t arr = out_begin_arr(out);
+  uint64_t budget = (uint64_t)count * k_scan_steps;
+  do {
+    tcursor = hm_scan(&g_data.db, tcursor, &cb_scan, (void *)&ctx);
+  } while (tcursor && ctx.n < (uint64_t)count && --budget);
+  out_end_arr(out, arr, ctx.n);
+
+  // done with this shard, continue with the next one
+  int64_t next = 0;
+  if (tcursor) {
+    next = (int64_t)(tcursor * nshards + shard);
+  } else if (shard + 1 < nshards) {
+    next = (int64_t)(shard + 1);
+  }
+  buf_patch(&out, cursor_pos + 1, &next, 8);
+}
+
+static void do_bgrewriteaof(std::vector<std::string_view> &, Buffer &out) {
+  if (!aof_enabled()) {
+    return out_err(out, ERR_UNKNOWN, "the append-only log is off");
+  }
+  aof_rewrite();
+  return out_nil(out);
+}
+
+static void do_bgsave(std::vector<std::string_view> &, Buffer &out) {
+  if (!snap_enabled()) {
+    return out_err(out, ERR_UNKNOWN, "snapshots are off");
+  }
+  snap_save();
+  return out_nil(out);
+}
+
+// the stats of a shard, packed as u64s: the fields, then a block per
+// command it has executed: idx, total, sum, max, nbuckets, the buckets
+// in use as (idx, count) pairs
+enum {
+  STAT_CONNS = 0,
+  STAT_ACCEPTED = 1,
+  STAT_CMDS = 2,
+  STAT_OPS_PER_SEC = 3,
+  STAT_BYTES_IN = 4,
+  STAT_BYTES_OUT = 5,
+  STAT_FORWARDED = 6,
+  STAT_EXPIRED = 7,
+  STAT_KEYS = 8,
+  STAT_SLOTS = 9,          // of the newer table
+  STAT_OLD_SLOTS = 10,     // of the older table, 0 unless rehashing
+  STAT_OLD_KEYS = 11,      // still to be migrated
+  STAT_MIGRATION_POS = 12, // older slots migrated
+  STAT_SLAB_PAGES = 13,    // bytes in slab pages
+  STAT_SLAB_USED = 14,     // of them handed out
+  STAT_LARGE_COUNT = 15,   // objects too big for the slabs
+  STAT_LARGE_BYTES = 16,
+  STAT_NFIELDS = 17,
+};
+
+static size_t htab_slots(HTab *htab) {
+  return htab->ctrl ? htab->mask + 1 : 0;
+}
+
+static void stats_pack(std::vector<uint64_t> &pack) {
+  Stats &stats = g_data.stats;
+  HMap &db = g_data.db;
+  pack.assign(STAT_NFIELDS, 0);
+  for (Conn *conn : g_data.fd2conn) {
+    pack[STAT_CONNS] += conn ? 1 : 0;
+  }
+  pack[STAT_ACCEPTED] = stats.accepted;
+  pack[STAT_CMDS] = stats_cmds();
+  pack[STAT_OPS_PER_SEC] = stats.ops_per_sec;
+  uint64_t now_ms = get_monotonic_msec();
+  if (now_ms >= stats.sample_ms + 2000) {
+    // the loop has been waiting, the last rate is stale
+    pack[STAT_OPS_PER_SEC] = (pack[STAT_CMDS] - stats.sample_cmds) * 1000 /
+                             (now_ms - stats.sample_ms);
+  }
+  pack[STAT_BYTES_IN] = stats.bytes_in;
+  pack[STAT_BYTES_OUT] = stats.bytes_out;
+  pack[STAT_FORWARDED] = stats.forwarded;
+  pack[STAT_EXPIRED] = stats.expired;
+  pack[STAT_KEYS] = hm_size(&db);
+  pack[STAT_SLOTS] = htab_slots(&db.newer);
+  pack[STAT_OLD_SLOTS] = htab_slots(&db.older);
+  pack[STAT_OLD_KEYS] = db.older.size;
+  pack[STAT_MIGRATION_POS] = db.older.ctrl ? db.migration_pos : 0;
+  SlabStats slab;
+  slab_stats(&slab);
+  pack[STAT_SLAB_PAGES] = slab.page_bytes;
+  pack[STAT_SLAB_USED] = slab.used_bytes;
+  pack[STAT_LARGE_COUNT] = slab.large_count;
+  pack[STAT_LARGE_BYTES] = slab.large_bytes;
+
+  for (size_t i = 0; i < k_nstat_cmds; i++) {
+    Hist *lat = stats.lat[i];
+    if (!lat) {
+      continue;
+    }
+    pack.insert(pack.end(), {i, lat->total, lat->sum, lat->max, 0});
+    size_t nbuckets = pack.size() - 1;
+    for (size_t b = 0; b < k_hist_buckets; b++) {
+      if (lat->counts[b]) {
+        pack.insert(pack.end(), {b, lat->counts[b]});
+        pack[nbuckets]++;
+      }
+    }
+  }
+}
+
+// the latencies of the shards merged by command, `lat` is by stats_index()
+static void stats_unpack_lat(const std::vector<uint64_t> &pack,
+                             std::vector<Hist *> &lat) {
+  for (size_t pos = STAT_NFIELDS; pos + 5 <= pack.size();) {
+    uint64_t idx = pack[pos], nbuckets = pack[pos + 4];
+    if (idx >= k_nstat_cmds || nbuckets > (pack.size() - pos - 5) / 2) {
+      return; // malformed
+    }
+    Hist *&dst = lat[idx];
+    if (!dst) {
+      dst = new Hist();
+    }
+    dst->total += pack[pos + 1];
+    dst->sum += pack[pos + 2];
+    dst->max = std::max(dst->max, pack[pos + 3]);
+    pos += 5;
+    for (uint64_t i = 0; i < nbuckets; i++, pos += 2) {
+      if (pack[pos] < k_hist_buckets) {
+        dst->counts[pack[pos]] += pack[pos + 1];
+      }
+    }
+  }
+}
+
+static void info_add(std::string &text, const char *fmt, ...)
+    __attribute__((format(printf, 2, 3)));
+
+static void info_add(std::string &text, const char *fmt, ...) {
+  char line[256];
+  va_list ap;
+  va_start(ap, fmt);
+  int n = vsnprintf(line, sizeof(line), fmt, ap);
+  va_end(ap);
+  if (n > 0) {
+    text.append(line, std::min((size_t)n, sizeof(line) - 1));
+  }
+}
+
+static void info_field(std::string &text, const char *name, uint64_t val) {
+  info_add(text, "%s:%llu\n", name, (unsigned long long)val);
+}
+
+static double ticks_to_usec(uint64_t ticks) {
+  return (double)ticks / g_tsc_per_ns / 1000;
+}
+
+// the stats of all the shards as `name:value` lines in sections, like
+// the INFO of redis; `packs` is by shard
+static void info_reply(Buffer &out,
+                       const std::vector<std::vector<uint64_t>> &packs) {
+  uint64_t sum[STAT_NFIELDS] = {};
+  std::vector<Hist *> lat(k_nstat_cmds, NULL);
+  for (const std::vector<uint64_t> &pack : packs) {
+    for (size_t i = 0; i < STAT_NFIELDS && i < pack.size(); i++) {
+      sum[i] += pack[i];
+    }
+    stats_unpack_lat(pack, lat);
+  }
+
+  std::string text;
+  text += "# Server\n";
+  info_field(text, "uptime_in_seconds",
+             (get_monotonic_msec() - g_start_ms) / 1000);
+  info_field(text, "shards", g_shards.size());
+  info_add(text, "io_engine:%s\n", g_data.ring ? "uring" : "epoll");
+  info_field(text, "aof_enabled", aof_enabled());
+  info_field(text, "snapshots_enabled", snap_enabled());
+
+  text += "\n# Clients\n";
+  info_field(text, "connected_clients", sum[STAT_CONNS]);
+  info_field(text, "total_connections_received", sum[STAT_ACCEPTED]);
+
+  text += "\n# Stats\n";
+  info_field(text, "total_commands_processed", sum[STAT_CMDS]);
+  info_field(text, "instantaneous_ops_per_sec", sum[STAT_OPS_PER_SEC]);
+  info_field(text, "total_net_input_bytes", sum[STAT_BYTES_IN]);
+  info_field(text, "total_net_output_bytes", sum[STAT_BYTES_OUT]);
+  info_field(text, "forwarded_requests", sum[STAT_FORWARDED]);
+  info_field(text, "expired_keys", sum[STAT_EXPIRED]);
+
+  // a slot is a pointer and a control byte
+  uint64_t slots = sum[STAT_SLOTS] + sum[STAT_OLD_SLOTS];
+  text += "\n# Memory\n";
+  info_field(text, "slab_page_bytes", sum[STAT_SLAB_PAGES]);
+  info_field(text, "slab_used_bytes", sum[STAT_SLAB_USED]);
+  info_field(text, "large_objects", sum[STAT_LARGE_COUNT]);
+  info_field(text, "large_object_bytes", sum[STAT_LARGE_BYTES]);
+  info_field(text, "hashtable_bytes", slots * (sizeof(HNode *) + 1));
+
+  text += "\n# Keyspace\n";
+  info_field(text, "keys", sum[STAT_KEYS]);
+  info_field(text, "table_slots", sum[STAT_SLOTS]);
+  info_field(text, "rehash_old_slots", sum[STAT_OLD_SLOTS]);
+  info_field(text, "rehash_old_keys", sum[STAT_OLD_KEYS]);
+  for (size_t id = 0; id < packs.size(); id++) {
+    const std::vector<uint64_t> &pack = packs[id];
+    if (pack.size() < STAT_NFIELDS) {
+      continue;
+    }
+    info_add(text,
+             "shard%zu:keys=%llu,slots=%llu,old_slots=%llu,migrated=%llu,"
+             "conns=%llu,ops_per_sec=%llu\n",
+             id, (unsigned long long)pack[STAT_KEYS],
+             (unsigned long long)pack[STAT_SLOTS],
+             (unsigned long long)pack[STAT_OLD_SLOTS],
+             (unsigned long long)pack[STAT_MIGRATION_POS],
+             (unsigned long long)pack[STAT_CONNS],
+             (unsigned long long)pack[STAT_OPS_PER_SEC]);
+  }
+
+  // the time in execute() on the shard, not the round trip
+  text += "\n# Latency\n";
+  for (size_t i = 0; i < k_nstat_cmds; i++) {
+    Hist *h = lat[i];
+    if (!h) {
+      continue;
+    }
+    info_add(text,
+             "cmdstat_%.*s:calls=%llu,usec_per_call=%.3f,p50=%.3f,"
+             "p99=%.3f,p999=%.3f,max=%.3f\n",
+             (int)k_stat_cmds[i].size(), k_stat_cmds[i].data(),
+             (unsigned long long)h->total,
+             ticks_to_usec(h->sum) / (double)h->total,
+             ticks_to_usec(hist_quantile(h, 0.5)),
+             ticks_to_usec(hist_quantile(h, 0.99)),
+             ticks_to_usec(hist_quantile(h, 0.999)), ticks_to_usec(h->max));
+    delete h;
+  }
+  return out_str(out, text.data(), text.size());
+}
+
+static void do_info(std::vector<std::string_view> &, Buffer &out) {
+  std::vector<std::vector<uint64_t>> packs(1);
+  stats_pack(packs[0]);
+  if (g_shards.size() > 1) {
+    // a part, the shard with the conn puts them together in multi_merge()
+    return out_str(out, (const char *)packs[0].data(), packs[0].size() * 8);
+  }
+  return info_reply(out, packs);
+}
+
+static void do_request(std::vector<std::string_view> &cmd, Buffer &out) {
+  if (cmd.size() == 2 && cmd[0] == "get") {
+    return do_get(cmd, out);
+  } else if (cmd.size() == 3 && cmd[0] == "set") {
+    return do_set(cmd, out);
+  } else if (cmd.size() >= 2 && cmd[0] == "mget") {
+    return do_mget(cmd, out);
+  } else if (cmd.size() >= 3 && cmd.size() % 2 == 1 && cmd[0] == "mset") {
+    return do_mset(cmd, out);
+  } else if (cmd.size() >= 2 && cmd[0] == "mdel") {
+    return do_mdel(cmd, out);
+  } else if (cmd.size() == 2 && (cmd[0] == "del" || cmd[0] == "unlink")) {
+    return do_del(cmd, out);
+  } else if (cmd.size() == 3 && (cmd[0] == "expire" || cmd[0] == "pexpire" ||
+                                  cmd[0] == "pexpireat")) {
+    return do_expire(cmd, out);
+  } else if (cmd.size() == 2 && (cmd[0] == "ttl" || cmd[0] == "pttl")) {
+    return do_ttl(cmd, out);
+  } else if (cmd.size() == 2 && cmd[0] == "persist") {
+    return do_persist(cmd, out);
+  } else if (cmd.size() == 4 && cmd[0] == "zadd") {
+    return do_zadd(cmd, out);
+  } else if (cmd.size() == 3 && cmd[0] == "zrem") {
+    return do_zrem(cmd, out);
+  } else if (cmd.size() == 3 && cmd[0] == "zscore") {
+    return do_zscore(cmd, out);
+  } else if (cmd.size() == 3 && cmd[0] == "zrank") {
+    return do_zrank(cmd, out);
+  } else if (cmd.size() == 4 && cmd[0] == "zrange") {
+    return do_zrange(cmd, out);
+  } else if (cmd.size() == 6 && cmd[0] == "zquery") {
+    return do_zquery(cmd, out);
+  } else if (cmd.size() == 2 && (cmd[0] == "incr" || cmd[0] == "decr")) {
+    return do_incr(cmd, out);
+  } else if (cmd.size() == 3 && (cmd[0] == "incrby" || cmd[0] == "decrby")) {
+    return do_incr(cmd, out);
+  } else if (cmd.size() == 4 && cmd[0] == "hset") {
+    return do_hset(cmd, out);
+  } else if (cmd.size() == 3 && cmd[0] == "hget") {
+    return do_hget(cmd, out);
+  } else if (cmd.size() == 3 && cmd[0] == "hdel") {
+    return do_hdel(cmd, out);
+  } else if (cmd.size() == 2 && cmd[0] == "hlen") {
+    return do_hlen(cmd, out);
+  } else if (cmd.size() == 2 && cmd[0] == "hgetall") {
+    return do_hgetall(cmd, out);
+  } else if (cmd.size() >= 3 && (cmd[0] == "lpush" || cmd[0] == "rpush")) {
+    return do_push(cmd, out);
+  } else if (cmd.size() == 2 && (cmd[0] == "lpop" || cmd[0] == "rpop")) {
+    return do_pop(cmd, out);
+  } else if (cmd.size() == 2 && cmd[0] == "llen") {
+    return do_llen(cmd, out);
+  } else if (cmd.size() == 4 && cmd[0] == "lrange") {
+    return do_lrange(cmd, out);
+  } else if (cmd.size() >= 2 && cmd.size() % 2 == 0 && cmd[0] == "scan") {
+    return do_scan(cmd, out);
+  } else if (cmd.size() == 1 && cmd[0] == "bgrewriteaof") {
+    return do_bgrewriteaof(cmd, out);
+  } else if (cmd.size() == 1 && cmd[0] == "bgsave") {
+    return do_bgsave(cmd, out);
+  } else if (cmd.size() == 1 && cmd[0] == "info") {
+    return do_info(cmd, out);
+  } else {
+    return out_err(out, ERR_UNKNOWN, "unknown command");
+  }
+}
+
+// the commands that change the data, they go to the log
+static bool cmd_is_write(std::vector<std::string_view> &cmd) {
+  static const std::string_view k_writes[] = {
+      "set",  "del",  "unlink", "expire", "pexpire", "pexpireat", "persist",
+      "zadd", "zrem", "incr",   "decr",   "incrby",  "decrby",    "hset",
+      "hdel", "lpush", "rpush", "lpop",   "rpop",    "mset",      "mdel",
+  };
+  if (cmd.size() < 2) {
+    return false;
+  }
+  for (std::string_view name : k_writes) {
+    if (cmd[0] == name) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// an entry is dumped for the current walk if its mark has the parity
+// of the epoch, a new walk flips it for all the entries at once
+static bool entry_dumped(Entry *ent) {
+  return ent->dumped == (g_data.dump_epoch & 1);
+}
+
+static void aof_dump(std::vector<std::string_view> &args) {
+  aof_append(args.data(), args.size(), AOF_REWRITE);
+}
+
+static bool cb_dump_field(std::string_view field, std::string_view val,
+                          void *arg) {
+  std::vector<std::string_view> &args = *(std::vector<std::string_view> *)arg;
+  args.resize(2);
+  args.push_back(field);
+  args.push_back(val);
+  aof_dump(args);
+  return true;
+}
+
+// list items per rpush in the compacted log
+const size_t k_dump_batch = 64;
+
+static void cb_dump_item(std::string_view val, void *arg) {
+  std::vector<std::string_view> &args = *(std::vector<std::string_view> *)arg;
+  args.push_back(val);
+  if (args.size() == 2 + k_dump_batch) {
+    aof_dump(args);
+    args.resize(2);
+  }
+}
+
+// the commands that recreate an entry, for the compacted log
+static void aof_dump_entry(Entry *ent) {
+  std::string_view key = entry_key(ent);
+  std::vector<std::string_view> args;
+  char buf[32];
+  switch (ent->type) {
+  case T_STR:
+    args = {"set", key, entry_val(ent)};
+    aof_dump(args);
+    break;
+  case T_INT: {
+    char *end = std::to_chars(buf, buf + sizeof(buf), *entry_int(ent)).ptr;
+    args = {"set", key, std::string_view(buf, end - buf)};
+    aof_dump(args);
+    break;
+  }
+  case T_ZSET:
+    for (ZNode *zn = zset_at(entry_zset(ent), 0); zn;
+         zn = znode_offset(zn, 1)) {
+      int len = snprintf(buf, sizeof(buf), "%.17g", zn->score);
+      args = {"zadd", key, std::string_view(buf, len),
+              std::string_view(zn->name, zn->len)};
+      aof_dump(args);
+    }
+    break;
+  case T_HASH:
+    args = {"hset", key};
+    dict_foreach(entry_dict(ent), &cb_dump_field, (void *)&args);
+    break;
+  case T_LIST:
+    args = {"rpush", key};
+    if (size_t n = dq_size(entry_deque(ent))) {
+      dq_range(entry_deque(ent), 0, n - 1, &cb_dump_item, (void *)&args);
+    }
+    if (args.size() > 2) {
+      aof_dump(args);
+    }
+    break;
+  }
+
+  if (ent->heap_idx != k_no_ttl) {
+    int64_t ttl_ms =
+        (int64_t)g_data.heap[ent->heap_idx].val - (int64_t)get_monotonic_msec();
+    char *end = std::to_chars(buf, buf + sizeof(buf),
+                              add_sat(get_wall_msec(), ttl_ms)).ptr;
+    args = {"pexpireat", key, std::string_view(buf, end - buf)};
+    aof_dump(args);
+  }
+}
+
+// serialized entries are handed over in blocks of about this size
+const size_t k_snap_block = 64 * 1024;
+
+static void snap_flush() {
+  if (buf_size(&g_data.snap_buf) > 0) {
+    snap_append(g_data.shard->id, &g_data.snap_buf, g_data.snap_count);
+    g_data.snap_count = 0;
+  }
+}
+
+// an entry for a snapshot, with the tags of the responses:
+// [type, key, unix-ms deadline or nil, value]
+static void snap_dump_entry(Entry *ent) {
+  Buffer &out = g_data.snap_buf;
+  size_t header = buf_size(&out);
+  buf_append_u32(out, 0); // the length, patched below
+  out_arr(out, 4);
+  out_int(out, ent->type);
+  std::string_view key = entry_key(ent);
+  out_str(out, key.data(), key.size());
+  if (ent->heap_idx != k_no_ttl) {
+    int64_t ttl_ms =
+        (int64_t)g_data.heap[ent->heap_idx].val - (int64_t)get_monotonic_msec();
+    out_int(out, add_sat(get_wall_msec(), ttl_ms));
+  } else {
+    out_nil(out);
+  }
+
+  switch (ent->type) {
+  case T_STR: {
+    std::string_view val = entry_val(ent);
+    out_str(out, val.data(), val.size());
+    break;
+  }
+  case T_INT:
+    out_int(out, *entry_int(ent));
+    break;
+  case T_ZSET:
+    out_arr(out, (uint32_t)(zset_size(entry_zset(ent)) * 2));
+    for (ZNode *zn = zset_at(entry_zset(ent), 0); zn;
+         zn = znode_offset(zn, 1)) {
+      out_str(out, zn->name, zn->len);
+      out_dbl(out, zn->score);
+    }
+    break;
+  case T_HASH:
+    out_arr(out, (uint32_t)(dict_size(entry_dict(ent)) * 2));
+    dict_foreach(entry_dict(ent), &cb_hgetall, (void *)&out);
+    break;
+  case T_LIST:
+    out_arr(out, (uint32_t)dq_size(entry_deque(ent)));
+    if (size_t n = dq_size(entry_deque(ent))) {
+      dq_range(entry_deque(ent), 0, n - 1, &cb_lrange, (void *)&out);
+    }
+    break;
+  }
+
+  uint32_t len = (uint32_t)(buf_size(&out) - header - 4);
+  buf_patch(&out, header, &len, 4);
+  g_data.snap_count++;
+  if (buf_size(&out) >= k_snap_block) {
+    snap_flush();
+  }
+}
+
+// the entry as it is now goes to the walk's output
+static void walk_dump(Entry *ent) {
+  ent->dumped = g_data.dump_epoch & 1;
+  if (g_data.walk == WALK_AOF) {
+    aof_dump_entry(ent);
+  } else {
+    snap_dump_entry(ent);
+  }
+}
+
+// log a change, relative TTLs are made absolute so a replay doesn't
+// extend them
+static void aof_log(std::vector<std::string_view> &cmd) {
+  uint32_t dest = AOF_MAIN | (g_data.aof_rewriting ? AOF_REWRITE : 0);
+  int64_t ttl_ms = 0;
+  int64_t unit = cmd[0] == "expire" ? 1000 : 1;
+  bool rel = cmd[0] == "expire" || cmd[0] == "pexpire";
+  if (rel && cmd.size() == 3 && str2int(cmd[2], ttl_ms) &&
+      !__builtin_mul_overflow(ttl_ms, unit, &ttl_ms)) {
+    char buf[24];
+    char *end = std::to_chars(buf, buf + sizeof(buf),
+                              add_sat(get_wall_msec(), ttl_ms)).ptr;
+    std::string_view args[] = {"pexpireat", cmd[1],
+                               std::string_view(buf, end - buf)};
+    return aof_append(args, 3, dest);
+  }
+  aof_append(cmd.data(), cmd.size(), dest);
+}
+
+// execute a request, and log it if it changes the data
+static uint64_t execute_logged(std::vector<std::string_view> &cmd,
+                               Buffer &out) {
+  bool logged = aof_enabled();
+  if ((!logged && !g_data.walk) || !cmd_is_write(cmd)) {
+    do_request(cmd, out);
+    return 0;
+  }
+  if (g_data.walk) {
+    // copy-on-write, a walk gets the entries as they were before the
+    // change; for a log rewrite, the change itself follows them
+    size_t step = multi_step(cmd);
+    size_t end = step ? cmd.size() : 2;
+    for (size_t i = 1; i < end; i += step ? step : 1) {
+      LookupKey key;
+      key_init(key, cmd[i]);
+      if (HNode *node = hm_lookup(&g_data.db, &key.node, &entry_eq)) {
+        Entry *ent = container_of(node, Entry, node);
+        if (!entry_dumped(ent) && !entry_expired(ent)) {
+          walk_dump(ent);
+        }
+      }
+    }
+  }
+  do_request(cmd, out);
+  if (!logged) {
+    return 0;
+  }
+  aof_log(cmd);
+  return aof_ticket();
+}
+
+// the time of a command on the shard that executes it, without the waits
+// for the network or for other shards;
+// returns the log flush the reply waits for, 0 if none
+static uint64_t execute(std::vector<std::string_view> &cmd, Buffer &out) {
+  uint64_t start = __rdtsc();
+  uint64_t seq = execute_logged(cmd, out);
+  stats_record(cmd, __rdtsc() - start);
+  return seq;
+}
+
+static void response_begin(Buffer &out, size_t *header) {
+  *header = buf_size(&out); // messege header position
+  buf_append_u32(out, 0); // reserve space
+}
+
+static size_t response_size(Buffer &out, size_t header) {
+  return buf_size(&out) - header - 4;
+}
+
+static void response_end(Buffer &out, size_t header) {
+  size_t msg_size = response_size(out, header);
+  if (msg_size > k_max_msg) {
+    buf_truncate(&out, header + 4);
+    out_err(out, ERR_TOO_BIG, "response is too big.");
+    msg_size = response_size(out, header);
+  }
+  // message header
+  uint32_t len = (uint32_t)msg_size;
+  buf_patch(&out, header, &len, 4);
+}
+
+struct MultiReq;
+
+// a request executed by the shard that owns its key,
+// then sent back to the shard that owns the connection
+struct Forward {
+  MNode node;          // link in a shard's inbox
+  uint32_t origin = 0; // the shard to reply to
+  bool done = false;   // a reply on its way back
+  Conn *conn = NULL;   // only touched by the origin thread
+  MultiReq *multi = NULL; // a part of it, see multi_request()
+  uint64_t aof_seq = 0;   // the reply is held until this flush is on disk
+  // owned copies, the receive buffer moves on once forwarded
+  std::vector<std::string> args;
+  Buffer out; // response body
+};
+
+static void shard_send(uint32_t id, Forward *fwd) {
+  Shard *shard = g_shards[id];
+  if (mq_push(&shard->inbox, &fwd->node)) {
+    // the queue was empty, the consumer may be asleep
+    uint64_t one = 1;
+    ssize_t rv = write(shard->wake_fd, &one, sizeof(one));
+    (void)rv; // only fails if the counter is saturated
+  }
+}
+
+static void forward_request(Conn *conn, uint32_t owner,
+                            std::vector<std::string_view> &cmd) {
+  Forward *fwd = new Forward();
+  fwd->origin = g_data.shard->id;
+  fwd->conn = conn;
+  fwd->args.assign(cmd.begin(), cmd.end());
+  shard_send(owner, fwd);
+  g_data.stats.forwarded++;
+}
+
+// a multi-key request whose keys are on several shards: each one executes
+// a part with its own keys, then the replies are put together in the order
+// of the keys. It's not atomic across the shards. A command for all the
+// shards is sent to each of them as is.
+struct MultiReq {
+  Conn *conn = NULL;
+  uint32_t waiting = 0;         // parts not back yet
+  std::vector<uint32_t> owners; // of each key
+  std::vector<Forward *> parts; // by shard, NULL if it owns none of the keys
+};
+
+// the part of a multi-key command with the keys owned by `shard`
+static bool multi_part(std::vector<std::string_view> &cmd, uint32_t shard,
+                       std::vector<std::string_view> &part) {
+  size_t step = multi_step(cmd);
+  part.assign(1, cmd[0]);
+  for (size_t i = 1; i < cmd.size(); i += step) {
+    if (arg_shard(cmd[i]) == shard) {
+      part.insert(part.end(), cmd.begin() + i, cmd.begin() + i + step);
+    }
+  }
+  return part.size() > 1;
+}
+
+static Forward *multi_new_part(MultiReq *multi, std::string_view name) {
+  Forward *part = new Forward();
+  part->origin = g_data.shard->id;
+  part->conn = multi->conn;
+  part->multi = multi;
+  part->args.emplace_back(name);
+  return part;
+}
+
+static void multi_request(Conn *conn, std::vector<std::string_view> &cmd) {
+  size_t step = multi_step(cmd);
+  MultiReq *multi = new MultiReq();
+  multi->conn = conn;
+  multi->parts.resize(g_shards.size(), NULL);
+  for (size_t i = 1; step && i < cmd.size(); i += step) {
+    uint32_t owner = arg_shard(cmd[i]);
+    multi->owners.push_back(owner);
+    Forward *&part = multi->parts[owner];
+    if (!part) {
+      part = multi_new_part(multi, cmd[0]);
+    }
+    part->args.insert(part->args.end(), cmd.begin() + i,
+                      cmd.begin() + i + step);
+  }
+  if (!step) {
+    // no keys, all the shards; see cmd_shard()
+    for (Forward *&part : multi->parts) {
+      part = multi_new_part(multi, cmd[0]);
+    }
+  }
+
+  Forward *local = NULL;
+  for (uint32_t id = 0; id < multi->parts.size(); id++) {
+    if (Forward *part = multi->parts[id]) {
+      if (id == g_data.shard->id) {
+        local = part;
+      } else {
+        multi->waiting++;
+        shard_send(id, part);
+        g_data.stats.forwarded++;
+      }
+    }
+  }
+  // ours while the others are busy, `cmd` is still in use by the caller
+  if (local) {
+    std::vector<std::string_view> args(local->args.begin(),
+                                       local->args.end());
+    if (uint64_t seq = execute(args, local->out)) {
+      conn->aof_seq = seq;
+    }
+  }
+  conn->pending = true;
+}
+
+// process one request if there is enough data
+static bool try_one_request(Conn *conn) {
+  if (conn->pending) {
+    return false; // responses must stay in order
+  }
+
+  // try to parse the protocol: message header
+  size_t size = rbuf_size(&conn->incoming);
+  if (size < 4) {
+    return false; // want read
+  }
+  uint32_t len = 0;
+  memcpy(&len, rbuf_data(&conn->incoming), 4);
+  if (len > k_max_msg) {
+    msg("too long");
+    conn->want_close = true;
+    return false; // want close
+  }
+
+  // message body
+  if (4 + len > size) {
+    return false; // want read
+  }
+  const uint8_t *request = rbuf_data(&conn->incoming) + 4;
+
+  // got one req, perform app logic;
+  // the args are views into `incoming`, valid until it's consumed
+  std::vector<std::string_view> &cmd = g_data.cmd;
+  if (parse_req(request, len, cmd) < 0) {
+    msg("bad request");
+    conn->want_close = true;
+    return false; // want close
+  }
+
+  uint32_t owner = cmd_shard(cmd);
+  if (owner == k_split_shards) {
+    // wait for the parts on the other shards
+    multi_request(conn, cmd);
+    rbuf_consume(&conn->incoming, 4 + len);
+    return false;
+  }
+  if (owner != g_data.shard->id) {
+    // not ours, stop processing this connection until the reply is back
+    forward_request(conn, owner, cmd);
+    conn->pending = true;
+    rbuf_consume(&conn->incoming, 4 + len);
+    return false; // wait for the reply
+  }
+
+  size_t header_pos = 0;
+  response_begin(conn->outgoing, &header_pos);
+  if (uint64_t seq = execute(cmd, conn->outgoing)) {
+    conn->aof_seq = seq;
+  }
+  response_end(conn->outgoing, header_pos);
+
+  // app logic done, remove the req message
+  rbuf_consume(&conn->incoming, 4 + len);
+
+  return true; // success
+}
+
+const size_t k_max_iov = 64;
+
+// some data has been written by either engine
+static void handle_sent(Conn *conn, size_t n) {
+  // remove written data from outgoing
+  buf_consume(&conn->outgoing, n);
+  g_data.stats.bytes_out += n;
+
+  // update the readiness intention
+  if (buf_size(&conn->outgoing) == 0) {
+    // all data is written
+    conn->want_read = !conn->pending;
+    conn->want_write = false;
+  } // else: want write
+  conn_touch(conn);
+}
+
+// app callback when the socket is writable
+static void handle_write(Conn *conn) {
+  assert(buf_size(&conn->outgoing) > 0);
+  // gather the chunks into a single syscall
+  struct iovec iov[k_max_iov];
+  size_t niov = buf_iov(&conn->outgoing, iov, k_max_iov);
+  ssize_t rv = writev(conn->fd, iov, (int)niov);
+  if (rv < 0 && errno == EAGAIN) {
+    return; // actually not ready
+  }
+
+  if (rv < 0) {
+    msg_errno("write() error");
+    conn->want_close = true;
+    return;
+  }
+
+  return handle_sent(conn, (size_t)rv);
+}
+
+// the key of a request without a full parse
+static bool peek_key(const uint8_t *data, size_t size,
+                     std::string_view &key) {
+  const uint8_t *end = data + size;
+  uint32_t nstr = 0, len = 0;
+  std::string_view name;
+  return read_u32(data, end, nstr) && nstr >= 2 &&
+         read_u32(data, end, len) && read_str(data, end, len, name) &&
+         read_u32(data, end, len) && read_str(data, end, len, key);
+}
+
+// the next batch of pipelined requests: all their keys are hashed and
+// their table groups prefetched, then the entries in them, so the misses
+// overlap instead of each request waiting for its own in turn
+static void prefetch_requests(Conn *conn) {
+  uint64_t hcodes[k_prefetch_batch];
+  size_t n = 0;
+  const uint8_t *data = rbuf_data(&conn->incoming);
+  size_t size = rbuf_size(&conn->incoming);
+  for (size_t pos = 0; n < k_prefetch_batch && size - pos >= 4;) {
+    uint32_t len = 0;
+    memcpy(&len, data + pos, 4);
+    if (len > size - pos - 4) {
+      break; // not all here yet
+    }
+    std::string_view key;
+    if (peek_key(data + pos + 4, len, key)) {
+      uint64_t hcode = str_hash((uint8_t *)key.data(), key.size());
+      if (key_shard(hcode) == g_data.shard->id) {
+        hcodes[n++] = hcode;
+      }
+    }
+    pos += 4 + len;
+  }
+  if (n < 2) {
+    return; // nothing to overlap
+  }
+  for (size_t i = 0; i < n; i++) {
+    hm_prefetch_group(&g_data.db, hcodes[i]);
+  }
+  for (size_t i = 0; i < n; i++) {
+    hm_prefetch_nodes(&g_data.db, hcodes[i]);
+  }
+}
+
+// parse req and generate response
+static void handle_requests(Conn *conn) {
+  for (size_t i = 0;; i++) {
+    if (i % k_prefetch_batch == 0) {
+      prefetch_requests(conn);
+    }
+    if (!try_one_request(conn)) {
+      break;
+    }
+  }
+  // update the readiness intention
+  if (buf_size(&conn->outgoing) > 0) {
+    conn->want_read = false;
+    if (conn->aof_seq > aof_synced()) {
+      // with fsync always, the replies wait for the changes to be on disk
+      conn->want_write = false;
+      if (!conn->held) {
+        conn->held = true;
+        g_data.held_conns.push_back(conn);
+      }
+      return;
+    }
+    conn->want_write = true;
+
+    // the socket is likely ready to write in a req-res protocol,
+    // try to write it without waiting for the next iteration;
+    // io_uring batches it with the next submission instead
+    if (!g_data.ring) {
+      handle_write(conn);
+    }
+    return;
+  }
+
+  // want read, unless a forwarded request is still out
+  conn->want_read = !conn->pending;
+  conn_touch(conn);
+}
+
+const size_t k_min_read = 64 * 1024;
+
+// app callback when the socket is readable
+static void handle_read(Conn *conn) {
+  // read some data, directly into the free space of the buffer
+  size_t avail = 0;
+  uint8_t *space = rbuf_space(&conn->incoming, k_min_read, &avail);
+  ssize_t rv = read(conn->fd, space, avail);
+  if (rv < 0 && errno == EAGAIN) {
+    return; // actually not ready
+  }
+
+  // handle IO error
+  if (rv < 0) {
+    msg_errno("read() error");
+    conn->want_close = true;
+    return; // want close
+  }
+
+  // handle EOF
+  if (rv == 0) {
+    if (rbuf_size(&conn->incoming) == 0) {
+      msg("client closed");
+    } else {
+      msg("unexpected EOF");
+    }
+    conn->want_close = true;
+    return; // want close
+  }
+
+  // got some new data
+  rbuf_commit(&conn->incoming, (size_t)rv);
+  g_data.stats.bytes_in += (size_t)rv;
+
+  return handle_requests(conn);
+}
+
+const int k_max_events = 1024;
+
+// sync the epoll interest with the app's intent,
+// a syscall is only made when `want_read`/`want_write` changed
+static void conn_update_events(Conn *conn) {
+  uint32_t events = EPOLLERR; // always poll for error
+  if (conn->want_read) {
+    events |= EPOLLIN;
+  }
+
+  if (conn->want_write) {
+    events |= EPOLLOUT;
+  }
+
+  if (events == conn->events) {
+    return; // nothing changed
+  }
+
+  struct epoll_event ev = {};
+  ev.events = events;
+  ev.data.fd = conn->fd;
+  int op = conn->events == 0 ? EPOLL_CTL_ADD : EPOLL_CTL_MOD;
+  if (epoll_ctl(g_data.epfd, op, conn->fd, &ev)) {
+    die("epoll_ctl()");
+  }
+  conn->events = events;
+}
+
+static void uring_settle(Conn *conn);
+
+// close the socket from socket error or app logic,
+// or sync the epoll interest if it stays open
+static void conn_settle(Conn *conn) {
+  if (g_data.ring) {
+    return uring_settle(conn);
+  }
+
+  if (!conn->want_close) {
+    return conn_update_events(conn);
+  }
+
+  dlist_detach(&conn->timer_node);
+  if (conn->pending || conn->held) {
+    // the forwarded request or the list of held conns still points to it,
+    // close it when the reply is back; stop polling it in the meantime
+    if (conn->events) {
+      (void)epoll_ctl(g_data.epfd, EPOLL_CTL_DEL, conn->fd, NULL);
+      conn->events = 0;
+    }
+    return;
+  }
+
+  // closing the fd also removes it from the epoll set
+  (void)close(conn->fd);
+  g_data.fd2conn[conn->fd] = NULL;
+  delete conn;
+}
+
+// the size of a nil or a string in a reply
+static size_t buf_elem_size(const Buffer &buf, size_t pos) {
+  uint8_t tag = 0;
+  buf_peek(&buf, pos, &tag, 1);
+  if (tag == TAG_NIL) {
+    return 1;
+  }
+  assert(tag == TAG_STR);
+  uint32_t len = 0;
+  buf_peek(&buf, pos + 1, &len, 4);
+  return 1 + 4 + len;
+}
+
+// the replies of the parts as one: the values of mget in the order of
+// the keys, the sum of the counts of mdel, nil for mset, and the stats
+// of all the shards for info
+static void multi_merge(MultiReq *multi, Buffer &out) {
+  std::string_view name;
+  for (Forward *part : multi->parts) {
+    if (part) {
+      name = part->args[0];
+    }
+  }
+  if (name == "info") {
+    std::vector<std::vector<uint64_t>> packs(multi->parts.size());
+    for (size_t id = 0; id < packs.size(); id++) {
+      Buffer &part = multi->parts[id]->out;
+      uint32_t len = 0;
+      buf_peek(&part, 1, &len, 4); // see do_info()
+      packs[id].resize(len / 8);
+      buf_peek(&part, 1 + 4, packs[id].data(), packs[id].size() * 8);
+    }
+    return info_reply(out, packs);
+  }
+  if (name == "mdel") {
+    int64_t total = 0;
+    for (Forward *part : multi->parts) {
+      int64_t n = 0;
+      if (part) {
+        buf_peek(&part->out, 1, &n, 8);
+      }
+      total += n;
+    }
+    return out_int(out, total);
+  }
+  if (name != "mget") {
+    return out_nil(out);
+  }
+
+  out_arr(out, (uint32_t)multi->owners.size());
+  std::vector<size_t> pos(multi->parts.size(), 1 + 4); // past the arr tag
+  std::string val;
+  for (uint32_t owner : multi->owners) {
+    Buffer &part = multi->parts[owner]->out;
+    val.resize(buf_elem_size(part, pos[owner]));
+    buf_peek(&part, pos[owner], val.data(), val.size());
+    buf_append(&out, val.data(), val.size());
+    pos[owner] += val.size();
+  }
+}
+
+// a part is back, the reply is sent once all of them are
+static void multi_reply(Forward *fwd) {
+  MultiReq *multi = fwd->multi;
+  if (--multi->waiting > 0) {
+    return;
+  }
+
+  Conn *conn = multi->conn;
+  assert(conn->pending);
+  conn->pending = false;
+  if (!conn->want_close) {
+    size_t header_pos = 0;
+    response_begin(conn->outgoing, &header_pos);
+    multi_merge(multi, conn->outgoing);
+    response_end(conn->outgoing, header_pos);
+
+    // resume the pipelined requests behind it
+    handle_requests(conn);
+  }
+  for (Forward *part : multi->parts) {
+    delete part;
+  }
+  delete multi;
+
+  conn_settle(conn);
+}
+
+// the reply of a forwarded request is back at the origin shard
+static void handle_reply(Forward *fwd) {
+  if (fwd->multi) {
+    return multi_reply(fwd);
+  }
+  Conn *conn = fwd->conn;
+  assert(conn->pending);
+  conn->pending = false;
+
+  if (!conn->want_close) {
+    size_t header_pos = 0;
+    response_begin(conn->outgoing, &header_pos);
+    buf_splice(&conn->outgoing, &fwd->out);
+    response_end(conn->outgoing, header_pos);
+
+    // resume the pipelined requests behind it
+    handle_requests(conn);
+  }
+  delete fwd;
+
+  conn_settle(conn);
+}
+
+// execute a request on behalf of another shard
+static void handle_forward(Forward *fwd) {
+  std::vector<std::string_view> &cmd = g_data.cmd;
+  cmd.assign(fwd->args.begin(), fwd->args.end());
+  fwd->aof_seq = execute(cmd, fwd->out);
+  fwd->done = true;
+  if (fwd->aof_seq > aof_synced()) {
+    // with fsync always, the reply waits for the change to be on disk
+    g_data.held_fwds.push_back(fwd);
+    return;
+  }
+  shard_send(fwd->origin, fwd);
+}
+
+// the log's I/O thread signals the wake fd once a flush is on disk,
+// the replies that waited for it go out
+static void aof_release() {
+  uint64_t synced = aof_synced();
+  size_t nfwds = 0;
+  for (Forward *fwd : g_data.held_fwds) {
+    if (fwd->aof_seq <= synced) {
+      shard_send(fwd->origin, fwd);
+    } else {
+      g_data.held_fwds[nfwds++] = fwd;
+    }
+  }
+  g_data.held_fwds.resize(nfwds);
+
+  // a resumed conn can be held again by the requests behind, so the
+  // ready ones are taken off the list first
+  std::vector<Conn *> conns;
+  size_t nconns = 0;
+  for (Conn *conn : g_data.held_conns) {
+    if (conn->aof_seq <= synced) {
+      conns.push_back(conn);
+    } else {
+      g_data.held_conns[nconns++] = conn;
+    }
+  }
+  g_data.held_conns.resize(nconns);
+  for (Conn *conn : conns) {
+    conn->held = false;
+    if (!conn->want_close) {
+      handle_requests(conn); // sends the output
+    }
+    conn_settle(conn);
+  }
+}
+
+static void handle_inbox(Shard *shard) {
+  // reset the eventfd before draining, so a push after this is not missed
+  uint64_t cnt = 0;
+  ssize_t rv = read(shard->wake_fd, &cnt, sizeof(cnt));
+  (void)rv;
+
+  MNode *node = mq_pop_all(&shard->inbox);
+  while (node) {
+    Forward *fwd = container_of(node, Forward, node);
+    node = node->next; // the node is reused once sent
+
+    if (fwd->done) {
+      handle_reply(fwd);
+    } else {
+      handle_forward(fwd);
+    }
+  }
+  aof_release();
+}
+
+// the wait timeout of the loop, up to the next deadline
+static int32_t next_timer_ms() {
+  uint64_t next_ms = (uint64_t)-1;
+  // the conns at the front of the lists are the first to time out
+  if (!dlist_empty(&g_data.idle_list)) {
+    Conn *conn = container_of(g_data.idle_list.next, Conn, timer_node);
+    next_ms = conn->last_active_ms + k_idle_timeout_ms;
+  }
+  if (!dlist_empty(&g_data.io_list)) {
+    Conn *conn = container_of(g_data.io_list.next, Conn, timer_node);
+    next_ms = std::min(next_ms, conn->last_active_ms + k_io_timeout_ms);
+  }
+  // key expiration
+  if (!g_data.heap.empty()) {
+    next_ms = std::min(next_ms, g_data.heap[0].val);
+  }
+  // a rewrite or a snapshot is noticed within a second,
+  // and a walk or a rehash doesn't wait
+  if (g_data.walk || hm_rehashing(&g_data.db)) {
+    return 0;
+  }
+  if (aof_enabled() || snap_enabled()) {
+    next_ms = std::min(next_ms, get_monotonic_msec() + 1000);
+  }
+  if (next_ms == (uint64_t)-1) {
+    return -1; // no timers, no timeouts
+  }
+
+  uint64_t now_ms = get_monotonic_msec();
+  if (next_ms <= now_ms) {
+    return 0; // missed?
+  }
+  return (int32_t)std::min<uint64_t>(next_ms - now_ms, INT32_MAX);
+}
+
+// bounded, so mass expiry doesn't stall the loop;
+// the rest is left for the next iterations, which then don't wait
+const size_t k_max_expire_works = 2000;
+
+// close the conns at the front of a list that timed out,
+// settling a conn takes it off the list
+static void reap_conns(DList *list, uint64_t timeout_ms, uint64_t now_ms) {
+  while (!dlist_empty(list)) {
+    Conn *conn = container_of(list->next, Conn, timer_node);
+    if (conn->last_active_ms + timeout_ms > now_ms) {
+      break; // the rest are newer
+    }
+    fprintf(stderr, "connection timed out: %d\n", conn->fd);
+    conn->want_close = true;
+    conn_settle(conn);
+  }
+}
+
+static void process_timers() {
+  uint64_t now_ms = get_monotonic_msec();
+  reap_conns(&g_data.idle_list, k_idle_timeout_ms, now_ms);
+  reap_conns(&g_data.io_list, k_io_timeout_ms, now_ms);
+  std::vector<HeapItem> &heap = g_data.heap;
+  size_t nworks = 0;
+  while (!heap.empty() && heap[0].val <= now_ms &&
+         nworks++ < k_max_expire_works) {
+    Entry *ent = container_of(heap[0].ref, Entry, heap_idx);
+    LookupKey key;
+    key.key = entry_key(ent);
+    key.node.hcode = ent->node.hcode;
+    entry_remove(key, ent);
+    g_data.stats.expired++;
+  }
+  stats_tick(now_ms);
+}
+
+// rehashing time per idle loop iteration, on top of the steps taken by
+// the requests, so the old table doesn't linger when it's quiet
+const uint64_t k_idle_rehash_ns = 100 * 1000;
+
+static void idle_tick(bool idle) {
+  if (idle && hm_rehashing(&g_data.db)) {
+    hm_rehash(&g_data.db, k_idle_rehash_ns);
+  }
+}
+
+// hm_scan() steps per loop iteration, while walking the keys
+const size_t k_walk_steps = 64;
+
+static void cb_walk(HNode *node, void *) {
+  Entry *ent = container_of(node, Entry, node);
+  if (!entry_dumped(ent) && !entry_expired(ent)) {
+    walk_dump(ent);
+  }
+}
+
+static void walk_start(uint32_t walk) {
+  g_data.dump_epoch++; // none of the entries is dumped now
+  g_data.walk = walk;
+  g_data.walk_cursor = 0;
+}
+
+static void walk_done() {
+  if (g_data.walk == WALK_AOF) {
+    aof_rewrite_walked();
+  } else {
+    snap_flush();
+    snap_walked(g_data.shard->id);
+  }
+  g_data.walk = WALK_NONE;
+}
+
+// persistence's share of a loop iteration: a bit of a walk,
+// then the log records go to the I/O thread
+static void persist_tick() {
+  if (!g_data.walk) {
+    // one walk at a time, the other one waits
+    if (aof_enabled() && aof_rewrite_begun(&g_data.aof_gen)) {
+      walk_start(WALK_AOF);
+      g_data.aof_rewriting = true;
+    } else if (snap_enabled() && snap_begun(&g_data.snap_gen)) {
+      walk_start(WALK_SNAP);
+    }
+  }
+  for (size_t i = 0; g_data.walk && i < k_walk_steps; i++) {
+    g_data.walk_cursor =
+        hm_scan(&g_data.db, g_data.walk_cursor, &cb_walk, NULL);
+    if (g_data.walk_cursor == 0) {
+      walk_done();
+    }
+  }
+  if (g_data.aof_rewriting && g_data.walk != WALK_AOF &&
+      !aof_rewrite_active(g_data.aof_gen)) {
+    g_data.aof_rewriting = false; // the compacted log is the live one
+  }
+  if (aof_enabled()) {
+    aof_flush();
+  }
+}
+
+// replay the log, only the keys of this shard
+static void aof_replay(const uint8_t *body, size_t len, void *arg) {
+  std::vector<std::string_view> &cmd = g_data.cmd;
+  if (parse_req(body, len, cmd) < 0 || cmd.size() < 2) {
+    return;
+  }
+  Buffer &out = *(Buffer *)arg;
+  uint32_t owner = cmd_shard(cmd);
+  if (owner == k_split_shards) {
+    // the keys may be owned differently from when it was logged
+    std::vector<std::string_view> part;
+    if (multi_part(cmd, g_data.shard->id, part)) {
+      do_request(part, out);
+    }
+  } else if (owner == g_data.shard->id) {
+    do_request(cmd, out);
+  }
+  buf_clear(&out);
+}
+
+// readers of a snapshot entry, tagged like the responses
+static bool read_tag(const uint8_t *&cur, const uint8_t *end, uint8_t tag) {
+  if (cur >= end || *cur != tag) {
+    return false;
+  }
+  cur++;
+  return true;
+}
+
+static bool read_tagged_str(const uint8_t *&cur, const uint8_t *end,
+                            std::string_view &out) {
+  uint32_t len = 0;
+  return read_tag(cur, end, TAG_STR) && read_u32(cur, end, len) &&
+         read_str(cur, end, len, out);
+}
+
+// an int or a double, both are 8 bytes
+static bool read_tagged_8(const uint8_t *&cur, const uint8_t *end,
+                          uint8_t tag, void *out) {
+  if (!read_tag(cur, end, tag) || cur + 8 > end) {
+    return false;
+  }
+  memcpy(out, cur, 8);
+  cur += 8;
+  return true;
+}
+
+static bool read_arr(const uint8_t *&cur, const uint8_t *end, uint32_t &n) {
+  return read_tag(cur, end, TAG_ARR) && read_u32(cur, end, n);
+}
+
+// fill the object of a new entry from the serialized value
+static bool snap_read_obj(Entry *ent, const uint8_t *&cur,
+                          const uint8_t *end) {
+  if (ent->type == T_INT) {
+    return read_tagged_8(cur, end, TAG_INT, entry_int(ent));
+  }
+  uint32_t n = 0;
+  if (!read_arr(cur, end, n)) {
+    return false;
+  }
+  std::string_view a, b;
+  double score = 0;
+  for (uint32_t i = 0; i < n; i++) {
+    switch (ent->type) {
+    case T_ZSET:
+      if (i % 2 == 0 && !read_tagged_str(cur, end, a)) {
+        return false;
+      }
+      if (i % 2 == 1) {
+        if (!read_tagged_8(cur, end, TAG_DBL, &score)) {
+          return false;
+        }
+        zset_insert(entry_zset(ent), a.data(), a.size(), score);
+      }
+      break;
+    case T_HASH:
+      if (!read_tagged_str(cur, end, i % 2 ? b : a)) {
+        return false;
+      }
+      if (i % 2 == 1) {
+        dict_set(entry_dict(ent), a, b);
+      }
+      break;
+    case T_LIST:
+      if (!read_tagged_str(cur, end, a)) {
+        return false;
+      }
+      dq_push(entry_deque(ent), a, false);
+      break;
+    }
+  }
+  return true;
+}
+
+// the state of a snapshot load
+struct SnapLoad {
+  size_t nmapped = 0;         // entries pointing into the file
+  std::vector<HNode *> batch; // for hm_insert_bulk()
+};
+
+// entries are put in the table in batches of this many
+const size_t k_load_batch = 1 << 20;
+
+static void snap_insert_batch(SnapLoad &load) {
+  hm_insert_bulk(&g_data.db, load.batch.data(), load.batch.size());
+  load.batch.clear();
+}
+
+// load an entry from a snapshot, if it belongs to this shard; the entry is
+// built directly, without going through the commands
+static void snap_restore(const uint8_t *data, size_t len, void *arg) {
+  SnapLoad &load = *(SnapLoad *)arg;
+  const uint8_t *cur = data, *end = data + len;
+  uint32_t n = 0;
+  int64_t type = 0;
+  LookupKey key;
+  if (!read_arr(cur, end, n) || n != 4 ||
+      !read_tagged_8(cur, end, TAG_INT, &type) || type < T_STR ||
+      type > T_LIST || !read_tagged_str(cur, end, key.key)) {
+    die("bad snapshot entry");
+  }
+  key_init(key, key.key);
+  if (key_shard(key.node.hcode) != g_data.shard->id) {
+    return; // every shard reads the whole file
+  }
+  int64_t ttl_ms = -1;
+  if (!read_tag(cur, end, TAG_NIL)) {
+    int64_t at = 0;
+    if (!read_tagged_8(cur, end, TAG_INT, &at)) {
+      die("bad snapshot entry");
+    }
+    ttl_ms = at - get_wall_msec();
+    if (ttl_ms <= 0) {
+      return; // expired while down
+    }
+  }
+
+  Entry *ent = NULL;
+  if (type == T_STR) {
+    std::string_view val;
+    if (!read_tagged_str(cur, end, val)) {
+      die("bad snapshot entry");
+    }
+    if (key.key.size() + val.size() > sizeof(MappedStr)) {
+      ent = entry_new_mapped(key.key, val, key.node.hcode);
+      load.nmapped++;
+    } else {
+      ent = entry_new(key.key, val, key.node.hcode); // no smaller mapped
+    }
+  } else {
+    ent = entry_new_obj(key.key, (uint32_t)type, key.node.hcode);
+    if (!snap_read_obj(ent, cur, end)) {
+      die("bad snapshot entry");
+    }
+  }
+  entry_set_ttl(ent, ttl_ms);
+  load.batch.push_back(&ent->node);
+  if (load.batch.size() == k_load_batch) {
+    snap_insert_batch(load);
+  }
+}
+
+static void epoll_add(int fd) {
+  struct epoll_event ev = {};
+  ev.events = EPOLLIN;
+  ev.data.fd = fd;
+  if (epoll_ctl(g_data.epfd, EPOLL_CTL_ADD, fd, &ev)) {
+    die("epoll_ctl()");
+  }
+}
+
+// the epoll engine: readiness notifications, then `read()`/`writev()`
+static void epoll_loop(Shard *shard) {
+  g_data.epfd = epoll_create1(EPOLL_CLOEXEC);
+  if (g_data.epfd < 0) {
+    die("epoll_create1()");
+  }
+
+  // these stay registered for the whole life of the shard
+  epoll_add(shard->listen_fd);
+  epoll_add(shard->wake_fd);
+
+  struct epoll_event events[k_max_events];
+
+  while (true) {
+    // wait for readiness, only the ready fds are returned
+    int timeout_ms = next_timer_ms();
+    int nready = epoll_wait(g_data.epfd, events, k_max_events, timeout_ms);
+    if (nready < 0 && errno == EINTR) {
+      continue; // not an error
+    }
+
+    if (nready < 0) {
+      die("epoll_wait");
+    }
+
+    for (int i = 0; i < nready; ++i) {
+      int fd = events[i].data.fd;
+      uint32_t ready = events[i].events;
+
+      // handle the listening socket
+      if (fd == shard->listen_fd) {
+        if (Conn *conn = handle_accept(fd)) {
+          // put it into the map
+          std::vector<Conn *> &fd2conn = g_data.fd2conn;
+          if (fd2conn.size() <= (size_t)conn->fd) {
+            fd2conn.resize(conn->fd + 1);
+          }
+          assert(!fd2conn[conn->fd]);
+          fd2conn[conn->fd] = conn;
+          g_data.stats.accepted++;
+          conn_touch(conn);
+          conn_update_events(conn);
+        }
+        continue;
+      }
+
+      // handle requests and replies from other shards
+      if (fd == shard->wake_fd) {
+        handle_inbox(shard);
+        continue;
+      }
+
+      // handle connections sockets
+      Conn *conn = g_data.fd2conn[fd];
+      if (!conn) {
+        continue; // closed by a reply earlier in this batch
+      }
+
+      if ((ready & EPOLLIN) && conn->want_read) {
+        handle_read(conn);
+      }
+
+      if ((ready & EPOLLOUT) && conn->want_write) {
+        handle_write(conn);
+      }
+
+      if (ready & (EPOLLERR | EPOLLHUP)) {
+        conn->want_close = true;
+      }
+
+      conn_settle(conn);
+    } // for each ready fd
+
+    process_timers();
+    slab_collect(); // what the reclaimer freed for this thread
+    persist_tick();
+    idle_tick(nready == 0);
+  } // the event loop
+}
+
+// the io_uring engine: multishot accept, multishot recv into provided
+// buffers, and all the sends of an iteration in a single submission
+
+// what a completion is for, stored in the low bits of `user_data`
+enum {
+  OP_ACCEPT = 1,
+  OP_WAKE = 2,
+  OP_RECV = 3,
+  OP_SEND = 4,
+  OP_CANCEL = 5,
+};
+
+enum {
+  RECV_IDLE = 0,
+  RECV_ARMED = 1,
+  RECV_CANCELLING = 2,
+};
+
+const unsigned k_uring_entries = 4096;
+const unsigned k_uring_cq_entries = 16 * 1024;
+const uint16_t k_uring_nbufs = 1024; // pow of 2
+const uint32_t k_uring_buf_size = 16 * 1024;
+// stop receiving when this much input is buffered behind unsent output
+const size_t k_max_stalled = 1 << 20;
+
+// the kernel copies the msghdr at submission (IORING_FEAT_SUBMIT_STABLE),
+// so these only live until the next `io_uring_enter()`; the data chunks
+// themselves stay in `Conn::outgoing` until the completion
+struct UringSend {
+  struct msghdr mh;
+  struct iovec iov[k_max_iov];
+};
+
+const size_t k_uring_max_sends = 256; // per submission
+
+static void uring_submit_or_die(unsigned wait_nr, int timeout_ms) {
+  if (int err = uring_submit(g_data.ring, wait_nr, timeout_ms)) {
+    errno = -err;
+    die("io_uring_enter");
+  }
+  g_data.nsends = 0;
+}
+
+static uint64_t op_data(void *ptr, uint64_t op) {
+  return (uint64_t)(uintptr_t)ptr | op;
+}
+
+static struct io_uring_sqe *uring_sqe() {
+  struct io_uring_sqe *sqe = uring_get_sqe(g_data.ring);
+  if (!sqe) {
+    // the SQ is full, flush it to the kernel
+    uring_submit_or_die(0, -1);
+    sqe = uring_get_sqe(g_data.ring);
+    assert(sqe);
+  }
+  return sqe;
+}
+
+static void uring_arm_accept(int fd) {
+  struct io_uring_sqe *sqe = uring_sqe();
+  sqe->opcode = IORING_OP_ACCEPT;
+  sqe->fd = fd;
+  sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+  sqe->user_data = op_data(NULL, OP_ACCEPT);
+}
+
+static void uring_arm_wake(int fd) {
+  struct io_uring_sqe *sqe = uring_sqe();
+  sqe->opcode = IORING_OP_POLL_ADD;
+  sqe->fd = fd;
+  sqe->poll32_events = POLLIN;
+  sqe->len = IORING_POLL_ADD_MULTI;
+  sqe->user_data = op_data(NULL, OP_WAKE);
+}
+
+static void uring_arm_recv(Conn *conn) {
+  struct io_uring_sqe *sqe = uring_sqe();
+  sqe->opcode = IORING_OP_RECV;
+  sqe->fd = conn->fd;
+  sqe->ioprio = IORING_RECV_MULTISHOT;
+  sqe->flags = IOSQE_BUFFER_SELECT;
+  sqe->buf_group = g_data.bufs.bgid;
+  sqe->user_data = op_data(conn, OP_RECV);
+  conn->recv_state = RECV_ARMED;
+  conn->inflight++;
+}
+
+static void uring_cancel_recv(Conn *conn) {
+  struct io_uring_sqe *sqe = uring_sqe();
+  sqe->opcode = IORING_OP_ASYNC_CANCEL;
+  sqe->addr = op_data(conn, OP_RECV);
+  sqe->user_data = op_data(NULL, OP_CANCEL);
+  conn->recv_state = RECV_CANCELLING;
+}
+
+static void uring_send(Conn *conn) {
+  if (g_data.nsends == k_uring_max_sends) {
+    uring_submit_or_die(0, -1);
+  }
+
+  // a full SQ is flushed here, which frees the slots, so take one after
+  struct io_uring_sqe *sqe = uring_sqe();
+  UringSend *send = &g_data.sends[g_data.nsends++];
+  send->mh = {};
+  send->mh.msg_iov = send->iov;
+  send->mh.msg_iovlen = buf_iov(&conn->outgoing, send->iov, k_max_iov);
+
+  sqe->opcode = IORING_OP_SENDMSG;
+  sqe->fd = conn->fd;
+  sqe->addr = (uint64_t)(uintptr_t)&send->mh;
+  sqe->len = 1;
+  sqe->msg_flags = MSG_NOSIGNAL;
+  sqe->user_data = op_data(conn, OP_SEND);
+  conn->send_busy = true;
+  conn->inflight++;
+}
+
+// close, or queue the ops the conn needs for the next submission
+static void uring_settle(Conn *conn) {
+  if (conn->want_close) {
+    if (!conn->shut) {
+      // completes the outstanding recv and send quickly
+      (void)shutdown(conn->fd, SHUT_RDWR);
+      conn->shut = true;
+      dlist_detach(&conn->timer_node);
+    }
+
+    if (conn->inflight == 0 && !conn->pending && !conn->queued &&
+        !conn->held) {
+      (void)close(conn->fd);
+      g_data.fd2conn[conn->fd] = NULL;
+      delete conn;
+    }
+    return;
+  }
+
+  bool need_send = conn->want_write && !conn->send_busy;
+  bool need_recv = conn->recv_state == RECV_IDLE &&
+                   rbuf_size(&conn->incoming) <= k_max_stalled;
+  if ((need_send || need_recv) && !conn->queued) {
+    conn->queued = true;
+    g_data.io_queue.push_back(conn);
+  }
+}
+
+// prepare the queued ops, the sends are batched into a few syscalls
+static void uring_flush_queue() {
+  for (size_t i = 0; i < g_data.io_queue.size(); ++i) {
+    Conn *conn = g_data.io_queue[i];
+    conn->queued = false;
+    if (conn->want_close) {
+      uring_settle(conn);
+      continue;
+    }
+
+    if (conn->recv_state == RECV_IDLE &&
+        rbuf_size(&conn->incoming) <= k_max_stalled) {
+      uring_arm_recv(conn);
+    }
+
+    if (conn->want_write && !conn->send_busy) {
+      uring_send(conn);
+    }
+  }
+  g_data.io_queue.clear();
+}
+
+static void uring_on_accept(int connfd) {
+  struct sockaddr_in client_addr = {};
+  socklen_t socklen = sizeof(client_addr);
+  (void)getpeername(connfd, (struct sockaddr *)&client_addr, &socklen);
+
+  Conn *conn = conn_new(connfd, client_addr);
+  // put it into the map
+  std::vector<Conn *> &fd2conn = g_data.fd2conn;
+  if (fd2conn.size() <= (size_t)conn->fd) {
+    fd2conn.resize(conn->fd + 1);
+  }
+  assert(!fd2conn[conn->fd]);
+  fd2conn[conn->fd] = conn;
+  g_data.stats.accepted++;
+  conn_touch(conn);
+  uring_settle(conn); // arms the recv
+}
+
+static void uring_on_recv(Conn *conn, int res, uint32_t flags) {
+  if (!(flags & IORING_CQE_F_MORE)) {
+    conn->inflight--; // the multishot recv has terminated
+    conn->recv_state = RECV_IDLE;
+  }
+
+  if (res > 0) {
+    // got some new data, the buffer goes back to the kernel right away
+    uint16_t bid = (uint16_t)(flags >> IORING_CQE_BUFFER_SHIFT);
+    rbuf_append(&conn->incoming, uring_buf(&g_data.bufs, bid), (size_t)res);
+    g_data.stats.bytes_in += (size_t)res;
+    uring_buf_recycle(&g_data.bufs, bid);
+
+    if (conn->want_read) {
+      handle_requests(conn);
+    } else if (rbuf_size(&conn->incoming) > k_max_stalled &&
+               conn->recv_state == RECV_ARMED) {
+      // the peer isn't reading responses, stop reading requests
+      uring_cancel_recv(conn);
+    }
+  } else if (res == 0) {
+    // handle EOF
+    if (rbuf_size(&conn->incoming) == 0) {
+      msg("client closed");
+    } else {
+      msg("unexpected EOF");
+    }
+    conn->want_close = true;
+  } else if (res != -ENOBUFS && res != -ECANCELED) {
+    // handle IO error; running out of buffers just needs a re-arm
+    errno = -res;
+    msg_errno("recv() error");
+    conn->want_close = true;
+  }
+
+  uring_settle(conn);
+}
+
+static void uring_on_send(Conn *conn, int res) {
+  conn->inflight--;
+  conn->send_busy = false;
+  if (res < 0) {
+    errno = -res;
+    msg_errno("send() error");
+    conn->want_close = true;
+  } else {
+    handle_sent(conn, (size_t)res);
+    if (conn->want_read && rbuf_size(&conn->incoming) > 0) {
+      // resume the input buffered while the output was pending
+      handle_requests(conn);
+    }
+  }
+
+  uring_settle(conn);
+}
+
+static void uring_loop(Shard *shard) {
+  // these stay armed for the whole life of the shard
+  uring_arm_accept(shard->listen_fd);
+  uring_arm_wake(shard->wake_fd);
+
+  while (true) {
+    uring_flush_queue();
+
+    // submit everything and wait for completions or the next timer
+    uring_submit_or_die(1, next_timer_ms());
+
+    size_t ncqes = 0;
+    while (struct io_uring_cqe *cqe = uring_peek_cqe(g_data.ring)) {
+      ncqes++;
+      uint64_t data = cqe->user_data;
+      int res = cqe->res;
+      uint32_t flags = cqe->flags;
+      uring_cqe_seen(g_data.ring);
+
+      uint64_t op = data & 7;
+      Conn *conn = (Conn *)(uintptr_t)(data & ~(uint64_t)7);
+      switch (op) {
+      case OP_ACCEPT:
+        if (res >= 0) {
+          uring_on_accept(res);
+        } else {
+          errno = -res;
+          msg_errno("accept() error");
+        }
+        if (!(flags & IORING_CQE_F_MORE)) {
+          uring_arm_accept(shard->listen_fd);
+        }
+        break;
+      case OP_WAKE:
+        // handle requests and replies from other shards
+        handle_inbox(shard);
+        if (!(flags & IORING_CQE_F_MORE)) {
+          uring_arm_wake(shard->wake_fd);
+        }
+        break;
+      case OP_RECV:
+        uring_on_recv(conn, res, flags);
+        break;
+      case OP_SEND:
+        uring_on_send(conn, res);
+        break;
+      default: // OP_CANCEL
+        break;
+      }
+    } // for each completion
+
+    process_timers();
+    slab_collect(); // what the reclaimer freed for this thread
+    persist_tick();
+    idle_tick(ncqes == 0);
+  } // the event loop
+}
+
+static bool uring_setup() {
+  Uring *ring = new Uring();
+  int err = uring_init(ring, k_uring_entries, k_uring_cq_entries);
+  if (!err) {
+    err = uring_buf_ring_init(ring, &g_data.bufs, 0, k_uring_nbufs,
+                              k_uring_buf_size);
+  }
+  if (err) {
+    errno = -err;
+    msg_errno("io_uring unavailable, falling back to epoll");
+    delete ring;
+    return false;
+  }
+
+  g_data.ring = ring;
+  g_data.sends = new UringSend[k_uring_max_sends];
+  return true;
+}
+
+// load the snapshot without copying the big strings, into a table
+// that's big enough for the shard's share of the keys
+static void snap_warm_start() {
+  uint64_t nentries = 0;
+  if (!snap_open(&nentries)) {
+    die("snap_open()");
+  }
+  uint64_t share = nentries / g_shards.size();
+  hm_reserve(&g_data.db, share + share / 16 + 64); // the hashing varies
+  SnapLoad load;
+  bool ok = snap_load(&snap_restore, &load);
+  snap_insert_batch(load);
+  snap_hold(load.nmapped);
+  snap_release(1); // the one from snap_open()
+  if (!ok) {
+    die("snap_load()");
+  }
+}
+
+// the event loop of a shard, runs on its own thread
+static void shard_loop(Shard *shard, bool use_uring) {
+  g_data.shard = shard;
+  // the log has the latest data if there is one
+  if (aof_enabled() || snap_enabled()) {
+    uint64_t start_ms = get_monotonic_msec();
+    Buffer out;
+    if (aof_enabled() && !aof_load(&aof_replay, &out)) {
+      die("aof_load()");
+    }
+    if (!aof_enabled()) {
+      snap_warm_start();
+    }
+    fprintf(stderr, "shard %u: %zu keys loaded in %llu ms\n", shard->id,
+            hm_size(&g_data.db),
+            (unsigned long long)(get_monotonic_msec() - start_ms));
+  }
+  if (aof_enabled()) {
+    aof_set_wake_fd(shard->wake_fd);
+  }
+  if (use_uring && uring_setup()) {
+    return uring_loop(shard);
+  }
+  return epoll_loop(shard);
+}
+
+static int listen_on(uint16_t port) {
+  // the listening socket
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  if (fd < 0) {
+    die("socket()");
+  }
+
+  // every shard binds its own socket to the same port,
+  // the kernel balances new connections between them
+  int val = 1;
+  setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &val, sizeof(val));
+  setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &val, sizeof(val));
+
+  // bind
+  struct sockaddr_in addr = {};
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port);
+  addr.sin_addr.s_addr = htonl(0);
+  int rv = bind(fd, (const sockaddr *)&addr, sizeof(addr));
+  if (rv) {
+    die("bind()");
+  }
+
+  // set the fd to non blocking
+  fd_set_nb(fd);
+
+  // listen
+  rv = listen(fd, SOMAXCONN);
+  if (rv) {
+    die("listen()");
+  }
+  return fd;
+}
+
+static void usage(const char *prog) {
+  fprintf(stderr,
+          "usage: %s [-p port] [-t threads] [-e epoll|uring]\n"
+          "          [-a aof-file] [-f always|everysec|no]\n"
+          "          [-s snapshot-file] [-i snapshot-interval-secs]\n",
+          prog);
+  exit(1);
+}
+
+int main(int argc, char **argv) {
+  uint16_t port = 1234;
+  uint32_t nthreads = std::thread::hardware_concurrency();
+  bool use_uring = false;
+  const char *aof_path = NULL;
+  int aof_fsync = AOF_FSYNC_EVERYSEC;
+  const char *snap_path = NULL;
+  uint32_t snap_interval_s = 0;
+  for (int i = 1; i < argc; ++i) {
+    if (!strcmp(argv[i], "-p") && i + 1 < argc) {
+      port = (uint16_t)atoi(argv[++i]);
+    } else if (!strcmp(argv[i], "-t") && i + 1 < argc) {
+      nthreads = (uint32_t)atoi(argv[++i]);
+    } else if (!strcmp(argv[i], "-e") && i + 1 < argc) {
+      const char *engine = argv[++i];
+      if (!strcmp(engine, "uring")) {
+        use_uring = true;
+      } else if (strcmp(engine, "epoll")) {
+        usage(argv[0]);
+      }
+    } else if (!strcmp(argv[i], "-a") && i + 1 < argc) {
+      aof_path = argv[++i];
+    } else if (!strcmp(argv[i], "-f") && i + 1 < argc) {
+      const char *policy = argv[++i];
+      if (!strcmp(policy, "always")) {
+        aof_fsync = AOF_FSYNC_ALWAYS;
+      } else if (!strcmp(policy, "everysec")) {
+        aof_fsync = AOF_FSYNC_EVERYSEC;
+      } else if (!strcmp(policy, "no")) {
+        aof_fsync = AOF_FSYNC_NO;
+      } else {
+        usage(argv[0]);
+      }
+    } else if (!strcmp(argv[i], "-s") && i + 1 < argc) {
+      snap_path = argv[++i];
+    } else if (!strcmp(argv[i], "-i") && i + 1 < argc) {
+      snap_interval_s = (uint32_t)atoi(argv[++i]);
+    } else {
+      usage(argv[0]);
+    }
+  }
+  if (nthreads == 0) {
+    nthreads = 1;
+  }
+
+  // a peer closing early shouldn't kill the process on write
+  signal(SIGPIPE, SIG_IGN);
+
+  // random per process, so clients can't pick colliding keys
+  hash_init(0);
+
+  // big values are freed off the event loops
+  if (!reclaim_init()) {
+    die("eventfd()");
+  }
+
+  g_start_ms = get_monotonic_msec();
+  tsc_calibrate(); // for the latencies of info
+
+  // every shard replays its own keys from the log
+  if (aof_path && !aof_open(aof_path, aof_fsync, nthreads)) {
+    die("aof_open()");
+  }
+  // or load the snapshot, without the log
+  if (snap_path && !snap_init(snap_path, nthreads, snap_interval_s)) {
+    die("snap_init()");
+  }
+
+  // one shard per event loop thread
+  for (uint32_t i = 0; i < nthreads; ++i) {
+    Shard *shard = new Shard();
+    shard->id = i;
+    shard->listen_fd = listen_on(port);
+    shard->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (shard->wake_fd < 0) {
+      die("eventfd()");
+    }
+    g_shards.push_back(shard);
+  }
+
+  std::vector<std::thread> threads;
+  for (Shard *shard : g_shards) {
+    threads.emplace_back(shard_loop, shard, use_uring);
+  }
+
+  for (std::thread &th : threads) {
+    th.join();
+  }
 
   return 0;
 }
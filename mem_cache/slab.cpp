@@ -0,0 +1,199 @@
+#include "slab.h"
+#include "mpsc.h"
+#include <assert.h>
+#include <stdlib.h>
+
+static void die_oom() { abort(); }
+
+// objects are carved from 64K pages, which are never returned to malloc,
+// a freed object goes on the free list of its class
+const size_t k_slab_page = 64 * 1024;
+
+// the first word of a free object
+struct SlabFree {
+  SlabFree *next;
+};
+
+struct SlabClass {
+  SlabFree *free = NULL;  // freed objects
+  uint8_t *bump = NULL;   // the uncarved part of the last page
+  uint8_t *bump_end = NULL;
+  size_t pages = 0;
+  size_t used = 0;
+  size_t nfree = 0;
+};
+
+// objects freed for another thread, chained per class,
+// so the owner takes them back without touching each one
+struct SlabBatch {
+  MNode node;
+  SlabFree *head[k_slab_classes] = {};
+  SlabFree *tail[k_slab_classes] = {};
+  size_t count[k_slab_classes] = {};
+  size_t large_count = 0; // already returned to malloc
+  size_t large_bytes = 0;
+};
+
+struct SlabHeap {
+  SlabClass classes[k_slab_classes];
+  size_t large_count = 0;
+  size_t large_bytes = 0;
+  MQueue remote;           // batches from other threads
+  SlabBatch *batch = NULL; // collecting frees for `owner`
+  SlabHeap *owner = NULL;
+};
+
+static thread_local SlabHeap g_slab;
+
+// classes are 16 bytes apart up to 128, then 4 per power of 2,
+// so the rounding waste stays under 25%
+static size_t class_index(size_t size) {
+  if (size <= 128) {
+    return size <= 16 ? 0 : (size - 1) / 16;
+  }
+  size_t lg = 63 - __builtin_clzll(size - 1); // 2^lg < size <= 2^(lg+1)
+  return 8 + (lg - 7) * 4 + ((size - 1 - ((size_t)1 << lg)) >> (lg - 2));
+}
+
+static size_t class_size(size_t idx) {
+  if (idx < 8) {
+    return (idx + 1) * 16;
+  }
+  size_t lg = 7 + (idx - 8) / 4;
+  return ((size_t)1 << lg) + ((idx - 8) % 4 + 1) * ((size_t)1 << (lg - 2));
+}
+
+size_t slab_size(size_t size) {
+  return size <= k_slab_max ? class_size(class_index(size)) : size;
+}
+
+void *slab_alloc(size_t size) {
+  assert(!g_slab.batch); // only frees while collecting for another thread
+  if (size > k_slab_max) {
+    void *ptr = malloc(size);
+    if (!ptr) {
+      die_oom();
+    }
+    g_slab.large_count++;
+    g_slab.large_bytes += size;
+    return ptr;
+  }
+
+  size_t idx = class_index(size);
+  SlabClass &cls = g_slab.classes[idx];
+  cls.used++;
+  // reuse a freed object
+  if (SlabFree *obj = cls.free) {
+    cls.free = obj->next;
+    cls.nfree--;
+    return obj;
+  }
+  // carve a new one, from a new page if needed
+  size_t osize = class_size(idx);
+  if (cls.bump + osize > cls.bump_end) {
+    cls.bump = (uint8_t *)malloc(k_slab_page);
+    if (!cls.bump) {
+      die_oom();
+    }
+    cls.bump_end = cls.bump + k_slab_page - k_slab_page % osize;
+    cls.pages++;
+  }
+  void *ptr = cls.bump;
+  cls.bump += osize;
+  return ptr;
+}
+
+static void batch_free(SlabBatch *batch, void *ptr, size_t size) {
+  if (size > k_slab_max) {
+    batch->large_count++;
+    batch->large_bytes += size;
+    return free(ptr);
+  }
+
+  size_t idx = class_index(size);
+  SlabFree *obj = (SlabFree *)ptr;
+  obj->next = batch->head[idx];
+  if (!batch->tail[idx]) {
+    batch->tail[idx] = obj;
+  }
+  batch->head[idx] = obj;
+  batch->count[idx]++;
+}
+
+void slab_free(void *ptr, size_t size) {
+  if (!ptr) {
+    return;
+  }
+  if (g_slab.batch) {
+    return batch_free(g_slab.batch, ptr, size);
+  }
+  if (size > k_slab_max) {
+    g_slab.large_count--;
+    g_slab.large_bytes -= size;
+    return free(ptr);
+  }
+
+  SlabClass &cls = g_slab.classes[class_index(size)];
+  assert(cls.used > 0);
+  SlabFree *obj = (SlabFree *)ptr;
+  obj->next = cls.free;
+  cls.free = obj;
+  cls.used--;
+  cls.nfree++;
+}
+
+void slab_stats(SlabStats *stats) {
+  *stats = SlabStats{};
+  for (size_t i = 0; i < k_slab_classes; i++) {
+    const SlabClass &cls = g_slab.classes[i];
+    SlabClassStats &out = stats->classes[i];
+    out.size = class_size(i);
+    out.pages = cls.pages;
+    out.used = cls.used;
+    out.free = cls.nfree;
+    stats->page_bytes += cls.pages * k_slab_page;
+    stats->used_bytes += cls.used * out.size;
+  }
+  stats->large_count = g_slab.large_count;
+  stats->large_bytes = g_slab.large_bytes;
+}
+
+SlabHeap *slab_heap() { return &g_slab; }
+
+void slab_remote_begin(SlabHeap *owner) {
+  assert(!g_slab.batch && owner != &g_slab);
+  g_slab.batch = new SlabBatch();
+  g_slab.owner = owner;
+}
+
+void slab_remote_end() {
+  mq_push(&g_slab.owner->remote, &g_slab.batch->node);
+  g_slab.batch = NULL;
+  g_slab.owner = NULL;
+}
+
+void slab_collect() {
+  if (!g_slab.remote.head.load(std::memory_order_relaxed)) {
+    return; // the common case, no atomic write
+  }
+  MNode *node = mq_pop_all(&g_slab.remote);
+  while (node) {
+    SlabBatch *batch = (SlabBatch *)node; // the first member
+    node = node->next;
+    // splice the chains onto the free lists
+    for (size_t i = 0; i < k_slab_classes; i++) {
+      if (!batch->count[i]) {
+        continue;
+      }
+      SlabClass &cls = g_slab.classes[i];
+      assert(cls.used >= batch->count[i]);
+      batch->tail[i]->next = cls.free;
+      cls.free = batch->head[i];
+      cls.used -= batch->count[i];
+      cls.nfree += batch->count[i];
+    }
+    g_slab.large_count -= batch->large_count;
+    g_slab.large_bytes -= batch->large_bytes;
+    delete batch;
+  }
+}
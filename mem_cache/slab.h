@@ -0,0 +1,43 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// size-classed slab allocator for small objects,
+// the state is per thread, memory must be freed by the thread that got it
+// or handed back to it with slab_remote_begin()
+const size_t k_slab_max = 4096;   // bigger objects go to malloc
+const size_t k_slab_classes = 28; // no of size classes up to k_slab_max
+
+// per size class usage
+struct SlabClassStats {
+  size_t size = 0;  // object size of the class
+  size_t pages = 0; // slab pages carved into this class
+  size_t used = 0;  // objects handed out
+  size_t free = 0;  // objects on the free list
+};
+
+struct SlabStats {
+  SlabClassStats classes[k_slab_classes];
+  size_t page_bytes = 0;  // memory held in slab pages
+  size_t used_bytes = 0;  // object bytes handed out, incl. class rounding
+  size_t large_count = 0; // objects too big for a class
+  size_t large_bytes = 0;
+};
+
+// the usable size of an allocation of `size` bytes
+size_t slab_size(size_t size);
+void *slab_alloc(size_t size);
+// `size` must be what was passed to `slab_alloc()`
+void slab_free(void *ptr, size_t size);
+void slab_stats(SlabStats *stats);
+
+// the allocator state of a thread
+struct SlabHeap;
+SlabHeap *slab_heap();
+// until slab_remote_end(), the frees of this thread are collected for
+// `owner` instead, they're handed back in one batch
+void slab_remote_begin(SlabHeap *owner);
+void slab_remote_end();
+// take back the objects other threads freed for this one
+void slab_collect();
@@ -0,0 +1,434 @@
+#include "snapshot.h"
+#include "mpsc.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
+
+static void die(const char *msg) {
+  fprintf(stderr, "[%d] %s\n", errno, msg);
+  abort();
+}
+
+const char k_magic[8] = {'M', 'C', 'S', 'N', 'A', 'P', '0', '1'};
+const size_t k_header_size = 8 + 4;
+const size_t k_block_header = 4 + 4 + 4;
+const uint32_t k_end_writer = (uint32_t)-1;
+
+// crc32c (Castagnoli), the SSE4.2 instruction if the CPU has it,
+// checked at run time so it doesn't depend on the build flags
+struct CrcTable {
+  uint32_t v[256];
+  CrcTable() {
+    for (uint32_t i = 0; i < 256; i++) {
+      uint32_t crc = i;
+      for (int k = 0; k < 8; k++) {
+        crc = (crc >> 1) ^ (0x82f63b78 & (0 - (crc & 1)));
+      }
+      v[i] = crc;
+    }
+  }
+};
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2"))) static uint32_t
+crc32c_hw(uint32_t crc, const uint8_t *p, size_t n) {
+  for (; n >= 8; p += 8, n -= 8) {
+    uint64_t v = 0;
+    memcpy(&v, p, 8);
+    crc = (uint32_t)_mm_crc32_u64(crc, v);
+  }
+  for (; n; p++, n--) {
+    crc = _mm_crc32_u8(crc, *p);
+  }
+  return crc;
+}
+#endif
+
+static uint32_t crc32c(uint32_t crc, const uint8_t *p, size_t n) {
+  crc = ~crc;
+#if defined(__x86_64__)
+  static const bool hw = __builtin_cpu_supports("sse4.2");
+  if (hw) {
+    return ~crc32c_hw(crc, p, n);
+  }
+#endif
+  static const CrcTable table;
+  for (; n; p++, n--) {
+    crc = table.v[(crc ^ *p) & 0xff] ^ (crc >> 8);
+  }
+  return ~crc;
+}
+
+// entries serialized by a writer
+struct SnapBlock {
+  MNode node;
+  Buffer data;
+  uint32_t writer = 0;
+  uint32_t nentries = 0;
+  bool walked = false; // the last block of the writer
+};
+
+static struct {
+  bool enabled = false;
+  std::string path;
+  uint32_t nwriters = 0;
+  uint32_t interval_s = 0;
+  MQueue blocks;
+  int wake_fd = -1;
+  std::atomic<bool> save_req{false};
+  std::atomic<uint64_t> gen{0}; // the last snapshot started
+  // owned by the snapshot thread
+  int fd = -1; // the file being written
+  uint64_t offset = 0;
+  uint32_t nwalked = 0;
+  uint64_t nentries = 0;
+  uint64_t start_ms = 0;
+  uint64_t saved_ms = 0;
+} g_snap;
+
+static void snap_loop();
+
+static uint64_t get_monotonic_msec() {
+  struct timespec tv = {0, 0};
+  clock_gettime(CLOCK_MONOTONIC, &tv);
+  return uint64_t(tv.tv_sec) * 1000 + tv.tv_nsec / 1000 / 1000;
+}
+
+static std::string tmp_path() { return g_snap.path + ".tmp"; }
+
+bool snap_init(const char *path, uint32_t nwriters, uint32_t interval_s) {
+  g_snap.path = path;
+  g_snap.nwriters = nwriters;
+  g_snap.interval_s = interval_s;
+  g_snap.saved_ms = get_monotonic_msec();
+  g_snap.wake_fd = eventfd(0, EFD_CLOEXEC);
+  if (g_snap.wake_fd < 0) {
+    return false;
+  }
+  g_snap.enabled = true;
+  std::thread(snap_loop).detach();
+  return true;
+}
+
+bool snap_enabled() { return g_snap.enabled; }
+
+static void wake_snap() {
+  uint64_t one = 1;
+  ssize_t rv = write(g_snap.wake_fd, &one, sizeof(one));
+  (void)rv; // only fails if the counter is saturated
+}
+
+void snap_save() {
+  g_snap.save_req.store(true);
+  wake_snap();
+}
+
+bool snap_begun(uint64_t *gen) {
+  uint64_t cur = g_snap.gen.load(std::memory_order_acquire);
+  if (cur == *gen) {
+    return false;
+  }
+  *gen = cur;
+  return true;
+}
+
+static void push_block(SnapBlock *blk) {
+  if (mq_push(&g_snap.blocks, &blk->node)) {
+    wake_snap(); // the queue was empty, the thread may be asleep
+  }
+}
+
+void snap_append(uint32_t id, Buffer *data, uint32_t nentries) {
+  SnapBlock *blk = new SnapBlock();
+  blk->writer = id;
+  blk->nentries = nentries;
+  buf_splice(&blk->data, data);
+  push_block(blk);
+}
+
+void snap_walked(uint32_t id) {
+  SnapBlock *blk = new SnapBlock();
+  blk->writer = id;
+  blk->walked = true;
+  push_block(blk);
+}
+
+// the snapshot file mapped for loading
+static struct {
+  std::mutex mu; // for mapping and unmapping
+  const uint8_t *data = NULL;
+  size_t size = 0;
+  std::atomic<size_t> refs{0};
+} g_map;
+
+// the end block is the last one, with the no of entries
+static bool read_end(const uint8_t *data, size_t size, uint64_t *nentries) {
+  if (size < k_header_size + k_block_header + 8 ||
+      memcmp(data, k_magic, 8) != 0) {
+    return false;
+  }
+  const uint8_t *end = data + size - k_block_header - 8;
+  uint32_t len = 0, crc = 0, writer = 0;
+  memcpy(&len, end, 4);
+  memcpy(&crc, end + 4, 4);
+  memcpy(&writer, end + 8, 4);
+  memcpy(nentries, end + k_block_header, 8);
+  return len == 8 && writer == k_end_writer &&
+         crc == crc32c(0, end + k_block_header, 8);
+}
+
+bool snap_open(uint64_t *nentries) {
+  *nentries = 0;
+  std::lock_guard<std::mutex> lock(g_map.mu);
+  if (!g_map.data) {
+    int fd = open(g_snap.path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0 && errno == ENOENT) {
+      g_map.refs++; // nothing to map, released all the same
+      return true;
+    }
+    if (fd < 0) {
+      return false;
+    }
+    struct stat st = {};
+    if (fstat(fd, &st) || st.st_size == 0) {
+      close(fd);
+      return false;
+    }
+    size_t size = (size_t)st.st_size;
+    void *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+      return false;
+    }
+    // start the page-in, every writer reads the whole file
+    madvise(map, size, MADV_WILLNEED);
+    g_map.data = (const uint8_t *)map;
+    g_map.size = size;
+  }
+  g_map.refs++;
+  if (!read_end(g_map.data, g_map.size, nentries)) {
+    g_map.refs--; // left mapped, the other writers fail the same way
+    return false;
+  }
+  return true;
+}
+
+void snap_hold(size_t n) { g_map.refs += n; }
+
+void snap_release(size_t n) {
+  if (g_map.refs.fetch_sub(n) != n) {
+    return;
+  }
+  std::lock_guard<std::mutex> lock(g_map.mu);
+  if (g_map.refs == 0 && g_map.data) { // not mapped again meanwhile
+    munmap((void *)g_map.data, g_map.size);
+    g_map.data = NULL;
+  }
+}
+
+bool snap_load(void (*f)(const uint8_t *data, size_t len, void *arg),
+               void *arg) {
+  const uint8_t *data = g_map.data;
+  size_t size = g_map.size;
+  if (!data) {
+    return true; // no file
+  }
+  bool ok = true;
+  bool ended = false;
+  size_t pos = k_header_size;
+  while (ok && !ended && size - pos >= k_block_header) {
+    uint32_t len = 0, crc = 0, writer = 0;
+    memcpy(&len, data + pos, 4);
+    memcpy(&crc, data + pos + 4, 4);
+    memcpy(&writer, data + pos + 8, 4);
+    const uint8_t *cur = data + pos + k_block_header;
+    if (len > size - pos - k_block_header) {
+      ok = false; // cut short
+      break;
+    }
+    pos += k_block_header + len;
+    ended = writer == k_end_writer;
+    if (ended) {
+      continue;
+    }
+
+    ok = crc32c(0, cur, len) == crc;
+    const uint8_t *end = cur + len;
+    while (ok && cur < end) {
+      uint32_t elen = 0;
+      ok = end - cur >= 4;
+      if (ok) {
+        memcpy(&elen, cur, 4);
+        ok = elen <= (size_t)(end - cur - 4);
+      }
+      if (ok) {
+        f(cur + 4, elen, arg);
+        cur += 4 + elen;
+      }
+    }
+  }
+  return ok && ended;
+}
+
+// snapshot thread from here on
+
+static void pwrite_all(int fd, const void *data, size_t len, uint64_t off) {
+  const uint8_t *p = (const uint8_t *)data;
+  while (len > 0) {
+    ssize_t rv = pwrite(fd, p, len, (off_t)off);
+    if (rv < 0 && errno == EINTR) {
+      continue;
+    }
+    if (rv < 0) {
+      die("snapshot: pwrite()");
+    }
+    p += rv;
+    off += (uint64_t)rv;
+    len -= (size_t)rv;
+  }
+}
+
+static void write_header(uint32_t len, uint32_t crc, uint32_t writer,
+                         uint64_t off) {
+  uint8_t hdr[k_block_header];
+  memcpy(hdr, &len, 4);
+  memcpy(hdr + 4, &crc, 4);
+  memcpy(hdr + 8, &writer, 4);
+  pwrite_all(g_snap.fd, hdr, sizeof(hdr), off);
+}
+
+static void snap_start() {
+  g_snap.fd = open(tmp_path().c_str(),
+                   O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (g_snap.fd < 0) {
+    perror("snapshot: can't start");
+    return;
+  }
+  uint8_t hdr[k_header_size];
+  memcpy(hdr, k_magic, 8);
+  memcpy(hdr + 8, &g_snap.nwriters, 4);
+  pwrite_all(g_snap.fd, hdr, sizeof(hdr), 0);
+  g_snap.offset = sizeof(hdr);
+  g_snap.nwalked = 0;
+  g_snap.nentries = 0;
+  g_snap.start_ms = get_monotonic_msec();
+  // the writers see it from their loops, the file is ready before that
+  g_snap.gen.fetch_add(1, std::memory_order_release);
+}
+
+// the checksum is computed while writing, the header goes in last
+static void write_block(SnapBlock *blk) {
+  uint64_t hdr_off = g_snap.offset;
+  uint64_t off = hdr_off + k_block_header;
+  uint32_t crc = 0;
+  size_t len = 0;
+  struct iovec iov[64];
+  while (buf_size(&blk->data) > 0) {
+    size_t n = buf_iov(&blk->data, iov, 64);
+    size_t nbytes = 0;
+    for (size_t i = 0; i < n; i++) {
+      crc = crc32c(crc, (const uint8_t *)iov[i].iov_base, iov[i].iov_len);
+      pwrite_all(g_snap.fd, iov[i].iov_base, iov[i].iov_len, off);
+      off += iov[i].iov_len;
+      nbytes += iov[i].iov_len;
+    }
+    buf_consume(&blk->data, nbytes);
+    len += nbytes;
+  }
+  write_header((uint32_t)len, crc, blk->writer, hdr_off);
+  g_snap.offset = off;
+  g_snap.nentries += blk->nentries;
+}
+
+static void snap_finish() {
+  uint64_t off = g_snap.offset + k_block_header;
+  pwrite_all(g_snap.fd, &g_snap.nentries, 8, off);
+  write_header(8, crc32c(0, (const uint8_t *)&g_snap.nentries, 8),
+               k_end_writer, g_snap.offset);
+  if (fdatasync(g_snap.fd)) {
+    die("snapshot: fdatasync()");
+  }
+  close(g_snap.fd);
+  g_snap.fd = -1;
+  if (rename(tmp_path().c_str(), g_snap.path.c_str())) {
+    die("snapshot: rename()");
+  }
+  // make the rename durable
+  size_t slash = g_snap.path.rfind('/');
+  std::string dir = slash == std::string::npos ? "." :
+                    g_snap.path.substr(0, slash + 1);
+  int dfd = open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (dfd >= 0) {
+    (void)fsync(dfd);
+    close(dfd);
+  }
+
+  g_snap.saved_ms = get_monotonic_msec();
+  fprintf(stderr, "snapshot: %llu keys, %llu bytes in %llu ms\n",
+          (unsigned long long)g_snap.nentries,
+          (unsigned long long)(off + 8),
+          (unsigned long long)(g_snap.saved_ms - g_snap.start_ms));
+}
+
+static void snap_loop() {
+  while (true) {
+    // wait for blocks, or for the next periodic snapshot
+    int timeout_ms = -1;
+    uint64_t now_ms = get_monotonic_msec();
+    if (g_snap.interval_s && g_snap.fd < 0) {
+      uint64_t next_ms = g_snap.saved_ms + g_snap.interval_s * 1000ull;
+      timeout_ms = next_ms > now_ms ? (int)(next_ms - now_ms) : 0;
+    }
+    struct pollfd pfd = {g_snap.wake_fd, POLLIN, 0};
+    int rv = poll(&pfd, 1, timeout_ms);
+    if (rv < 0 && errno != EINTR) {
+      die("snapshot: poll()");
+    }
+    if (rv > 0) {
+      // reset the eventfd before draining, so a push after this is not missed
+      uint64_t cnt = 0;
+      ssize_t err = read(g_snap.wake_fd, &cnt, sizeof(cnt));
+      (void)err;
+    }
+
+    now_ms = get_monotonic_msec();
+    bool due = g_snap.interval_s &&
+               now_ms >= g_snap.saved_ms + g_snap.interval_s * 1000ull;
+    if ((g_snap.save_req.exchange(false) || due) && g_snap.fd < 0) {
+      snap_start();
+      if (g_snap.fd < 0) {
+        g_snap.saved_ms = now_ms; // retry at the next interval
+      }
+    }
+
+    MNode *node = mq_pop_all(&g_snap.blocks);
+    while (node) {
+      SnapBlock *blk = (SnapBlock *)node; // the first member
+      node = node->next;
+      if (g_snap.fd >= 0 && !blk->walked) {
+        write_block(blk);
+      }
+      if (g_snap.fd >= 0 && blk->walked &&
+          ++g_snap.nwalked == g_snap.nwriters) {
+        snap_finish();
+      }
+      delete blk;
+    }
+  }
+}
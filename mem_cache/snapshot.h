@@ -0,0 +1,46 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+// proj
+#include "buffer.h"
+
+// point-in-time snapshots without fork(): every writer thread walks its
+// keys and serializes them, an entry about to change is dumped first;
+// a snapshot thread writes them to the file in checksummed blocks
+//
+// +--------+---------+---------+-----+-----+
+// | header | block 1 | block 2 | ... | end |
+// +--------+---------+---------+-----+-----+
+// header: "MCSNAP01", u32 no of writers
+// block:  u32 len, u32 crc32c, u32 writer, then `len` bytes of entries,
+//         each one is a u32 len and the bytes
+// end:    a block of writer ~0 holding the u64 no of entries
+
+// the snapshot file, `nwriters` threads take part in a snapshot;
+// also saved every `interval_s` seconds if not 0
+bool snap_init(const char *path, uint32_t nwriters, uint32_t interval_s);
+bool snap_enabled();
+// ask for a snapshot, it's started by the snapshot thread
+void snap_save();
+// true once per snapshot, when the writer should start walking its keys
+bool snap_begun(uint64_t *gen);
+// hand over the entries serialized by writer `id`, `data` is then empty
+void snap_append(uint32_t id, Buffer *data, uint32_t nentries);
+// the writer has walked all its keys
+void snap_walked(uint32_t id);
+
+// loading: the file is mapped once for all the writers, the entries passed
+// to `f` point into it and stay valid while it's referenced. The file
+// must not be truncated while mapped, the snapshot thread only renames.
+
+// map the snapshot file and take a reference, `nentries` is from the end
+// block. False if it's corrupt or cut short, true with no entries if it
+// doesn't exist.
+bool snap_open(uint64_t *nentries);
+// call `f` with each entry of the mapped file, false if a block is corrupt
+bool snap_load(void (*f)(const uint8_t *data, size_t len, void *arg),
+               void *arg);
+// references to the mapped file, it's unmapped when the last one goes
+void snap_hold(size_t n);
+void snap_release(size_t n);
@@ -0,0 +1,82 @@
+// check: recv with buffer selection picks from the registered buffer ring,
+// through a few wraps of the ring, without falling back to provided buffers
+// g++ -std=c++17 -O2 test_uring.cpp uring.cpp -o test_uring
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+// proj
+#include "uring.h"
+
+const uint16_t k_nbufs = 4;
+const uint32_t k_buf_size = 64;
+
+static void check(bool ok, const char *msg) {
+  if (!ok) {
+    fprintf(stderr, "FAIL: %s\n", msg);
+    exit(1);
+  }
+}
+
+int main() {
+  Uring ring;
+  int err = uring_init(&ring, 8, 16);
+  if (err) {
+    fprintf(stderr, "skip: io_uring_setup() = %d\n", err);
+    return 0;
+  }
+  UringBufRing bufs;
+  err = uring_buf_ring_init(&ring, &bufs, 0, k_nbufs, k_buf_size);
+  check(err == 0, "uring_buf_ring_init()");
+  if (bufs.legacy) {
+    fprintf(stderr, "skip: no registered buffer rings (before 5.19)\n");
+    return 0;
+  }
+
+  int fds[2];
+  check(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0, "socketpair()");
+
+  // every bid, including the last one, comes back several times
+  uint32_t seen = 0;
+  for (int i = 0; i < 4 * k_nbufs; i++) {
+    char out[32];
+    int len = snprintf(out, sizeof(out), "msg %d", i);
+    check(write(fds[1], out, (size_t)len) == len, "write()");
+
+    struct io_uring_sqe *sqe = uring_get_sqe(&ring);
+    check(sqe != NULL, "uring_get_sqe()");
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = fds[0];
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = bufs.bgid;
+    sqe->user_data = (uint64_t)i;
+    check(uring_submit(&ring, 1, 1000) == 0, "uring_submit()");
+
+    struct io_uring_cqe *cqe = uring_peek_cqe(&ring);
+    check(cqe != NULL, "no completion");
+    if (cqe->res < 0) {
+      fprintf(stderr, "FAIL: recv = %d\n", cqe->res);
+      return 1;
+    }
+    check(cqe->user_data == (uint64_t)i, "user_data");
+    check(cqe->res == len, "recv length");
+    check(cqe->flags & IORING_CQE_F_BUFFER, "no buffer selected");
+    uint16_t bid = (uint16_t)(cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+    check(bid < k_nbufs, "bid out of range");
+    check(memcmp(uring_buf(&bufs, bid), out, (size_t)len) == 0, "data");
+    uring_cqe_seen(&ring);
+
+    seen |= 1u << bid;
+    uring_buf_recycle(&bufs, bid);
+  }
+  check(seen == (1u << k_nbufs) - 1, "not every bid was used");
+
+  close(fds[0]);
+  close(fds[1]);
+  free(bufs.bufs);
+  printf("ok\n");
+  return 0;
+}
@@ -0,0 +1,273 @@
+#include "uring.h"
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+static void die(const char *msg) {
+  fprintf(stderr, "[%d] %s\n", errno, msg);
+  abort();
+}
+
+static int sys_setup(unsigned entries, struct io_uring_params *p) {
+  return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_enter(int fd, unsigned to_submit, unsigned min_complete,
+                     unsigned flags, void *arg, size_t argsz) {
+  return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags,
+                      arg, argsz);
+}
+
+static int sys_register(int fd, unsigned op, void *arg, unsigned nr_args) {
+  return (int)syscall(__NR_io_uring_register, fd, op, arg, nr_args);
+}
+
+static unsigned load_acquire(unsigned *p) {
+  return __atomic_load_n(p, __ATOMIC_ACQUIRE);
+}
+
+static void store_release(unsigned *p, unsigned v) {
+  __atomic_store_n(p, v, __ATOMIC_RELEASE);
+}
+
+// returns 0 or -errno
+int uring_init(Uring *ring, unsigned entries, unsigned cq_entries) {
+  struct io_uring_params p = {};
+  p.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SINGLE_ISSUER |
+            IORING_SETUP_COOP_TASKRUN;
+  p.cq_entries = cq_entries;
+  int fd = sys_setup(entries, &p);
+  if (fd < 0 && errno == EINVAL) {
+    // older kernels, retry without the optional flags
+    memset(&p, 0, sizeof(p));
+    p.flags = IORING_SETUP_CQSIZE;
+    p.cq_entries = cq_entries;
+    fd = sys_setup(entries, &p);
+  }
+  if (fd < 0) {
+    return -errno;
+  }
+
+  if (!(p.features & IORING_FEAT_SINGLE_MMAP) ||
+      !(p.features & IORING_FEAT_SUBMIT_STABLE) ||
+      !(p.features & IORING_FEAT_EXT_ARG)) {
+    close(fd);
+    return -ENOSYS; // too old to bother
+  }
+
+  ring->fd = fd;
+  ring->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  ring->cq_ring_size =
+      p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  if (ring->cq_ring_size > ring->sq_ring_size) {
+    ring->sq_ring_size = ring->cq_ring_size;
+  }
+
+  // the SQ and CQ rings share a single mapping
+  ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+  if (ring->sq_ring == MAP_FAILED) {
+    close(fd);
+    return -errno;
+  }
+  ring->cq_ring = ring->sq_ring;
+
+  ring->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+  ring->sqes = (struct io_uring_sqe *)mmap(
+      NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+      fd, IORING_OFF_SQES);
+  if (ring->sqes == MAP_FAILED) {
+    munmap(ring->sq_ring, ring->sq_ring_size);
+    close(fd);
+    return -errno;
+  }
+
+  uint8_t *sq = (uint8_t *)ring->sq_ring;
+  ring->sq_head = (unsigned *)(sq + p.sq_off.head);
+  ring->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+  ring->sq_mask = *(unsigned *)(sq + p.sq_off.ring_mask);
+  ring->sq_entries = p.sq_entries;
+  ring->sq_array = (unsigned *)(sq + p.sq_off.array);
+
+  uint8_t *cq = (uint8_t *)ring->cq_ring;
+  ring->cq_head = (unsigned *)(cq + p.cq_off.head);
+  ring->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+  ring->cq_mask = *(unsigned *)(cq + p.cq_off.ring_mask);
+  ring->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+  return 0;
+}
+
+// returns NULL if the SQ is full, submit and retry
+struct io_uring_sqe *uring_get_sqe(Uring *ring) {
+  unsigned head = load_acquire(ring->sq_head);
+  unsigned tail = *ring->sq_tail + ring->sq_pending;
+  if (tail - head >= ring->sq_entries) {
+    return NULL;
+  }
+
+  unsigned idx = tail & ring->sq_mask;
+  ring->sq_array[idx] = idx;
+  ring->sq_pending++;
+  struct io_uring_sqe *sqe = &ring->sqes[idx];
+  memset(sqe, 0, sizeof(*sqe));
+  return sqe;
+}
+
+// submit the prepared SQEs, and wait for at least `wait_nr` completions
+// up to `timeout_ms` (-1 for no limit); returns 0 or -errno
+int uring_submit(Uring *ring, unsigned wait_nr, int timeout_ms) {
+  unsigned submit = ring->sq_pending;
+  store_release(ring->sq_tail, *ring->sq_tail + submit);
+  ring->sq_pending = 0;
+
+  unsigned flags = wait_nr ? IORING_ENTER_GETEVENTS : 0;
+  struct __kernel_timespec ts = {};
+  struct io_uring_getevents_arg arg = {};
+  void *argp = NULL;
+  size_t argsz = 0;
+  if (wait_nr && timeout_ms >= 0) {
+    ts.tv_sec = timeout_ms / 1000;
+    ts.tv_nsec = (long long)(timeout_ms % 1000) * 1000000;
+    arg.ts = (uint64_t)(uintptr_t)&ts;
+    argp = &arg;
+    argsz = sizeof(arg);
+    flags |= IORING_ENTER_EXT_ARG;
+  }
+
+  if (!submit && !wait_nr) {
+    return 0;
+  }
+
+  int rv = sys_enter(ring->fd, submit, wait_nr, flags, argp, argsz);
+  if (rv < 0 && errno != ETIME && errno != EINTR && errno != EBUSY) {
+    return -errno;
+  }
+  return 0;
+}
+
+struct io_uring_cqe *uring_peek_cqe(Uring *ring) {
+  unsigned head = *ring->cq_head;
+  if (head == load_acquire(ring->cq_tail)) {
+    return NULL;
+  }
+  return &ring->cqes[head & ring->cq_mask];
+}
+
+void uring_cqe_seen(Uring *ring) {
+  store_release(ring->cq_head, *ring->cq_head + 1);
+}
+
+static struct io_uring_sqe *get_sqe_or_flush(Uring *ring) {
+  struct io_uring_sqe *sqe = uring_get_sqe(ring);
+  if (!sqe) {
+    (void)uring_submit(ring, 0, -1);
+    sqe = uring_get_sqe(ring);
+  }
+  return sqe;
+}
+
+static int buf_ring_register(Uring *ring, UringBufRing *bufs) {
+  size_t ring_size = bufs->nbufs * sizeof(struct io_uring_buf);
+  void *mem = mmap(NULL, ring_size, PROT_READ | PROT_WRITE,
+                   MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+  if (mem == MAP_FAILED) {
+    return -errno;
+  }
+
+  struct io_uring_buf_reg reg = {};
+  reg.ring_addr = (uint64_t)(uintptr_t)mem;
+  reg.ring_entries = bufs->nbufs;
+  reg.bgid = bufs->bgid;
+  if (sys_register(ring->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+    int err = errno;
+    munmap(mem, ring_size);
+    return -err;
+  }
+
+  bufs->br = (struct io_uring_buf_ring *)mem;
+  // hand all the buffers to the kernel
+  for (uint16_t bid = 0; bid < bufs->nbufs; ++bid) {
+    uring_buf_recycle(bufs, bid);
+  }
+
+  return 0;
+}
+
+// returns 0 or -errno
+int uring_buf_ring_init(Uring *ring, UringBufRing *bufs, uint16_t bgid,
+                        uint16_t nbufs, uint32_t buf_size) {
+  bufs->bufs = (uint8_t *)malloc((size_t)nbufs * buf_size);
+  if (!bufs->bufs) {
+    return -ENOMEM;
+  }
+  bufs->buf_size = buf_size;
+  bufs->nbufs = nbufs;
+  bufs->bgid = bgid;
+
+  if (buf_ring_register(ring, bufs) == 0) {
+    return 0;
+  }
+
+  // fall back to providing all the buffers with a single op
+  bufs->legacy = ring;
+  struct io_uring_sqe *sqe = get_sqe_or_flush(ring);
+  if (!sqe) {
+    return -EBUSY;
+  }
+  sqe->opcode = IORING_OP_PROVIDE_BUFFERS;
+  sqe->fd = nbufs;
+  sqe->addr = (uint64_t)(uintptr_t)bufs->bufs;
+  sqe->len = buf_size;
+  sqe->buf_group = bgid;
+  sqe->off = 0; // starting bid
+  int err = uring_submit(ring, 1, -1);
+  if (err) {
+    return err;
+  }
+
+  struct io_uring_cqe *cqe = uring_peek_cqe(ring);
+  int res = cqe ? cqe->res : -EIO;
+  if (cqe) {
+    uring_cqe_seen(ring);
+  }
+  return res < 0 ? res : 0;
+}
+
+uint8_t *uring_buf(UringBufRing *bufs, uint16_t bid) {
+  return bufs->bufs + (size_t)bid * bufs->buf_size;
+}
+
+// give a consumed buffer back to the kernel
+void uring_buf_recycle(UringBufRing *bufs, uint16_t bid) {
+  if (bufs->legacy) {
+    // goes out with the next submission, no completion unless it fails
+    struct io_uring_sqe *sqe = get_sqe_or_flush(bufs->legacy);
+    if (!sqe) {
+      die("io_uring_enter() for PROVIDE_BUFFERS");
+    }
+    sqe->opcode = IORING_OP_PROVIDE_BUFFERS;
+    sqe->flags = IOSQE_CQE_SKIP_SUCCESS;
+    sqe->fd = 1;
+    sqe->addr = (uint64_t)(uintptr_t)uring_buf(bufs, bid);
+    sqe->len = bufs->buf_size;
+    sqe->buf_group = bufs->bgid;
+    sqe->off = bid;
+    return;
+  }
+
+  struct io_uring_buf_ring *br = bufs->br;
+  uint16_t tail = br->tail;
+  // the header overlays entry 0 like in liburing; in C++ br->bufs is
+  // at offset 8, not 0, so don't index through it
+  struct io_uring_buf *buf =
+      (struct io_uring_buf *)br + (tail & (bufs->nbufs - 1));
+  buf->addr = (uint64_t)(uintptr_t)uring_buf(bufs, bid);
+  buf->len = bufs->buf_size;
+  buf->bid = bid;
+  __atomic_store_n(&br->tail, (uint16_t)(tail + 1), __ATOMIC_RELEASE);
+}
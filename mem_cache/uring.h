@@ -0,0 +1,52 @@
+#pragma once
+
+#include <linux/io_uring.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// a minimal io_uring wrapper over the raw syscalls
+struct Uring {
+  int fd = -1;
+  // submission queue
+  unsigned *sq_head = NULL;
+  unsigned *sq_tail = NULL;
+  unsigned *sq_array = NULL;
+  unsigned sq_mask = 0;
+  unsigned sq_entries = 0;
+  unsigned sq_pending = 0; // prepared but not yet submitted
+  struct io_uring_sqe *sqes = NULL;
+  // completion queue
+  unsigned *cq_head = NULL;
+  unsigned *cq_tail = NULL;
+  unsigned cq_mask = 0;
+  struct io_uring_cqe *cqes = NULL;
+  // mappings
+  void *sq_ring = NULL;
+  void *cq_ring = NULL;
+  size_t sq_ring_size = 0;
+  size_t cq_ring_size = 0;
+  size_t sqes_size = 0;
+};
+
+// a ring of equally sized buffers the kernel picks from for multishot recv
+struct UringBufRing {
+  struct io_uring_buf_ring *br = NULL;
+  uint8_t *bufs = NULL;
+  uint32_t buf_size = 0;
+  uint16_t nbufs = 0; // pow of 2
+  uint16_t bgid = 0;  // buffer group id
+  // buffers are handed back with IORING_OP_PROVIDE_BUFFERS instead,
+  // where registering a buffer ring fails (before 5.19)
+  Uring *legacy = NULL;
+};
+
+int uring_init(Uring *ring, unsigned entries, unsigned cq_entries);
+struct io_uring_sqe *uring_get_sqe(Uring *ring);
+int uring_submit(Uring *ring, unsigned wait_nr, int timeout_ms);
+struct io_uring_cqe *uring_peek_cqe(Uring *ring);
+void uring_cqe_seen(Uring *ring);
+
+int uring_buf_ring_init(Uring *ring, UringBufRing *bufs, uint16_t bgid,
+                        uint16_t nbufs, uint32_t buf_size);
+uint8_t *uring_buf(UringBufRing *bufs, uint16_t bid);
+void uring_buf_recycle(UringBufRing *bufs, uint16_t bid);
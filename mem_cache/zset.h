@@ -0,0 +1,32 @@
+#pragma once
+
+#include "avl.h"
+#include "hashtable.h"
+
+// sorted set, ordered by (score, name) in the tree,
+// and indexed by name in the hashtable
+struct ZSet {
+  AVLNode *root = NULL;
+  HMap hmap;
+};
+
+struct ZNode {
+  AVLNode tree;
+  HNode hmap;
+  double score = 0;
+  size_t len = 0;
+  char name[0]; // flexible array
+};
+
+// returns true if the name was added, false if its score was updated
+bool zset_insert(ZSet *zset, const char *name, size_t len, double score);
+ZNode *zset_lookup(ZSet *zset, const char *name, size_t len);
+void zset_delete(ZSet *zset, ZNode *node);
+// the first node >= (score, name)
+ZNode *zset_seekge(ZSet *zset, double score, const char *name, size_t len);
+// the node at a rank, NULL if out of range
+ZNode *zset_at(ZSet *zset, int64_t rank);
+size_t zset_size(ZSet *zset);
+void zset_clear(ZSet *zset);
+ZNode *znode_offset(ZNode *node, int64_t offset);
+int64_t znode_rank(ZNode *node);